@@ -13,6 +13,7 @@
 extern "C"
 {
 #include "kvm.h"
+#include "kvm_thread.h"
 }
 
 extern std::vector<std::string> history;
@@ -71,6 +72,12 @@ int main(int argc, char* args[])
     SDL_Event e;
 
     bool show_add_window = false;
+    bool use_jit = false;
+    kvm_context* kvm = kvm_context_create(); // The VM, kept around between runs so its settings stick.
+    kvm_thread* vm_thread = NULL; // Set while a program runs on its own thread.
+    SDL_Texture* vm_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, KVM_FRAME_WIDTH, KVM_FRAME_HEIGHT);
+    bool vm_display_focused = false; // Keys go to the VM while its display has focus.
+    int vm_mouse[3] = { -1, -1, -1 }; // Last mouse x, y, and buttons sent to the VM.
     bool show_text_input_window = false; // Track if input window is open
     //char input_text[MAX_BUF_SIZE] = ""; // Buffer for user input
     std::string displayed_text = ""; // Stores submitted text
@@ -88,6 +95,29 @@ int main(int argc, char* args[])
         {
             ImGui_ImplSDL2_ProcessEvent(&e);
             if (e.type == SDL_QUIT) { quit = true; }
+            if (vm_thread && vm_display_focused && (e.type == SDL_KEYDOWN || e.type == SDL_KEYUP) && !e.key.repeat)
+            {
+                kvm_queue_key(kvm, e.key.keysym.scancode, e.type == SDL_KEYDOWN);
+            }
+        }
+
+        // Show the VM's newest frame, and clean up after it once the program ends.
+        if (vm_thread)
+        {
+            // Check first, so a frame finished right before the program ended still gets shown.
+            bool vm_still_running = kvm_thread_is_running(vm_thread);
+
+            const uint32_t* pixels;
+            if (kvm_thread_get_frame(vm_thread, &pixels))
+            {
+                SDL_UpdateTexture(vm_texture, NULL, pixels, KVM_FRAME_WIDTH * sizeof(uint32_t));
+            }
+
+            if (!vm_still_running)
+            {
+                kvm_thread_stop(vm_thread);
+                vm_thread = NULL;
+            }
         }
 
         // Start ImGui frame
@@ -274,40 +304,23 @@ int main(int argc, char* args[])
                     }
                 }
 
-                // Set the temporary file name as "temp_code"
-                std::string temp_filename = "temp_code";  // No .txt extension
-                SDL_RWops* file_handle = SDL_RWFromFile((temp_filename+".txt").c_str(), "w");
-
-                if (file_handle)
+                // Start over if a program is still running.
+                if (vm_thread)
                 {
-                    // Write the sanitized code to the file
-                    Sint64 file_size = sanitized_text.size();
-                    SDL_RWwrite(file_handle, (sanitized_text).c_str(), 1, file_size);
-                    SDL_RWclose(file_handle);
-
-                    printf("Temporary file created: %s\n", temp_filename.c_str());
+                    kvm_thread_stop(vm_thread);
+                    vm_thread = NULL;
+                }
 
-                    // Initialize KVM
-                    if (kvm_init() != 0) {
-                        printf("KVM initialization failed.\n");
-                        return -1;
-                    }
+                // The VM is ours again, so this is the time to hand it the JIT setting.
+                kvm_set_jit_enabled(kvm, use_jit);
 
-                    // Now load the temporary file into KVM
-                    if (kvm_load_instructions(temp_filename.c_str()) != 0)
-                    {
-                        printf("Error loading instructions into KVM.\n");
-                    }
-                    else if (kvm_start(-1) != 0)
-                    {
-                        printf("Error starting KVM VM.\n");
-                    }
-                    kvm_quit(); 
-                }
-                else
+                // Assemble straight from the editor and run it on the VM's own thread.
+                vm_thread = kvm_thread_start(kvm, sanitized_text.c_str(), sanitized_text.size(), -1);
+                if (!vm_thread)
                 {
-                    printf("Error creating temporary file: %s\n", temp_filename.c_str());
+                    printf("Error starting KVM VM.\n");
                 }
+                vm_mouse[0] = vm_mouse[1] = vm_mouse[2] = -1;
             }
             else
             {
@@ -315,6 +328,10 @@ int main(int argc, char* args[])
             }
         }
 
+        // Compile hot code to native instructions while running.
+        // The VM belongs to its thread while a program runs, so the setting is only handed over at the next Execute.
+        ImGui::Checkbox("Use JIT", &use_jit);
+
          ImGui::EndChild();
         ImGui::NextColumn(); // Move to Right Box
 
@@ -344,6 +361,35 @@ int main(int argc, char* args[])
         ImGui::Columns(1); // Exit column mode
         ImGui::End();
 
+        // VM display, showing the last frame the program finished
+        ImGui::Begin("VM Display", nullptr, ImGuiWindowFlags_AlwaysAutoResize);
+        ImVec2 display_origin = ImGui::GetCursorScreenPos();
+        ImGui::Image((ImTextureID)(intptr_t)vm_texture, ImVec2(KVM_FRAME_WIDTH * 2, KVM_FRAME_HEIGHT * 2));
+        vm_display_focused = ImGui::IsWindowFocused();
+
+        if (vm_thread && ImGui::IsItemHovered())
+        {
+            // The display is drawn at twice the VM's resolution.
+            ImGuiIO& io = ImGui::GetIO();
+            int mouse[3] = {
+                (int)((io.MousePos.x - display_origin.x) / 2),
+                (int)((io.MousePos.y - display_origin.y) / 2),
+                (io.MouseDown[0] ? SDL_BUTTON_LMASK : 0) | (io.MouseDown[1] ? SDL_BUTTON_RMASK : 0) | (io.MouseDown[2] ? SDL_BUTTON_MMASK : 0)
+            };
+
+            // Only send changes, so the queue doesn't fill up while the program isn't reading the mouse.
+            if (mouse[0] != vm_mouse[0] || mouse[1] != vm_mouse[1] || mouse[2] != vm_mouse[2])
+            {
+                if (kvm_queue_mouse(kvm, mouse[0], mouse[1], mouse[2]))
+                {
+                    vm_mouse[0] = mouse[0];
+                    vm_mouse[1] = mouse[1];
+                    vm_mouse[2] = mouse[2];
+                }
+            }
+        }
+        ImGui::End();
+
         
         // Rendering
         ImGui::Render();
@@ -356,6 +402,10 @@ int main(int argc, char* args[])
         SDL_RenderPresent(renderer);
     }
   
+    kvm_thread_stop(vm_thread);
+    SDL_DestroyTexture(vm_texture);
+    kvm_context_free(kvm);
+
     // Cleanup ImGui
     ImGui_ImplSDLRenderer2_Shutdown();
     ImGui_ImplSDL2_Shutdown();
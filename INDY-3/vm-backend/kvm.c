@@ -13,6 +13,9 @@
 
 #include "kvm_input.h"
 #include "kvm_gpu.h"
+#include "kvm_assembler.h"
+#include "kvm_cache.h"
+#include "kvm_graphics_loader.h"
 
 #include "kvm_mem_map_constants.h"
 
@@ -28,6 +31,8 @@
 #define SYSCALL_LOAD_PALETTES 2
 #define SYSCALL_LOAD_GRAPHICS 3
 #define SYSCALL_SET_CYCLE_MAX 4
+#define SYSCALL_LOAD_PALETTES_ASYNC 5
+#define SYSCALL_LOAD_GRAPHICS_ASYNC 6
 
 #define SYSCALL_SET_TIMER 10
 #define SYSCALL_START_TIMER 11
@@ -39,25 +44,150 @@
 #define SYSCALL_GET_MOUSE_INPUT 51
 #define SYSCALL_GET_CONTROLLER_INPUT 52
 
+#define SYSCALL_MEM_COPY 20
+#define SYSCALL_MEM_FILL 21
+#define SYSCALL_MEM_FILL_STRIDED 22
+
 #define SYSCALL_GPU_REFRESH 100
 
-kvm_memory* mem;
-kvm_cpu* cpu;
+// Arguments of the memory syscalls, little endian in zero page.
+#define SYSCALL_ARG_DEST 1		// Destination address (same bytes as the usual syscall address).
+#define SYSCALL_ARG_SOURCE 3	// Source address for copies, the fill value (one byte) for fills.
+#define SYSCALL_ARG_LENGTH 5	// Number of bytes to copy or fill.
+#define SYSCALL_ARG_STRIDE 7	// Distance between filled bytes for strided fills (one byte).
+
+// Arguments of the async graphics syscalls. The file name goes in the usual syscall address.
+#define SYSCALL_ARG_STATUS 3	// Address of the byte the load reports back to.
+
+// What an async graphics load writes to its status byte.
+#define GRAPHICS_LOAD_DONE 0x00
+#define GRAPHICS_LOAD_PENDING 0x01
+#define GRAPHICS_LOAD_FAILED 0xFF
+
+// Most instructions to run between syscall checks when there's no cycle limit.
+#define RUN_BATCH_SIZE 0x100000
+
+// Longest a delay syscall sleeps before checking whether it's been interrupted, in milliseconds.
+#define DELAY_SLICE_MS 10
+
+// A graphics load running on a thread of its own. It's only copied into memory once a frame has been drawn.
+typedef struct graphics_job {
+	SDL_Thread* thread;
+	SDL_atomic_t done;
+
+	char filename[50];
+	bool is_palette;
+	uint16_t status_address;
+
+	// Written by the loading thread, read once done is set.
+	int result;
+	uint8_t data[KVM_TILE_DATA_SIZE];
+} graphics_job;
+
+typedef struct syscall_entry {
+	kvm_syscall_handler handler;
+	void* userdata;
+	kvm_syscall_stats stats;
+} syscall_entry;
+
+// Everything one VM needs. Nothing in here is shared with other VMs.
+struct kvm_context {
+	kvm_memory* mem;
+	kvm_cpu* cpu;
+	kvm_gpu* gpu;
+	kvm_input* input;
+
+	bool is_running;
+
+	// Progress of the current program, reset by kvm_init().
+	size_t cycle_count;
+	int max_cycles;
+	kvm_run_status run_status;	// Once the program quits or hits the cycle limit, this stays put.
+
+	// Settings, which carry over from one kvm_init() to the next.
+	bool jit_enabled;
+	bool headless;
+	bool skip_delays;
+	bool vsync;
+	bool integer_scale;
+
+	// Remembers the last program's lines, so loading it again after an edit only assembles what changed.
+	kvm_assembler_cache* assembler_cache;
+
+	// Async graphics loads in progress, one for tiles and one for palettes. NULL if there isn't one.
+	graphics_job* graphics_jobs[2];
+
+	syscall_entry syscall_table[KVM_SYSCALL_COUNT];
+
+	#pragma region Timer Variables
+	uint64_t sdl_timer_start_time;
+	uint64_t sdl_timer_current_time;
+	uint16_t kvm_timer;
+
+	// Skipped delays still move the timer forward, as if they happened.
+	uint64_t skipped_delay_time;
+
+	// Set from another thread by kvm_interrupt_delays(), cleared by kvm_init().
+	SDL_atomic_t delays_interrupted;
+	#pragma endregion
+};
+
+static void register_builtin_syscalls(kvm_context* kvm);
+
+kvm_context* kvm_context_create(void) {
+	kvm_context* kvm = malloc(sizeof(kvm_context));
+	memset(kvm, 0, sizeof(kvm_context));
+
+	kvm->input = kvm_input_init();
+
+	return kvm;
+}
+
+void kvm_context_free(kvm_context* kvm) {
+	if (!kvm) return;
+
+	kvm_quit(kvm);
+	kvm_input_free(kvm->input);
+	kvm_assembler_cache_free(kvm->assembler_cache);
+	free(kvm);
+}
+
+int kvm_init(kvm_context* kvm) {
+	if (!kvm) return -1;
+
+	kvm->mem = kvm_memory_init(0xFFFF, 0);
+	kvm->cpu = kvm_cpu_init();
+
+	if (!kvm->cpu || !kvm->mem) return -1;
 
-bool is_running = false;
+	kvm_set_jit_enabled(kvm, kvm->jit_enabled);
+	register_builtin_syscalls(kvm);
 
-int kvm_init(void) {
-	mem = kvm_memory_init(0xFFFF, 0);
-	cpu = kvm_cpu_init();
+	kvm->sdl_timer_start_time = 0;
+	kvm->sdl_timer_current_time = 0;
+	kvm->kvm_timer = 0;
+	kvm->skipped_delay_time = 0;
+	SDL_AtomicSet(&kvm->delays_interrupted, 0);
 
-	if (!cpu || !mem) return -1;
+	kvm->cycle_count = 0;
+	kvm->max_cycles = 0;
+	kvm->run_status = kvm_run_budget;
 	
-	if (SDL_Init(SDL_INIT_EVERYTHING) != 0) {
+	// Headless runs don't need any SDL subsystem (surfaces and timers work without one).
+	// SDL_Init() isn't thread safe, so skipping it also lets headless VMs be started from worker threads.
+	if (!kvm->headless && SDL_Init(SDL_INIT_EVERYTHING) != 0) {
 		printf("Error with SDL initialization.\n");
 		return -2;
 	}
 
-	kvm_gpu_init(mem);
+	kvm->gpu = kvm_gpu_init(kvm->mem, kvm->headless);
+	if (!kvm->gpu) return -3;
+	if (kvm->vsync) kvm_gpu_set_vsync(kvm->gpu, true);
+	kvm_gpu_set_integer_scale(kvm->gpu, kvm->integer_scale);
+
+	kvm_input_set_headless(kvm->input, kvm->headless);
+
+	kvm->is_running = true;
 	
 	return 0;
 }
@@ -72,7 +202,7 @@ static size_t file_get_size(FILE* file) {
 }
 
 // Takes a binary file of bytes and puts them in a specififed memory location
-static int load_binary_file_to_memory(const char* filename, size_t offset) {
+static int load_binary_file_to_memory(kvm_memory* mem, const char* filename, size_t offset) {
 	FILE* code_file = fopen(filename, "rb"); // open the file to read bytes
 	if (!code_file) {
 		printf("Error opening binary file %s.\n", filename);
@@ -84,122 +214,240 @@ static int load_binary_file_to_memory(const char* filename, size_t offset) {
 	// Copy the data into memory
 	if (file_size > mem->size - offset) {
 		printf("Error loading ROM, file size of %d exceeds memory capacity %d.\n", (int)file_size, (int)(mem->size - offset));
+		fclose(code_file);
 		return -1;
 	}
 
 	fread(mem->data + offset, 1, file_size, code_file);
 	fclose(code_file);
 
+	// Anything cached from the old contents is stale now.
+	kvm_memory_notify_write(mem, offset, file_size);
+
 	return 0;
 }
 
-int kvm_load_instructions(const char* filename) {
-	if (!cpu || !mem) return -1;
-
-	char sys_string[256]; // Increased buffer size to prevent overflow
-	char prog_count_str[20];
+// Load a converted file from the build cache, straight into memory. Returns true on a hit.
+static bool load_cached_to_memory(kvm_memory* mem, kvm_cache_key key, const char* extension, size_t offset) {
+	size_t size;
+	if (!kvm_cache_read(key, extension, mem->data + offset, mem->size - offset, &size)) return false;
 
-	snprintf(prog_count_str, sizeof(prog_count_str), "%d", INSTRUCTION_ROM_MEM_LOC);
+	kvm_memory_notify_write(mem, offset, size);
+	return true;
+}
 
-	// Ensure we do not append `.txt` if it's already there
-	if (strstr(filename, ".txt") == NULL) {
-		snprintf(sys_string, sizeof(sys_string), "python assembler.py %s.txt %s", filename, prog_count_str);
-	}
-	else {
-		snprintf(sys_string, sizeof(sys_string), "python assembler.py %s %s", filename, prog_count_str);
+// Put an assembled program in ROM.
+static int load_assembly(kvm_context* kvm, const kvm_assembly* assembly) {
+	kvm_memory* mem = kvm->mem;
+	if (assembly->size > mem->size - INSTRUCTION_ROM_MEM_LOC) {
+		printf("Error loading ROM, program size of %d exceeds memory capacity %d.\n", (int)assembly->size, (int)(mem->size - INSTRUCTION_ROM_MEM_LOC));
+		return -1;
 	}
 
-	printf("Executing: %s\n", sys_string); // Debug output
+	memcpy(mem->data + INSTRUCTION_ROM_MEM_LOC, assembly->bytes, assembly->size);
+	kvm_memory_notify_write(mem, INSTRUCTION_ROM_MEM_LOC, assembly->size);
+	return 0;
+}
+
+static kvm_assembler_cache* get_assembler_cache(kvm_context* kvm) {
+	if (!kvm->assembler_cache) kvm->assembler_cache = kvm_assembler_cache_create(INSTRUCTION_ROM_MEM_LOC);
+	return kvm->assembler_cache;
+}
 
-	// Run the Python script
-	if (system(sys_string)) return -1;
+int kvm_load_instructions(kvm_context* kvm, const char* filename) {
+	if (!kvm || !kvm->cpu || !kvm->mem) return -1;
 
-		
-	// Extract the base filename from the full path (correct handling)
-	const char* base_filename = strrchr(filename, '\\');
-	if (base_filename) {
-		base_filename++;  // Skip the '\\' itself
+	// Ensure we do not append `.txt` if it's already there
+	char source_filename[256];
+	if (strstr(filename, ".txt") == NULL) {
+		snprintf(source_filename, sizeof(source_filename), "%s.txt", filename);
 	}
 	else {
-		base_filename = filename;  // If no path, use the whole filename
+		snprintf(source_filename, sizeof(source_filename), "%s", filename);
 	}
 
-	// Now remove the ".txt" extension, if it exists
-	char out_file_name[256];
-	const char* dot_pos = strrchr(base_filename, '.');
-	if (dot_pos) {
-		snprintf(out_file_name, sizeof(out_file_name), "outs/%.*s.kvmbin", (int)(dot_pos - base_filename), base_filename);
+	FILE* source_file = fopen(source_filename, "rb");
+	if (!source_file) {
+		printf("Error opening source file %s.\n", source_filename);
+		return -1;
 	}
-	else {
-		snprintf(out_file_name, sizeof(out_file_name), "outs/%s.kvmbin", base_filename);
+
+	size_t file_size = file_get_size(source_file);
+	char* source = malloc(file_size + 1);
+	size_t source_length = fread(source, 1, file_size, source_file);
+	fclose(source_file);
+
+	// The same source always assembles to the same program, so it only needs assembling once.
+	uint64_t version = KVM_ASSEMBLER_VERSION;
+	kvm_cache_key key = kvm_cache_hash(kvm_cache_hash(KVM_CACHE_HASH_START, &version, sizeof(version)), source, source_length);
+	if (load_cached_to_memory(kvm->mem, key, "kvmbin", INSTRUCTION_ROM_MEM_LOC)) {
+		free(source);
+		return 0;
 	}
 
-	printf("Binary file name: %s\n", out_file_name); // Debug output
+	kvm_assembly assembly;
+	int result = kvm_assemble_cached(get_assembler_cache(kvm), source, source_length, &assembly);
+	free(source);
+	if (result != 0) return -1;
+
+	result = load_assembly(kvm, &assembly);
+	if (result == 0) kvm_cache_write(key, "kvmbin", assembly.bytes, assembly.size);
+
+	kvm_assembly_free(&assembly);
+	return result;
+}
+
+int kvm_load_source(kvm_context* kvm, const char* source, size_t length) {
+	if (!kvm || !kvm->cpu || !kvm->mem) return -1;
+
+	kvm_assembly assembly;
+	if (kvm_assemble_cached(get_assembler_cache(kvm), source, length, &assembly) != 0) return -1;
+
+	int result = load_assembly(kvm, &assembly);
+	kvm_assembly_free(&assembly);
+	return result;
+}
+
+int kvm_load_binary(kvm_context* kvm, const char* filename) {
+	if (!kvm || !kvm->cpu || !kvm->mem) return -1;
+
+	return load_binary_file_to_memory(kvm->mem, filename, INSTRUCTION_ROM_MEM_LOC);
+}
+
+// Decodes graphics/<name>.bmp and converts it into tiles (KVM_TILE_DATA_SIZE bytes) or palettes (KVM_PALETTE_DATA_SIZE bytes).
+static int convert_graphics_file(const char* name, bool is_palette, uint8_t* out) {
+	char bitmap_filename[100];
+	snprintf(bitmap_filename, sizeof(bitmap_filename), "graphics/%s.bmp", name);
+
+	kvm_bitmap bitmap;
+	if (kvm_bitmap_load(bitmap_filename, &bitmap) != 0) return -1;
 
+	int result = is_palette ? kvm_convert_palettes(&bitmap, out) : kvm_convert_tiles(&bitmap, out);
+	kvm_bitmap_free(&bitmap);
 
-	int load_result = load_binary_file_to_memory(out_file_name, INSTRUCTION_ROM_MEM_LOC);
-	if (load_result != 0) return -1;
+	return result;
+}
+
+static size_t graphics_offset(bool is_palette) {
+	return is_palette ? VRAM_COLOR_PALETTES : GRAPHICS_ROM_MEM_LOC;
+}
+
+static size_t graphics_size(bool is_palette) {
+	return is_palette ? KVM_PALETTE_DATA_SIZE : KVM_TILE_DATA_SIZE;
+}
+
+static void cancel_graphics_job(kvm_context* kvm, bool is_palette);
+
+static int load_graphics_file(kvm_context* kvm, const char* name, bool is_palette) {
+	// A sync load replaces whatever an async one was going to put there.
+	cancel_graphics_job(kvm, is_palette);
+
+	size_t offset = graphics_offset(is_palette);
+	if (convert_graphics_file(name, is_palette, kvm->mem->data + offset) != 0) return -1;
 
+	kvm_memory_notify_write(kvm->mem, offset, graphics_size(is_palette));
 	return 0;
 }
 
+// Loads the graphics and puts the data in their proper ROM spots, the same way graphics_loader.py would.
+int kvm_load_graphics(kvm_context* kvm, const char* tile_filename, const char* palette_filename) {
+	if (!kvm || !kvm->cpu || !kvm->mem) return -1;
 
+	if (tile_filename && load_graphics_file(kvm, tile_filename, false) != 0) return -1;
+	if (palette_filename && load_graphics_file(kvm, palette_filename, true) != 0) return -1;
 
-// Runs the python scripts to load in the graphics, then puts the data in their proper ROM spots.
-int kvm_load_graphics(const char* tile_filename, const char* palette_filename) {
-	if (!cpu || !mem) return -1;
+	return 0;
+}
 
-	char sys_string[100] = "python graphics_loader.py ";
+#pragma region Async Graphics
 
-	char t_fname[50] = "-1";
-	if (tile_filename) {
-		strncpy(t_fname, tile_filename, 50);
-		t_fname[49] = 0;
-	}
+static int graphics_job_main(void* data) {
+	graphics_job* job = (graphics_job*)data;
 
-	char p_fname[50] = "-1";
-	if (palette_filename) {
-		strncpy(p_fname, palette_filename, 50);
-		p_fname[49] = 0;
-	}
+	job->result = convert_graphics_file(job->filename, job->is_palette, job->data);
 
-	printf("t: %s\np: %s\n", t_fname, p_fname);
+	// The data has to land before the VM thread sees the job as done.
+	SDL_MemoryBarrierRelease();
+	SDL_AtomicSet(&job->done, 1);
+	return 0;
+}
 
-	strcat(sys_string, t_fname);
-	strcat(sys_string, " ");
-	strcat(sys_string, p_fname);
-	if (strnlen(sys_string, 100) == 100) {
-		printf("Error with strings.\n");
-		return -1;
+static void free_graphics_job(kvm_context* kvm, bool is_palette) {
+	graphics_job* job = kvm->graphics_jobs[is_palette];
+	kvm->graphics_jobs[is_palette] = NULL;
+
+	if (job->thread) SDL_WaitThread(job->thread, NULL);
+	free(job);
+}
+
+// Start loading graphics on another thread. The status byte says pending until the result is copied in after a later frame.
+// Returns false if a load of the same kind is already going, or the thread couldn't be made.
+static bool start_graphics_job(kvm_context* kvm, const char* name, bool is_palette, uint16_t status_address) {
+	if (kvm->graphics_jobs[is_palette]) return false;
+
+	graphics_job* job = malloc(sizeof(graphics_job));
+	memset(job, 0, sizeof(graphics_job));
+	snprintf(job->filename, sizeof(job->filename), "%s", name);
+	job->is_palette = is_palette;
+	job->status_address = status_address;
+	SDL_AtomicSet(&job->done, 0);
+
+	job->thread = SDL_CreateThread(graphics_job_main, "kvm_graphics_load", job);
+	if (!job->thread) {
+		printf("Error creating graphics loading thread: %s\n", SDL_GetError());
+		free(job);
+		return false;
 	}
 
-	// Run the python script.
-	if (system(sys_string)) return -1;
+	kvm->graphics_jobs[is_palette] = job;
+	kvm_memory_write_byte(kvm->mem, status_address, GRAPHICS_LOAD_PENDING);
+	return true;
+}
 
-	if (tile_filename) {
-		char out_tile_filename[100] = "graphics/out/";
-		strcat(out_tile_filename, tile_filename);
-		strcat(out_tile_filename, ".kvmpix");
+// Drop a load that hasn't been copied in yet. Its status byte reports a failure.
+static void cancel_graphics_job(kvm_context* kvm, bool is_palette) {
+	graphics_job* job = kvm->graphics_jobs[is_palette];
+	if (!job) return;
 
-		printf("binary file name: %s\n", out_tile_filename);
+	if (kvm->mem) kvm_memory_write_byte(kvm->mem, job->status_address, GRAPHICS_LOAD_FAILED);
+	free_graphics_job(kvm, is_palette);
+}
 
-		if (load_binary_file_to_memory(out_tile_filename, GRAPHICS_ROM_MEM_LOC) != 0) return -1;
-	}
-	
-	if (palette_filename) {
-		char out_palette_filename[100] = "graphics/out/";
-		strcat(out_palette_filename, palette_filename);
-		strcat(out_palette_filename, ".kvmpal");
+// Called right after a frame is drawn. Finished loads are copied in all at once, so no frame ever shows half of the old graphics and half of the new.
+// When delays are skipped the VM isn't running in real time anyway, so it waits for the loads, which keeps runs repeatable.
+static void apply_graphics_jobs(kvm_context* kvm) {
+	for (int is_palette = 0; is_palette < 2; is_palette++) {
+		graphics_job* job = kvm->graphics_jobs[is_palette];
+		if (!job) continue;
 
-		if (load_binary_file_to_memory(out_palette_filename, VRAM_COLOR_PALETTES) != 0) return -1;
-	}
-	
+		if (kvm->skip_delays) {
+			SDL_WaitThread(job->thread, NULL);
+			job->thread = NULL;
+		}
+		else if (!SDL_AtomicGet(&job->done)) {
+			continue;
+		}
+		SDL_MemoryBarrierAcquire();
 
-	return 0;
+		if (job->result == 0) {
+			size_t offset = graphics_offset(is_palette);
+			size_t size = graphics_size(is_palette);
+			memcpy(kvm->mem->data + offset, job->data, size);
+			kvm_memory_notify_write(kvm->mem, offset, size);
+		}
+		else {
+			printf("Failed to load graphics file %s.\n", job->filename);
+		}
+		kvm_memory_write_byte(kvm->mem, job->status_address, job->result == 0 ? GRAPHICS_LOAD_DONE : GRAPHICS_LOAD_FAILED);
+
+		free_graphics_job(kvm, is_palette);
+	}
 }
 
+#pragma endregion
+
 // Gets a character string from KVM memory.
-static uint16_t load_string(char* str, uint16_t start_location, uint16_t max_len) {
+static uint16_t load_string(kvm_memory* mem, char* str, uint16_t start_location, uint16_t max_len) {
 	bool null_terminated = false;
 
 	uint16_t end_point = start_location + max_len;
@@ -223,170 +471,499 @@ static uint16_t load_string(char* str, uint16_t start_location, uint16_t max_len
 	return end_point;
 }
 
-int kvm_start(int max_cycles) {
-	if (!cpu || !mem) return -1;
+#pragma region Syscall Handlers
 
+static uint16_t get_syscall_arg16(const kvm_syscall_context* context, int arg) {
+	return context->memory[arg] | ((uint16_t)context->memory[arg + 1] << 8);
+}
 
-	// Cpu cycle until system calls happen.
-	size_t cycle_count = 0;
+static uint64_t get_timer_ticks(kvm_context* kvm) {
+	return SDL_GetTicks64() + kvm->skipped_delay_time;
+}
 
-	#pragma region Timer Variables
-	uint64_t sdl_timer_start_time = 0;
-	uint64_t sdl_timer_current_time = 0;
-	uint16_t kvm_timer = 0;
-	#pragma endregion
+static void syscall_quit(kvm_syscall_context* context) {
+	context->quit = true;
+}
+
+static void syscall_print_cpu(kvm_syscall_context* context) {
+	printf("\n");
+	kvm_cpu_print_status(context->kvm->cpu);
+}
 
-	bool cpu_running = true;
-	while (cpu_running) {
-		kvm_cpu_cycle(cpu, mem);
+static void syscall_printf(kvm_syscall_context* context) {
+	kvm_memory* mem = context->kvm->mem;
 
-		// Test for system calls.
-		if (mem->data[0] > 0) {
+	char* print_string = malloc(256);
+	uint16_t str_end_pt = load_string(mem, print_string, context->address, 256);
+	uint8_t bytes_to_print = kvm_memory_get_byte(mem, str_end_pt);
+	printf("%s ", print_string);
+
+	for (int i = 0; i < bytes_to_print; i++) {
+		printf("%x ", kvm_memory_get_byte(mem, str_end_pt + i + 1));
+	}
+	printf("\n");
+
+	free(print_string);
+}
+
+static void syscall_load_palettes(kvm_syscall_context* context) {
+	char* graphics_fname = malloc(50);
+	load_string(context->kvm->mem, graphics_fname, context->address, 50);
+
+	int graphics_result = kvm_load_graphics(context->kvm, NULL, graphics_fname);
+	if (graphics_result != 0) {
+		printf("Failed to load graphics file %s.\n", graphics_fname);
+		context->memory[1] = 0xFF; // FF for "Freakin' Failure"
+	}
+	else {
+		context->memory[1] = 0x00; // 0 for success.
+	}
+
+	free(graphics_fname);
+}
+
+static void syscall_load_graphics(kvm_syscall_context* context) {
+	char* graphics_fname = malloc(50);
+	load_string(context->kvm->mem, graphics_fname, context->address, 50);
+
+	int graphics_result = kvm_load_graphics(context->kvm, graphics_fname, NULL);
+	if (graphics_result != 0) {
+		printf("Failed to load graphics file %s.\n", graphics_fname);
+		context->memory[1] = 0xFF; // FF for "Freakin' Failure"
+	}
+	else {
+		context->memory[1] = 0x00; // 0 for success.
+	}
+
+	free(graphics_fname);
+}
+
+// Async versions of the two above. The file name is at the syscall address, and the status address is in bytes 3 and 4.
+// Byte 1 gets 0 if the load started, FF if it couldn't (a load of the same kind is still going, or the status address is 0).
+// The status byte stays 01 until the load is copied in after a frame is drawn, then it turns 0, or FF if the load failed.
+static void start_async_graphics_load(kvm_syscall_context* context, bool is_palette) {
+	char graphics_fname[50];
+	load_string(context->kvm->mem, graphics_fname, context->address, sizeof(graphics_fname));
+
+	uint16_t status_address = get_syscall_arg16(context, SYSCALL_ARG_STATUS);
+	bool started = status_address != KVM_MEMORY_SYSCALL_ADDRESS && start_graphics_job(context->kvm, graphics_fname, is_palette, status_address);
+	context->memory[1] = started ? 0x00 : 0xFF;
+}
+
+static void syscall_load_palettes_async(kvm_syscall_context* context) {
+	start_async_graphics_load(context, true);
+}
 
+static void syscall_load_graphics_async(kvm_syscall_context* context) {
+	start_async_graphics_load(context, false);
+}
+
+static void syscall_set_cycle_max(kvm_syscall_context* context) {
+	// Set the max number of cpu cycles to go, using the uint16 stored in the second two bytes of memory.
+	context->max_cycles = context->address;
+}
+
+static void syscall_start_timer(kvm_syscall_context* context) {
+	kvm_context* kvm = context->kvm;
+	kvm->kvm_timer = 0;
+	kvm->sdl_timer_start_time = get_timer_ticks(kvm);
+}
+
+static void syscall_stop_timer(kvm_syscall_context* context) {
+	kvm_context* kvm = context->kvm;
+	kvm->sdl_timer_current_time = get_timer_ticks(kvm) - kvm->sdl_timer_start_time;
+}
+
+static void syscall_get_timer(kvm_syscall_context* context) {
+	kvm_context* kvm = context->kvm;
+	kvm->sdl_timer_current_time = get_timer_ticks(kvm) - kvm->sdl_timer_start_time;
+	kvm->kvm_timer = (uint16_t)(kvm->sdl_timer_current_time % 0xFFFF);
+	context->memory[1] = (uint8_t)(kvm->kvm_timer & 0xFF);
+	context->memory[2] = (uint8_t)(kvm->kvm_timer >> 8) & 0xFF;
+}
+
+static void syscall_delay(kvm_syscall_context* context) {
+	if (context->kvm->skip_delays) {
+		context->kvm->skipped_delay_time += context->address;
+	}
+	else {
+		// Sleep in short pieces, so a VM on its own thread can be stopped partway through a long delay.
+		uint64_t end_time = SDL_GetTicks64() + context->address;
+		while (!SDL_AtomicGet(&context->kvm->delays_interrupted)) {
+			uint64_t now = SDL_GetTicks64();
+			if (now >= end_time) break;
+
+			uint64_t remaining = end_time - now;
+			SDL_Delay((uint32_t)(remaining < DELAY_SLICE_MS ? remaining : DELAY_SLICE_MS));
+		}
+	}
+}
+
+static void syscall_get_key_input(kvm_syscall_context* context) {
+	kvm_input_get_keyboard(context->kvm->input, context->kvm->mem);
+}
+
+static void syscall_get_mouse_input(kvm_syscall_context* context) {
+	kvm_input_get_mouse(context->kvm->input, context->kvm->mem);
+}
+
+// Bounds check for the memory syscalls. Writes the result to byte 1, 0 for success and FF for failure.
+static bool check_syscall_range(kvm_syscall_context* context, size_t address, size_t length) {
+	bool in_bounds = address + length <= context->memory_size;
+	if (!in_bounds) printf("Memory syscall %d out of bounds: %x + %x.\n", context->id, (int)address, (int)length);
+
+	context->memory[1] = in_bounds ? 0x00 : 0xFF;
+	return in_bounds;
+}
+
+static void syscall_mem_copy(kvm_syscall_context* context) {
+	size_t dest = get_syscall_arg16(context, SYSCALL_ARG_DEST);
+	size_t source = get_syscall_arg16(context, SYSCALL_ARG_SOURCE);
+	size_t length = get_syscall_arg16(context, SYSCALL_ARG_LENGTH);
+
+	if (!check_syscall_range(context, dest, length) || !check_syscall_range(context, source, length)) return;
+
+	memmove(context->memory + dest, context->memory + source, length);
+	kvm_notify_memory_write(context->kvm, dest, length);
+}
+
+static void syscall_mem_fill(kvm_syscall_context* context) {
+	size_t dest = get_syscall_arg16(context, SYSCALL_ARG_DEST);
+	uint8_t value = context->memory[SYSCALL_ARG_SOURCE];
+	size_t length = get_syscall_arg16(context, SYSCALL_ARG_LENGTH);
+
+	if (!check_syscall_range(context, dest, length)) return;
+
+	memset(context->memory + dest, value, length);
+	kvm_notify_memory_write(context->kvm, dest, length);
+}
+
+// Fill every stride'th byte, length times. Handy for one column of the tile map, or one field of a table of structs.
+static void syscall_mem_fill_strided(kvm_syscall_context* context) {
+	size_t dest = get_syscall_arg16(context, SYSCALL_ARG_DEST);
+	uint8_t value = context->memory[SYSCALL_ARG_SOURCE];
+	size_t count = get_syscall_arg16(context, SYSCALL_ARG_LENGTH);
+	size_t stride = context->memory[SYSCALL_ARG_STRIDE];
+
+	if (count == 0) {
+		check_syscall_range(context, dest, 0);
+		return;
+	}
+	if (stride == 0) {
+		printf("Strided fill with a stride of 0.\n");
+		context->memory[1] = 0xFF;
+		return;
+	}
+
+	size_t span = (count - 1) * stride + 1;
+	if (!check_syscall_range(context, dest, span)) return;
+
+	if (stride == 1) {
+		memset(context->memory + dest, value, count);
+	}
+	else {
+		for (size_t i = 0; i < count; i++) {
+			context->memory[dest + i * stride] = value;
+		}
+	}
+	kvm_notify_memory_write(context->kvm, dest, span);
+}
+
+static void syscall_gpu_refresh(kvm_syscall_context* context) {
+	kvm_context* kvm = context->kvm;
+	kvm_gpu_refresh_graphics(kvm->gpu, kvm->mem);
+	kvm_input_set_frame(kvm->input, kvm_gpu_get_frame_count(kvm->gpu));
+	apply_graphics_jobs(kvm);
+}
+
+static void syscall_print_mem_page(kvm_syscall_context* context) {
+	// Print one page of memory starting at the specified address.
+	kvm_memory_print_hexdump(context->kvm->mem, context->address, 256);
+}
+
+// Fill in the built-in syscalls, leaving alone any ID the embedder already registered.
+static void register_builtin_syscalls(kvm_context* kvm) {
+	static const struct { uint8_t id; kvm_syscall_handler handler; } builtins[] = {
+		{ SYSCALL_QUIT, syscall_quit },
+		{ SYSCALL_PRINTCPU, syscall_print_cpu },
+		{ SYSCALL_PRINTF, syscall_printf },
+		{ SYSCALL_LOAD_PALETTES, syscall_load_palettes },
+		{ SYSCALL_LOAD_GRAPHICS, syscall_load_graphics },
+		{ SYSCALL_LOAD_PALETTES_ASYNC, syscall_load_palettes_async },
+		{ SYSCALL_LOAD_GRAPHICS_ASYNC, syscall_load_graphics_async },
+		{ SYSCALL_SET_CYCLE_MAX, syscall_set_cycle_max },
+		{ SYSCALL_START_TIMER, syscall_start_timer },
+		{ SYSCALL_STOP_TIMER, syscall_stop_timer },
+		{ SYSCALL_GET_TIMER, syscall_get_timer },
+		{ SYSCALL_DELAY, syscall_delay },
+		{ SYSCALL_GET_KEY_INPUT, syscall_get_key_input },
+		{ SYSCALL_GET_MOUSE_INPUT, syscall_get_mouse_input },
+		{ SYSCALL_MEM_COPY, syscall_mem_copy },
+		{ SYSCALL_MEM_FILL, syscall_mem_fill },
+		{ SYSCALL_MEM_FILL_STRIDED, syscall_mem_fill_strided },
+		{ SYSCALL_GPU_REFRESH, syscall_gpu_refresh },
+		{ SYSCALL_PRINT_MEM_PAGE, syscall_print_mem_page },
+	};
+
+	for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+		if (!kvm->syscall_table[builtins[i].id].handler) {
+			kvm_register_syscall(kvm, builtins[i].id, builtins[i].handler, NULL);
+		}
+	}
+}
+
+// Run the handler for a syscall and add what it cost to its stats. IDs with no handler are ignored.
+static void dispatch_syscall(kvm_syscall_context* context) {
+	syscall_entry* entry = &context->kvm->syscall_table[context->id];
+	if (!entry->handler) return;
+
+	context->userdata = entry->userdata;
+
+	uint64_t start_ticks = SDL_GetPerformanceCounter();
+	entry->handler(context);
+	uint64_t ticks = SDL_GetPerformanceCounter() - start_ticks;
+
+	entry->stats.calls++;
+	entry->stats.total_ticks += ticks;
+	if (ticks > entry->stats.max_ticks) entry->stats.max_ticks = ticks;
+}
+
+int kvm_register_syscall(kvm_context* kvm, uint8_t id, kvm_syscall_handler handler, void* userdata) {
+	if (!kvm || id == 0 || !handler) return -1;
+
+	kvm->syscall_table[id].handler = handler;
+	kvm->syscall_table[id].userdata = userdata;
+	return 0;
+}
+
+void kvm_unregister_syscall(kvm_context* kvm, uint8_t id) {
+	if (!kvm) return;
+
+	kvm->syscall_table[id].handler = NULL;
+	kvm->syscall_table[id].userdata = NULL;
+}
+
+void kvm_notify_memory_write(kvm_context* kvm, size_t address, size_t length) {
+	if (!kvm || !kvm->mem) return;
+	kvm_memory_notify_write(kvm->mem, address, length);
+}
+
+const kvm_syscall_stats* kvm_get_syscall_stats(kvm_context* kvm, uint8_t id) {
+	return &kvm->syscall_table[id].stats;
+}
+
+void kvm_reset_syscall_stats(kvm_context* kvm) {
+	for (int i = 0; i < KVM_SYSCALL_COUNT; i++) {
+		kvm->syscall_table[i].stats.calls = 0;
+		kvm->syscall_table[i].stats.total_ticks = 0;
+		kvm->syscall_table[i].stats.max_ticks = 0;
+	}
+}
+
+void kvm_print_syscall_stats(kvm_context* kvm) {
+	double us_per_tick = 1000000.0 / (double)SDL_GetPerformanceFrequency();
+
+	printf("Syscall stats:\n");
+	for (int i = 0; i < KVM_SYSCALL_COUNT; i++) {
+		const kvm_syscall_stats* stats = &kvm->syscall_table[i].stats;
+		if (stats->calls == 0) continue;
+
+		printf("  %3d: %llu calls, %.1f us total, %.2f us avg, %.1f us max\n", i, (unsigned long long)stats->calls,
+			stats->total_ticks * us_per_tick, stats->total_ticks * us_per_tick / stats->calls, stats->max_ticks * us_per_tick);
+	}
+}
+
+#pragma endregion
+
+kvm_run_status kvm_run(kvm_context* kvm, int cycles, bool stop_at_frame) {
+	if (!kvm || !kvm->cpu || !kvm->mem) return kvm_run_error;
+	if (kvm->run_status == kvm_run_quit || kvm->run_status == kvm_run_cycle_limit) return kvm->run_status;
+
+	kvm_memory* mem = kvm->mem;
+	kvm_cpu* cpu = kvm->cpu;
+
+	// Input scripts can start on frame 0.
+	kvm_input_set_frame(kvm->input, kvm_gpu_get_frame_count(kvm->gpu));
+
+	// Cpu cycle until system calls happen.
+	size_t cycles_this_call = 0;
+
+	while (true) {
+		// Run until the next system call, without going past the cycle limit or this call's share.
+		int budget = RUN_BATCH_SIZE;
+		if (cycles > 0 && cycles - cycles_this_call < (size_t)budget) {
+			budget = (int)(cycles - cycles_this_call);
+		}
+		if (kvm->max_cycles > 0) {
+			int until_limit = (int)(kvm->max_cycles + 1 - kvm->cycle_count);
+			if (until_limit < 1) until_limit = 1;
+			if (until_limit < budget) budget = until_limit;
+		}
+		size_t cycles_run = kvm_cpu_run(cpu, mem, budget);
+
+		// Compare frame counts rather than syscall IDs, so an embedder's own refresh handler counts too.
+		uint32_t frames_before = kvm_gpu_get_frame_count(kvm->gpu);
+
+		// Stores to address 0 raise syscall_pending, no need to look at memory.
+		if (mem->syscall_pending) {
+			kvm_syscall_context context;
+			context.id = mem->data[0];
 			// Get the address from the second two bytes of memory, right after the syscall byte.
-			uint16_t syscall_addr = mem->data[1] | ((uint16_t)mem->data[2] << 8);
-
-			switch (mem->data[0]) {
-			case SYSCALL_QUIT: // Quit
-				cpu_running = false; break;
-			case SYSCALL_PRINTCPU: // print cpu data
-				printf("\n");
-				kvm_cpu_print_status(cpu);
-				break;
-			case SYSCALL_PRINTF:
-			{
-				char* print_string = malloc(256);
-				uint16_t str_end_pt = load_string(print_string, syscall_addr, 256);
-				uint8_t bytes_to_print = kvm_memory_get_byte(mem, str_end_pt);
-				//printf("addr: %x endpt: %x bytes: %x\n",syscall_addr,  str_end_pt, bytes_to_print);
-				printf("%s ", print_string);
-
-				for (int i = 0; i < bytes_to_print; i++) {
-					printf("%x ", kvm_memory_get_byte(mem, str_end_pt + i + 1));
-				}
-				printf("\n");
-
-				free(print_string);
-				break;
-			}
-			case SYSCALL_LOAD_PALETTES:
-			{
-				char* graphics_fname = malloc(50);
-				load_string(graphics_fname, syscall_addr, 50);
-
-				int graphics_result = kvm_load_graphics(NULL, graphics_fname);
-				if (graphics_result != 0) {
-					printf("Failed to load graphics file %s.\n", graphics_fname);
-					mem->data[1] = 0xFF; // FF for "Freakin' Failure"
-				}
-				else {
-					mem->data[1] = 0x00; // 0 for success.
-				}
-
-				free(graphics_fname);
-			}
-			break;
-			case SYSCALL_LOAD_GRAPHICS:
-			{
-				char* graphics_fname = malloc(50);
-				load_string(graphics_fname, syscall_addr, 50);
-
-				int graphics_result = kvm_load_graphics(graphics_fname, NULL);
-				if (graphics_result != 0) {
-					printf("Failed to load graphics file %s.\n", graphics_fname);
-					mem->data[1] = 0xFF; // FF for "Freakin' Failure"
-				}
-				else {
-					mem->data[1] = 0x00; // 0 for success.
-				}
-
-				free(graphics_fname);
-			}
-			break;
-			case SYSCALL_SET_CYCLE_MAX:
-				// Set the max number of cpu cycles to go, using the uint16 stored in the second two bytes of memory.
-				max_cycles = syscall_addr;
-				break;
-
-				// Timer interaction
-			case SYSCALL_START_TIMER:
-				kvm_timer = 0;
-				sdl_timer_start_time = SDL_GetTicks64();
-				break;
-			case SYSCALL_STOP_TIMER:
-				sdl_timer_current_time = SDL_GetTicks64() - sdl_timer_start_time;
-				break;
-			case SYSCALL_GET_TIMER:
-			{
-				sdl_timer_current_time = SDL_GetTicks64() - sdl_timer_start_time;
-				kvm_timer = (uint16_t)(sdl_timer_current_time % 0xFFFF);
-				mem->data[1] = (uint8_t)(kvm_timer & 0xFF);
-				mem->data[2] = (uint8_t)(kvm_timer >> 8) & 0xFF;
-			}
-				break;
-			case SYSCALL_DELAY:
-				SDL_Delay(syscall_addr);
-				break;
-
-			// Input
-			case SYSCALL_GET_KEY_INPUT:
-				kvm_input_get_keyboard(mem);
-				break;
-			case SYSCALL_GET_MOUSE_INPUT:
-				kvm_input_get_mouse(mem);
-				break;
-			case SYSCALL_GPU_REFRESH:
-				kvm_gpu_refresh_graphics(mem);
-				break;
-			case SYSCALL_PRINT_MEM_PAGE:
-				{
-					// Print one page of memory starting at the specified address.
-					kvm_memory_print_hexdump(mem, syscall_addr, 256);
-				}break;
-			}
+			context.address = mem->data[1] | ((uint16_t)mem->data[2] << 8);
+			context.memory = mem->data;
+			context.memory_size = mem->size;
+			context.max_cycles = kvm->max_cycles;
+			context.quit = false;
+			context.kvm = kvm;
+			context.userdata = NULL;
+
+			dispatch_syscall(&context);
+
+			kvm->max_cycles = context.max_cycles;
+			if (context.quit) kvm->run_status = kvm_run_quit;
 
 			mem->data[0] = 0;
+			mem->syscall_pending = false;
+			kvm_memory_notify_write(mem, 0, 3);
 		}
 
-		if (max_cycles > 0 && ++cycle_count > max_cycles) {
-			cpu_running = false;
-			printf("Error, %d cycles reached.\n", max_cycles);
+		cycles_this_call += cycles_run;
+		kvm->cycle_count += cycles_run;
+		if (kvm->run_status != kvm_run_quit && kvm->max_cycles > 0 && kvm->cycle_count > (size_t)kvm->max_cycles) {
+			kvm->run_status = kvm_run_cycle_limit;
+			printf("Error, %d cycles reached.\n", kvm->max_cycles);
 		}
+
+		if (kvm->run_status != kvm_run_budget) return kvm->run_status;
+		if (stop_at_frame && kvm_gpu_get_frame_count(kvm->gpu) != frames_before) return kvm_run_frame;
+		if (cycles > 0 && cycles_this_call >= (size_t)cycles) return kvm_run_budget;
 	}
+}
 
-	return 0;
+int kvm_start(kvm_context* kvm, int max_cycles) {
+	if (!kvm || !kvm->cpu || !kvm->mem) return -1;
+
+	kvm_set_cycle_limit(kvm, max_cycles);
+
+	kvm_run_status status;
+	do {
+		status = kvm_run(kvm, 0, false);
+	} while (status == kvm_run_budget || status == kvm_run_frame);
+
+	return status == kvm_run_error ? -1 : 0;
 }
 
-int kvm_quit(void) {
+void kvm_set_cycle_limit(kvm_context* kvm, int max_cycles) {
+	if (!kvm) return;
+	kvm->max_cycles = max_cycles;
+}
+
+size_t kvm_get_cycle_count(kvm_context* kvm) {
+	if (!kvm) return 0;
+	return kvm->cycle_count;
+}
+
+int kvm_quit(kvm_context* kvm) {
+	if (!kvm) return -1;
 
-	kvm_gpu_quit();
+	// Loads still going have nowhere to go once memory is gone.
+	for (int is_palette = 0; is_palette < 2; is_palette++) {
+		if (kvm->graphics_jobs[is_palette]) free_graphics_job(kvm, is_palette);
+	}
+
+	kvm_gpu_quit(kvm->gpu);
+	kvm_cpu_free(kvm->cpu);
+	kvm_memory_free(kvm->mem);
 
-	kvm_cpu_free(cpu);
-	kvm_memory_free(mem);
+	kvm->gpu = NULL;
+	kvm->cpu = NULL;
+	kvm->mem = NULL;
 
-	is_running = false;
+	kvm->is_running = false;
 
 	return 0;
 }
 
-void kvm_hexdump(int start_page, int page_count, bool print_cpu_status) {
-	if (!mem) return;
+void kvm_set_jit_enabled(kvm_context* kvm, bool enabled) {
+	if (!kvm) return;
+
+	kvm->jit_enabled = enabled;
+	if (kvm->cpu) kvm_cpu_set_core(kvm->cpu, enabled ? kvm_core_jit : kvm_core_block);
+}
+
+void kvm_set_headless(kvm_context* kvm, bool enabled) {
+	if (!kvm) return;
+	kvm->headless = enabled;
+	kvm->skip_delays = enabled;
+}
+
+void kvm_set_skip_delays(kvm_context* kvm, bool enabled) {
+	if (!kvm) return;
+	kvm->skip_delays = enabled;
+}
+
+void kvm_interrupt_delays(kvm_context* kvm) {
+	if (!kvm) return;
+	SDL_AtomicSet(&kvm->delays_interrupted, 1);
+}
+
+void kvm_set_vsync(kvm_context* kvm, bool enabled) {
+	if (!kvm) return;
 
-	kvm_memory_print_hexdump(mem, start_page * 256, page_count * 256);
-	if (print_cpu_status && cpu) {
+	kvm->vsync = enabled;
+	if (kvm->gpu) kvm_gpu_set_vsync(kvm->gpu, enabled);
+}
+
+void kvm_set_integer_scale(kvm_context* kvm, bool enabled) {
+	if (!kvm) return;
+
+	kvm->integer_scale = enabled;
+	if (kvm->gpu) kvm_gpu_set_integer_scale(kvm->gpu, enabled);
+}
+
+bool kvm_queue_key(kvm_context* kvm, SDL_Scancode scancode, bool pressed) {
+	if (!kvm) return false;
+	return kvm_input_push_key(kvm->input, kvm_input_key_index(scancode), pressed);
+}
+
+bool kvm_queue_mouse(kvm_context* kvm, int x, int y, int buttons) {
+	if (!kvm) return false;
+	return kvm_input_push_mouse(kvm->input, x, y, buttons);
+}
+
+int kvm_set_input_script(kvm_context* kvm, const char* filename) {
+	if (!kvm) return -1;
+	return kvm_input_load_script(kvm->input, filename);
+}
+
+uint32_t kvm_get_frame_count(kvm_context* kvm) {
+	if (!kvm) return 0;
+	return kvm_gpu_get_frame_count(kvm->gpu);
+}
+
+void kvm_hexdump(kvm_context* kvm, int start_page, int page_count, bool print_cpu_status) {
+	if (!kvm || !kvm->mem) return;
+
+	kvm_memory_print_hexdump(kvm->mem, start_page * 256, page_count * 256);
+	if (print_cpu_status && kvm->cpu) {
 		printf("\n\nCPU Status:\n");
-		kvm_cpu_print_status(cpu);
+		kvm_cpu_print_status(kvm->cpu);
 	}
 }
 
-uint8_t* kvm_get_memory_pointer(void) {
-	if (!mem) return NULL;
-	if (!mem->data) return NULL;
+uint8_t* kvm_get_memory_pointer(kvm_context* kvm) {
+	if (!kvm || !kvm->mem) return NULL;
+	if (!kvm->mem->data) return NULL;
+
+	return kvm->mem->data;
+}
 
-	return mem->data;
+size_t kvm_get_memory_size(kvm_context* kvm) {
+	if (!kvm || !kvm->mem) return 0;
+	return kvm->mem->size;
 }
 
-SDL_Surface* kvm_get_display_surface(void) {
-	// will do later
-	return NULL;
+SDL_Surface* kvm_get_display_surface(kvm_context* kvm) {
+	if (!kvm) return NULL;
+	return kvm_gpu_get_surface(kvm->gpu);
 }
@@ -5,30 +5,145 @@
 #pragma once
 #include <stdbool.h>
 #include <stdint.h>
+#include <stddef.h>
 
 #include <SDL.h>
 
 /*
 So, we have to take in a filename to assemble, then assemble, and run it until it's done.
+Every VM lives in its own kvm_context, so any number of them can exist at once (each one used from one thread at a time).
 */
 
+typedef struct kvm_context kvm_context;
+
+// Make a new VM. Settings (JIT, headless, input script, syscall handlers) can be changed right away, before kvm_init().
+kvm_context* kvm_context_create(void);
+
+// Quits the VM if it's still running, and frees it.
+void kvm_context_free(kvm_context* kvm);
+
 // Call this first
-int kvm_init(void);
+int kvm_init(kvm_context* kvm);
 
 // Call this second with the filename of the currently loaded assembly file.
-// Runs the assembler python script, and loads the resulting file into ROM
-int kvm_load_instructions(const char* filename);
+// Assembles it (see kvm_assembler.h), and loads the result into ROM
+int kvm_load_instructions(kvm_context* kvm, const char* filename);
+
+// Or this, to assemble source that's already in memory (like the editor's text) straight into ROM.
+// The VM keeps each program's assembled lines, so loading an edited program again only assembles the lines that changed.
+int kvm_load_source(kvm_context* kvm, const char* source, size_t length);
+
+// Or this, to load a program that's already been assembled (a .kvmbin file) into ROM without running the assembler.
+int kvm_load_binary(kvm_context* kvm, const char* filename);
 
 // Call this third.
-// Run the VM. If max_cycles is > 0, The CPU will force quit after that many cycles (set it to zero to ignore this).
+// Run the VM until the program quits. If max_cycles is > 0, The CPU will force quit after that many cycles (set it to zero to ignore this).
 // max_cycles can also be set by a system call. (id 4)
-int kvm_start(int max_cycles);
+int kvm_start(kvm_context* kvm, int max_cycles);
+
+// Or, to keep control of the calling thread, call kvm_run() over and over instead of kvm_start().
+typedef enum kvm_run_status {
+	kvm_run_budget,			// Ran all the cycles asked for, call kvm_run() again to carry on.
+	kvm_run_frame,			// Stopped right after a frame was drawn (only when stop_at_frame is set).
+	kvm_run_quit,			// The program quit. Every later call returns this too, until the next kvm_init().
+	kvm_run_cycle_limit,	// Went past the cycle limit. Also sticks until the next kvm_init().
+	kvm_run_error			// The VM isn't initialized.
+} kvm_run_status;
+
+// Run for up to cycles cycles (0 for no limit), returning early when the program ends or, if stop_at_frame is set, draws a frame.
+// Syscalls are handled inside, a call never returns with one half done.
+kvm_run_status kvm_run(kvm_context* kvm, int cycles, bool stop_at_frame);
+
+// Total cycles after which the program is stopped (0 for no limit), counted from kvm_init(). Same limit syscall 4 sets.
+void kvm_set_cycle_limit(kvm_context* kvm, int max_cycles);
+
+// Cycles run since kvm_init().
+size_t kvm_get_cycle_count(kvm_context* kvm);
+
+// Call this last, after kvm_start() returns (or kvm_run() stops returning kvm_run_budget or kvm_run_frame). The context can be given to kvm_init() again afterwards.
+int kvm_quit(kvm_context* kvm);
+
+// Turn the JIT (see kvm_cpu_jit.c) on or off. Can be called at any time, the setting carries over to the next kvm_init().
+// Has no effect on hosts without a JIT.
+void kvm_set_jit_enabled(kvm_context* kvm, bool enabled);
+
+// Run without a window, for batch runs and testing. Takes effect at the next kvm_init().
+// Frames are still drawn, but only to the display surface. Input comes from the input script and kvm_queue_key()/kvm_queue_mouse() (or nothing), and delay syscalls return right away.
+void kvm_set_headless(kvm_context* kvm, bool enabled);
+
+// Headless runs skip delay syscalls (the timer still moves as if they happened). Turn that back off here, after kvm_set_headless(),
+// for a headless VM that should still run in real time, like one on its own thread (see kvm_thread.h).
+void kvm_set_skip_delays(kvm_context* kvm, bool enabled);
+
+// Cut short the delay syscall in progress, and make every later one return right away, until the next kvm_init().
+// Safe to call from another thread while the VM runs. For stopping a VM on its own thread without waiting out a long delay.
+void kvm_interrupt_delays(kvm_context* kvm);
+
+// How the window shows frames (see kvm_gpu.h). Both are off by default, can be changed at any time, and carry over to the next kvm_init().
+// With vsync, each frame waits for the display to refresh. With integer scale, frames are only scaled up by whole numbers.
+void kvm_set_vsync(kvm_context* kvm, bool enabled);
+void kvm_set_integer_scale(kvm_context* kvm, bool enabled);
+
+// Load a script of keyboard and mouse events to use when headless (format in kvm_input.h). NULL clears it. Returns 0 on success.
+int kvm_set_input_script(kvm_context* kvm, const char* filename);
+
+// Feed a headless VM live input. Safe to call from one other thread while the VM runs, events are picked up the next time the program reads input.
+// Mouse positions are in screen pixels (0-255). Returns false if the key isn't one the VM has, or the queue is full.
+bool kvm_queue_key(kvm_context* kvm, SDL_Scancode scancode, bool pressed);
+bool kvm_queue_mouse(kvm_context* kvm, int x, int y, int buttons);
+
+// Number of frames drawn since kvm_init().
+uint32_t kvm_get_frame_count(kvm_context* kvm);
+
+#pragma region Syscalls
+
+#define KVM_SYSCALL_COUNT 256
+
+// Everything a syscall handler gets to work with. Handlers are free to read and write memory directly.
+typedef struct kvm_syscall_context {
+	uint8_t id;				// The syscall being run (byte 0 of memory).
+	uint16_t address;		// Bytes 1 and 2 of memory, the argument most syscalls take.
+
+	uint8_t* memory;
+	size_t memory_size;
+
+	int max_cycles;			// Cycle limit of the current program. Can be changed by the handler.
+	bool quit;				// Set this to end the program, kvm_start() returns and kvm_run() returns kvm_run_quit.
+
+	kvm_context* kvm;		// The VM making the call.
+
+	void* userdata;			// Whatever was passed to kvm_register_syscall().
+} kvm_syscall_context;
+
+typedef void (*kvm_syscall_handler)(kvm_syscall_context* context);
+
+// Host-side cost of one syscall ID, measured around every call of its handler.
+typedef struct kvm_syscall_stats {
+	uint64_t calls;
+	uint64_t total_ticks;	// In SDL_GetPerformanceCounter() ticks.
+	uint64_t max_ticks;
+} kvm_syscall_stats;
+
+// Install a handler for a syscall ID, replacing whatever was there (built-ins included). ID 0 means "no syscall" and can't be used.
+// Can be called before kvm_init(). kvm_init() only puts the built-in handlers into IDs that are still empty.
+// Returns 0 on success, -1 if the ID or handler is invalid.
+int kvm_register_syscall(kvm_context* kvm, uint8_t id, kvm_syscall_handler handler, void* userdata);
+void kvm_unregister_syscall(kvm_context* kvm, uint8_t id);
+
+// A handler that writes to memory other than bytes 0-2 has to call this, so cached code for that memory is thrown away.
+void kvm_notify_memory_write(kvm_context* kvm, size_t address, size_t length);
+
+const kvm_syscall_stats* kvm_get_syscall_stats(kvm_context* kvm, uint8_t id);
+void kvm_reset_syscall_stats(kvm_context* kvm);
+void kvm_print_syscall_stats(kvm_context* kvm);
+
+#pragma endregion
 
-// Call this last, after kvm_start() returns
-int kvm_quit(void);
+void kvm_hexdump(kvm_context* kvm, int start_page, int page_count, bool print_cpu_status);
 
-void kvm_hexdump(int start_page, int page_count, bool print_cpu_status);
+uint8_t* kvm_get_memory_pointer(kvm_context* kvm);
+size_t kvm_get_memory_size(kvm_context* kvm);
 
-uint8_t* kvm_get_memory_pointer(void);
-SDL_Surface* kvm_get_display_surface(void);
+// The 256x256 surface the last frame was drawn to.
+SDL_Surface* kvm_get_display_surface(kvm_context* kvm);
 
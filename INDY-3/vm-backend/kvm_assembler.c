@@ -0,0 +1,1239 @@
+/*	Assembler for the KSU Micro VM, ported from assembler.py.
+*	It works the same way: one pass encodes every line and remembers where labels were used,
+*	then a second pass fills in those addresses once every label is known.
+*	Author: Matthew Watson
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "kvm_assembler.h"
+#include "leakcheck_util.h"
+
+#pragma region Text Helpers
+
+// Part of the source, not null terminated.
+typedef struct text_view {
+	const char* text;
+	size_t length;
+} text_view;
+
+static text_view make_view(const char* text, size_t length) {
+	text_view view = { text, length };
+	return view;
+}
+
+static bool is_one_of(char c, const char* chars) {
+	return c != '\0' && strchr(chars, c) != NULL;
+}
+
+// str.strip(chars) from python.
+static text_view strip(text_view view, const char* chars) {
+	while (view.length > 0 && is_one_of(view.text[0], chars)) {
+		view.text++;
+		view.length--;
+	}
+	while (view.length > 0 && is_one_of(view.text[view.length - 1], chars)) {
+		view.length--;
+	}
+	return view;
+}
+
+// view[start:] from python.
+static text_view slice_from(text_view view, size_t start) {
+	if (start > view.length) start = view.length;
+	return make_view(view.text + start, view.length - start);
+}
+
+static char lower_char(char c) {
+	return (c >= 'A' && c <= 'Z') ? (char)(c - 'A' + 'a') : c;
+}
+
+// Compare against a lowercase string, ignoring the case of the view.
+static bool equals_lower(text_view view, const char* lower) {
+	size_t length = strlen(lower);
+	if (view.length != length) return false;
+
+	for (size_t i = 0; i < length; i++) {
+		if (lower_char(view.text[i]) != lower[i]) return false;
+	}
+	return true;
+}
+
+static bool view_equals(text_view a, text_view b) {
+	return a.length == b.length && memcmp(a.text, b.text, a.length) == 0;
+}
+
+static bool view_contains(text_view view, char c) {
+	return memchr(view.text, c, view.length) != NULL;
+}
+
+// Lowercase copy for error messages. Long views get cut short.
+static const char* lower_copy(text_view view, char* buffer, size_t buffer_size) {
+	size_t length = view.length < buffer_size - 1 ? view.length : buffer_size - 1;
+	for (size_t i = 0; i < length; i++) {
+		buffer[i] = lower_char(view.text[i]);
+	}
+	buffer[length] = '\0';
+	return buffer;
+}
+
+static char* copy_string(text_view view) {
+	char* copy = malloc(view.length + 1);
+	memcpy(copy, view.text, view.length);
+	copy[view.length] = '\0';
+	return copy;
+}
+
+// Make room for one more element in a growable array. Returns the array, which may have moved.
+static void* grow_array(void* array, size_t count, size_t* capacity, size_t element_size, size_t first_capacity) {
+	if (count < *capacity) return array;
+
+	size_t new_capacity = *capacity ? *capacity * 2 : first_capacity;
+	void* bigger = malloc(new_capacity * element_size);
+	if (array) {
+		memcpy(bigger, array, count * element_size);
+		free(array);
+	}
+	*capacity = new_capacity;
+	return bigger;
+}
+
+#pragma endregion
+
+#pragma region Numbers
+
+static int digit_value(char c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return 99;
+}
+
+// int(text, base) from python: whitespace around it, a sign, an optional 0x for base 16, and single underscores between digits.
+// Numbers past 64 bits are clamped. Returns false if the text isn't a number.
+static bool parse_python_int(text_view text, int base, uint64_t* out_value, bool* out_negative) {
+	text = strip(text, " \t\n\r\v\f");
+
+	size_t i = 0;
+	bool negative = false;
+	if (i < text.length && (text.text[i] == '+' || text.text[i] == '-')) {
+		negative = text.text[i] == '-';
+		i++;
+	}
+
+	bool has_digits = false;
+	if (base == 16 && i + 1 < text.length && text.text[i] == '0' && lower_char(text.text[i + 1]) == 'x') {
+		i += 2;
+		// One underscore is allowed right after the prefix.
+		if (i < text.length && text.text[i] == '_') i++;
+	}
+
+	uint64_t value = 0;
+	bool last_was_underscore = false;
+	for (; i < text.length; i++) {
+		char c = text.text[i];
+		if (c == '_') {
+			if (!has_digits || last_was_underscore) return false;
+			last_was_underscore = true;
+			continue;
+		}
+
+		int digit = digit_value(c);
+		if (digit >= base) return false;
+
+		if (value > (UINT64_MAX - digit) / base) {
+			value = UINT64_MAX;
+		}
+		else {
+			value = value * base + digit;
+		}
+		has_digits = true;
+		last_was_underscore = false;
+	}
+
+	if (!has_digits || last_was_underscore) return false;
+
+	*out_value = value;
+	*out_negative = negative;
+	return true;
+}
+
+// get_int() from assembler.py. '$' means hex, and negative numbers turn into an 8 bit two's complement.
+static bool get_int(text_view text, uint64_t* out_value) {
+	int base = 10;
+	if (text.length > 0 && text.text[0] == '$') {
+		text = slice_from(text, 1);
+		base = 16;
+	}
+
+	uint64_t value;
+	bool negative;
+	if (!parse_python_int(text, base, &value, &negative)) return false;
+
+	if (negative && value != 0) {
+		value = (0 - value) & 0xFF;
+	}
+
+	*out_value = value;
+	return true;
+}
+
+#pragma endregion
+
+#pragma region Symbols
+
+typedef struct symbol {
+	char* name;		// NULL for an empty slot.
+	size_t name_length;
+	uint64_t value;
+} symbol;
+
+// Open addressing, the capacity is always a power of two.
+typedef struct symbol_table {
+	symbol* entries;
+	size_t capacity;
+	size_t count;
+} symbol_table;
+
+static uint64_t hash_name(text_view name) {
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < name.length; i++) {
+		hash ^= (uint8_t)name.text[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static symbol* symbol_find_slot(symbol* entries, size_t capacity, text_view name) {
+	size_t index = (size_t)hash_name(name) & (capacity - 1);
+	while (entries[index].name) {
+		if (view_equals(make_view(entries[index].name, entries[index].name_length), name)) break;
+		index = (index + 1) & (capacity - 1);
+	}
+	return &entries[index];
+}
+
+static void symbol_table_grow(symbol_table* table) {
+	size_t new_capacity = table->capacity ? table->capacity * 2 : 64;
+	symbol* new_entries = malloc(new_capacity * sizeof(symbol));
+	memset(new_entries, 0, new_capacity * sizeof(symbol));
+
+	for (size_t i = 0; i < table->capacity; i++) {
+		symbol* old = &table->entries[i];
+		if (!old->name) continue;
+		*symbol_find_slot(new_entries, new_capacity, make_view(old->name, old->name_length)) = *old;
+	}
+
+	if (table->entries) free(table->entries);
+	table->entries = new_entries;
+	table->capacity = new_capacity;
+}
+
+// Define a name, or change its value if it's already defined (like assigning to a python dict).
+static void symbol_set(symbol_table* table, text_view name, uint64_t value) {
+	// Keep the table under 3/4 full.
+	if ((table->count + 1) * 4 > table->capacity * 3) symbol_table_grow(table);
+
+	symbol* slot = symbol_find_slot(table->entries, table->capacity, name);
+	if (!slot->name) {
+		slot->name = copy_string(name);
+		slot->name_length = name.length;
+		table->count++;
+	}
+	slot->value = value;
+}
+
+static bool symbol_get(const symbol_table* table, text_view name, uint64_t* out_value) {
+	if (!table->capacity) return false;
+
+	symbol* slot = symbol_find_slot(table->entries, table->capacity, name);
+	if (!slot->name) return false;
+
+	*out_value = slot->value;
+	return true;
+}
+
+static void symbol_table_free(symbol_table* table) {
+	for (size_t i = 0; i < table->capacity; i++) {
+		if (table->entries[i].name) free(table->entries[i].name);
+	}
+	if (table->entries) free(table->entries);
+	table->entries = NULL;
+	table->capacity = 0;
+	table->count = 0;
+}
+
+#pragma endregion
+
+typedef enum addr_mode {
+	mode_invalid,
+	mode_immediate,
+	mode_zeropage,
+	mode_zpx,
+	mode_zpy,
+	mode_absolute,
+	mode_abx,
+	mode_aby,
+	mode_indirect_index_y,
+	mode_index_indirect_x
+} addr_mode;
+
+typedef enum fixup_type { fixup_all, fixup_hi, fixup_lo } fixup_type;
+
+// A variable a line looked up, and what it got. The line encodes the same way as long as every lookup still gives the same answer.
+typedef struct variable_lookup {
+	char* name;
+	bool found;
+	uint64_t value;
+} variable_lookup;
+
+// A label that was used before the second pass could know its address (locations_to_replace in assembler.py).
+typedef struct fixup {
+	size_t position;	// Where the instruction starts, the address goes right after the opcode.
+	char* name;
+	fixup_type type;
+	text_view line;		// For error messages.
+	int line_number;
+} fixup;
+
+typedef struct assembler {
+	uint16_t entry_point;
+
+	uint8_t* bytes;
+	size_t size;
+	size_t capacity;
+
+	symbol_table labels;	// ".name" on a line of its own, the address of whatever comes next.
+	symbol_table variables;	// ".name value", only usable on lines after they're defined.
+
+	fixup* fixups;
+	size_t fixup_count;
+	size_t fixup_capacity;
+
+	// The line being assembled, for error messages.
+	text_view line;
+	int line_number;
+
+	// The line split on spaces, like python's split(' '). Empty tokens are kept.
+	text_view* tokens;
+	size_t token_count;
+	size_t token_capacity;
+
+	// What the last line defined and which variables it looked up, for the incremental assembler.
+	bool line_defines_label;
+	text_view line_label;
+	bool line_defines_variable;
+	text_view line_variable;
+	uint64_t line_variable_value;
+
+	bool record_lookups;
+	variable_lookup* lookups;
+	size_t lookup_count;
+	size_t lookup_capacity;
+} assembler;
+
+// Print an error the same way assembler.py does. Always returns -1.
+static int assembler_error(assembler* as, const char* format, ...) {
+	char message[256];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(message, sizeof(message), format, args);
+	va_end(args);
+
+	text_view line = strip(as->line, " \t\n");
+	printf("Error on line %d: '%.*s'\n%s\n\n", as->line_number + 1, (int)line.length, line.text, message);
+	return -1;
+}
+
+static void emit_byte(assembler* as, uint8_t value) {
+	as->bytes = grow_array(as->bytes, as->size, &as->capacity, 1, 1024);
+	as->bytes[as->size++] = value;
+}
+
+// add_numeric_value() from assembler.py. With neither size given, it takes as many bytes as the number needs (at least one).
+static void add_numeric_value(assembler* as, uint64_t value, bool is_16_bit, bool is_8_bit) {
+	if (is_16_bit) {
+		emit_byte(as, (uint8_t)(value & 0xFF));
+		emit_byte(as, (uint8_t)((value >> 8) & 0xFF));
+	}
+	else if (is_8_bit) {
+		emit_byte(as, (uint8_t)(value & 0xFF));
+	}
+	else if (value == 0) {
+		emit_byte(as, 0);
+	}
+	else {
+		while (value > 0) {
+			emit_byte(as, (uint8_t)(value & 0xFF));
+			value >>= 8;
+		}
+	}
+}
+
+static void split_spaces(assembler* as, text_view text) {
+	as->token_count = 0;
+
+	size_t start = 0;
+	for (size_t i = 0; i <= text.length; i++) {
+		if (i < text.length && text.text[i] != ' ') continue;
+
+		as->tokens = grow_array(as->tokens, as->token_count, &as->token_capacity, sizeof(text_view), 16);
+		as->tokens[as->token_count++] = make_view(text.text + start, i - start);
+		start = i + 1;
+	}
+}
+
+// A number, or a variable that's already defined.
+static bool get_addr(assembler* as, text_view text, uint64_t* out_value) {
+	if (get_int(text, out_value)) return true;
+
+	bool found = symbol_get(&as->variables, text, out_value);
+	if (as->record_lookups) {
+		as->lookups = grow_array(as->lookups, as->lookup_count, &as->lookup_capacity, sizeof(variable_lookup), 8);
+		variable_lookup* lookup = &as->lookups[as->lookup_count++];
+		lookup->name = copy_string(text);
+		lookup->found = found;
+		lookup->value = found ? *out_value : 0;
+	}
+	return found;
+}
+
+// check_int16_or_str() from assembler.py. Anything that isn't a number or a variable is taken to be a label,
+// and gets filled in by the second pass. The value is 0 until then.
+static void get_addr_or_label(assembler* as, text_view text, fixup_type type, uint64_t* out_value, bool* out_is_label) {
+	*out_is_label = false;
+	if (get_addr(as, text, out_value)) return;
+
+	*out_value = 0;
+	*out_is_label = true;
+
+	as->fixups = grow_array(as->fixups, as->fixup_count, &as->fixup_capacity, sizeof(fixup), 64);
+	fixup* entry = &as->fixups[as->fixup_count++];
+	entry->position = as->size;
+	entry->name = copy_string(text);
+	entry->type = type;
+	entry->line = as->line;
+	entry->line_number = as->line_number;
+}
+
+static bool is_legal_opcode(uint8_t opcode) {
+	// Ranges are inclusive on both ends.
+	static const uint8_t legal_ranges[][2] = {
+		{ 0x00, 0x10 }, { 0x28, 0x2F }, { 0x40, 0x56 }, { 0x60, 0x76 }, { 0x80, 0x97 }, { 0xA0, 0xAF },
+		{ 0xB4, 0xBE }, { 0xC0, 0xC7 }, { 0xD0, 0xD3 }, { 0xD8, 0xDF }, { 0xE0, 0xF6 }, { 0xF8, 0xFF }
+	};
+	static const uint8_t omitted[] = { 0x49, 0x4B, 0x63, 0x67, 0x69, 0x6B, 0x73, 0x83, 0x87, 0x8B, 0xB5, 0xB6, 0xBB };
+
+	for (size_t i = 0; i < sizeof(omitted); i++) {
+		if (opcode == omitted[i]) return false;
+	}
+	for (size_t i = 0; i < sizeof(legal_ranges) / sizeof(legal_ranges[0]); i++) {
+		if (opcode >= legal_ranges[i][0] && opcode <= legal_ranges[i][1]) return true;
+	}
+	return false;
+}
+
+typedef struct mnemonic_bits {
+	const char* name;
+	uint8_t bits;
+} mnemonic_bits;
+
+static bool find_mnemonic(const mnemonic_bits* table, size_t count, text_view instr, uint8_t* out_bits) {
+	for (size_t i = 0; i < count; i++) {
+		if (equals_lower(instr, table[i].name)) {
+			*out_bits = table[i].bits;
+			return true;
+		}
+	}
+	return false;
+}
+
+#define TABLE_SIZE(table) (sizeof(table) / sizeof(table[0]))
+
+static const mnemonic_bits implicit_instructions[] = {
+	{ "nop", 0 }, { "brk", 1 }, { "rts", 2 }, { "rti", 3 }, { "tax", 4 }, { "tay", 5 }, { "txa", 6 }, { "tya", 7 }, { "tsx", 8 },
+	{ "txs", 9 }, { "pha", 10 }, { "pla", 11 }, { "php", 12 }, { "plp", 13 }, { "sec", 14 }, { "clc", 15 }, { "clv", 16 }
+};
+
+// Instructions that take no operand, but aren't in the list above.
+static const mnemonic_bits single_word_instructions[] = {
+	{ "inx", 0x28 }, { "iny", 0x29 }, { "dex", 0x2A }, { "dey", 0x2B }, { "shl", 0x2C }, { "shr", 0x2D }, { "rol", 0x2E }, { "ror", 0x2F }
+};
+
+static const mnemonic_bits indirect_index_y_instructions[] = {
+	{ "and", 0x8 }, { "ora", 0x9 }, { "xor", 0xA }, { "lda", 0xB }, { "adc", 0xC }, { "sbc", 0xD }, { "cmp", 0xE }, { "sta", 0xF }
+};
+
+// Math instructions with absolute, y addressing have opcodes of their own.
+static const mnemonic_bits absolute_y_instructions[] = {
+	{ "and", 0xB8 }, { "ora", 0xB9 }, { "xor", 0xBA }, { "adc", 0xBC }, { "sbc", 0xBD }, { "cmp", 0xBE }
+};
+
+// The low five bits of everything else.
+static const mnemonic_bits normal_instructions[] = {
+	{ "and", 0x00 }, { "ora", 0x01 }, { "xor", 0x02 }, { "bit", 0x03 }, { "adc", 0x04 }, { "sbc", 0x05 }, { "cmp", 0x06 }, { "cpx", 0x07 },
+	{ "inx", 0x08 }, { "inc", 0x08 }, { "iny", 0x09 }, { "dex", 0x0A }, { "dec", 0x0A }, { "dey", 0x0B },
+	{ "shl", 0x0C }, { "shr", 0x0D }, { "rol", 0x0E }, { "ror", 0x0F },
+	// loads/stores (and cpy)
+	{ "lda", 0x10 }, { "ldx", 0x11 }, { "ldy", 0x12 }, { "cpy", 0x13 }, { "sta", 0x14 }, { "stx", 0x15 }, { "sty", 0x16 },
+	// branches
+	{ "bcc", 0x18 }, { "bcs", 0x19 }, { "bne", 0x1A }, { "beq", 0x1B }, { "bpl", 0x1C }, { "bmi", 0x1D }, { "bvc", 0x1E }, { "bvs", 0x1F }
+};
+
+static int register_error(assembler* as, text_view name) {
+	char lower[32];
+	return assembler_error(as, "No register of name '%s'. Did you mean 'x' or 'y'?", lower_copy(name, lower, sizeof(lower)));
+}
+
+// An instruction with an operand.
+static int process_instruction(assembler* as, text_view stripped_line, text_view instr) {
+	char lower[32];
+
+	text_view right_hand = strip(slice_from(stripped_line, 3), " \t\n");
+
+	uint8_t opcode = 0x00;
+	uint64_t number = 0;
+
+	int instr_size = 2;
+	addr_mode mode = mode_invalid;
+
+	bool is_named_addr = false;
+
+	// Gather information about addressing mode
+	text_view no_paren = strip(right_hand, "()");
+	if (no_paren.length != right_hand.length) {
+		// Indirect addressing modes. Any ')' left in the middle goes too.
+		char inner[256];
+		size_t inner_length = 0;
+		for (size_t i = 0; i < no_paren.length; i++) {
+			if (no_paren.text[i] == ')') continue;
+			if (inner_length == sizeof(inner)) return assembler_error(as, "Line is too long.");
+			inner[inner_length++] = no_paren.text[i];
+		}
+		split_spaces(as, make_view(inner, inner_length));
+
+		if (as->token_count == 1) {
+			// Standard indirect addressing, only one instruction does this (whatever name it's written with).
+			uint64_t address;
+			if (!get_addr(as, as->tokens[0], &address)) {
+				return assembler_error(as, "Variable '%.*s' is not defined.", (int)as->tokens[0].length, as->tokens[0].text);
+			}
+			emit_byte(as, 0x89);
+			add_numeric_value(as, address, true, false);
+			return 0;
+		}
+
+		get_addr_or_label(as, as->tokens[0], fixup_all, &number, &is_named_addr);
+
+		instr_size = 3;
+		if (equals_lower(as->tokens[1], "x")) {
+			mode = mode_index_indirect_x;
+		}
+		else if (equals_lower(as->tokens[1], "y")) {
+			mode = mode_indirect_index_y;
+		}
+		else {
+			return register_error(as, as->tokens[1]);
+		}
+	}
+	else {
+		text_view value = as->tokens[1];
+		if (value.length == 0) return assembler_error(as, "Expected a value after '%s'.", lower_copy(instr, lower, sizeof(lower)));
+
+		if (value.text[0] == '#') {
+			// Immediate addressing
+			mode = mode_immediate;
+
+			bool is_hi = value.length >= 3 && lower_char(value.text[1]) == 'h' && lower_char(value.text[2]) == 'i';
+			bool is_lo = value.length >= 3 && lower_char(value.text[1]) == 'l' && lower_char(value.text[2]) == 'o';
+			if (is_hi || is_lo) {
+				if (as->token_count < 3) return assembler_error(as, "Expected an address after '%.*s'.", (int)value.length, value.text);
+
+				bool is_label;
+				get_addr_or_label(as, as->tokens[2], is_hi ? fixup_hi : fixup_lo, &number, &is_label);
+				if (is_hi) number >>= 8;
+			}
+			else {
+				// Normal 8-bit number
+				if (!get_int(slice_from(value, 1), &number)) {
+					return assembler_error(as, "'%.*s' is not a number.", (int)value.length - 1, value.text + 1);
+				}
+				if (number > 255) {
+					return assembler_error(as, "Immediate value %llu is too large; must fit in 8 bits.\nValid range is 0 - 255 (decimal) or $00 - $FF (hex).", (unsigned long long)number);
+				}
+			}
+		}
+		else {
+			get_addr_or_label(as, value, fixup_all, &number, &is_named_addr);
+
+			if (number <= 255 && !is_named_addr) {
+				// Zero page addressing
+				if (as->token_count == 2) {
+					mode = mode_zeropage;
+				}
+				else if (equals_lower(as->tokens[2], "x")) {
+					mode = mode_zpx;
+				}
+				else if (equals_lower(as->tokens[2], "y")) {
+					mode = mode_zpy;
+				}
+				else {
+					return register_error(as, as->tokens[2]);
+				}
+			}
+			else if (number <= 0xFFFF || is_named_addr) {
+				instr_size = 3;
+
+				// Absolute addressing
+				if (as->token_count == 2) {
+					mode = mode_absolute;
+				}
+				else if (equals_lower(as->tokens[2], "x")) {
+					mode = mode_abx;
+				}
+				else if (equals_lower(as->tokens[2], "y")) {
+					mode = mode_aby;
+				}
+				else {
+					return register_error(as, as->tokens[2]);
+				}
+			}
+			else {
+				return assembler_error(as, "Number %llu is too large.", (unsigned long long)number);
+			}
+		}
+	}
+
+	// Apply the high bits which signify the addressing mode
+	switch (mode) {
+	case mode_zeropage: case mode_zpx: case mode_zpy:
+		opcode |= 0x40;
+		break;
+	case mode_abx: case mode_aby: case mode_index_indirect_x: case mode_indirect_index_y:
+		opcode |= 0x80;
+		break;
+	case mode_immediate:
+		opcode |= 0xC0;
+		break;
+	case mode_absolute:
+		opcode |= 0xE0;
+		break;
+	default:
+		return assembler_error(as, "Addressing mode not supported.");
+	}
+
+	// Handle odd instructions out
+	bool is_normal = true;
+	uint8_t bits;
+
+	if (mode == mode_indirect_index_y) {
+		is_normal = false;
+		if (!find_mnemonic(indirect_index_y_instructions, TABLE_SIZE(indirect_index_y_instructions), instr, &bits)) {
+			return assembler_error(as, "No indirect index y instruction %s", lower_copy(instr, lower, sizeof(lower)));
+		}
+		opcode |= bits;
+	}
+
+	// Absolute jumps and misplaced lda/sta
+	if (equals_lower(instr, "jmp")) {
+		is_normal = false;
+		opcode = 0xE9;
+	}
+	else if (equals_lower(instr, "jsr")) {
+		is_normal = false;
+		opcode = 0xEB;
+	}
+	else if (equals_lower(instr, "lda") && (mode == mode_aby || mode == mode_index_indirect_x)) {
+		is_normal = false;
+		opcode = mode == mode_aby ? 0x93 : 0xA3;
+	}
+	else if (equals_lower(instr, "sta") && (mode == mode_aby || mode == mode_index_indirect_x)) {
+		is_normal = false;
+		opcode = mode == mode_aby ? 0xB7 : 0xA7;
+	}
+
+	if (mode == mode_aby) {
+		// Out of place math stuff
+		if (find_mnemonic(absolute_y_instructions, TABLE_SIZE(absolute_y_instructions), instr, &bits)) {
+			is_normal = false;
+			opcode = bits;
+		}
+	}
+	else if (mode == mode_index_indirect_x || mode == mode_indirect_index_y || mode == mode_zpx || mode == mode_zpy) {
+		opcode |= 0x20;
+	}
+
+	if (is_normal) {
+		if (!find_mnemonic(normal_instructions, TABLE_SIZE(normal_instructions), instr, &bits)) {
+			return assembler_error(as, "No normal instruction %s", lower_copy(instr, lower, sizeof(lower)));
+		}
+		opcode |= bits;
+	}
+
+	if (!is_legal_opcode(opcode)) {
+		return assembler_error(as, "Illegal opcode: '0x%x'.", opcode);
+	}
+
+	// Apply everything
+	emit_byte(as, opcode);
+	add_numeric_value(as, number, instr_size == 3 || is_named_addr, instr_size == 2 && !is_named_addr);
+	return 0;
+}
+
+// process_line() from assembler.py
+static int process_line(assembler* as, text_view line) {
+	char lower[32];
+
+	// Delete any commented out section
+	text_view stripped_line = strip(line, " \t\n");
+	const char* semicolon = memchr(stripped_line.text, ';', stripped_line.length);
+	if (semicolon) {
+		stripped_line = strip(make_view(stripped_line.text, semicolon - stripped_line.text), " \t\n");
+	}
+
+	if (stripped_line.length == 0) return 0;
+
+	split_spaces(as, stripped_line);
+
+	// Add a named address
+	if (stripped_line.text[0] == '.') {
+		if (as->token_count == 1) {
+			// Add an address at a given point in the ROM
+			text_view name = strip(slice_from(stripped_line, 1), " \t\n");
+			symbol_set(&as->labels, name, as->size + as->entry_point);
+			as->line_label = name;
+			as->line_defines_label = true;
+		}
+		else {
+			// Name a specific address (name a variable and assign it a memory cell)
+			uint64_t value;
+			if (!get_int(as->tokens[1], &value)) {
+				return assembler_error(as, "'%.*s' is not a number.", (int)as->tokens[1].length, as->tokens[1].text);
+			}
+			text_view name = strip(slice_from(as->tokens[0], 1), " \t\n");
+			symbol_set(&as->variables, name, value);
+			as->line_variable = name;
+			as->line_variable_value = value;
+			as->line_defines_variable = true;
+		}
+		return 0;
+	}
+
+	text_view instr = as->tokens[0];
+	uint8_t opcode;
+
+	if (find_mnemonic(implicit_instructions, TABLE_SIZE(implicit_instructions), instr, &opcode)) {
+		emit_byte(as, opcode);
+		return 0;
+	}
+	else if (as->token_count == 1) {
+		if (!find_mnemonic(single_word_instructions, TABLE_SIZE(single_word_instructions), instr, &opcode)) {
+			return assembler_error(as, "'%s' is not an implicit opcode.", lower_copy(instr, lower, sizeof(lower)));
+		}
+		emit_byte(as, opcode);
+		return 0;
+	}
+	else if (equals_lower(instr, "dat")) {
+		// Insert data into the byte array. A string takes in the whole rest of the line, quirks and all, just like assembler.py.
+		bool is_in_string = false;
+		for (size_t i = 1; i < as->token_count; i++) {
+			text_view item = as->tokens[i];
+			if (is_in_string) {
+				if (view_contains(item, '"')) is_in_string = false;
+			}
+			else if (item.length > 0 && item.text[0] == '"') {
+				// Character string
+				is_in_string = true;
+				text_view string = strip(slice_from(stripped_line, 3), " \"");
+				for (size_t c = 0; c < string.length; c++) {
+					emit_byte(as, (uint8_t)string.text[c]);
+				}
+			}
+			else {
+				uint64_t value;
+				if (!get_int(item, &value)) {
+					return assembler_error(as, "'%.*s' is not a number.", (int)item.length, item.text);
+				}
+				add_numeric_value(as, value, false, false);
+			}
+		}
+		return 0;
+	}
+
+	return process_instruction(as, stripped_line, instr);
+}
+
+// Fill in every label used before its address was known.
+static int resolve_fixups(assembler* as) {
+	for (size_t i = 0; i < as->fixup_count; i++) {
+		const fixup* entry = &as->fixups[i];
+
+		uint64_t address;
+		if (!symbol_get(&as->labels, make_view(entry->name, strlen(entry->name)), &address)) {
+			as->line = entry->line;
+			as->line_number = entry->line_number;
+			return assembler_error(as, "Address/Variable '%s' is not defined.", entry->name);
+		}
+
+		switch (entry->type) {
+		case fixup_all:
+			as->bytes[entry->position + 1] = (uint8_t)(address & 0xFF);
+			as->bytes[entry->position + 2] = (uint8_t)((address >> 8) & 0xFF);
+			break;
+		case fixup_hi:
+			as->bytes[entry->position + 1] = (uint8_t)((address >> 8) & 0xFF);
+			break;
+		case fixup_lo:
+			as->bytes[entry->position + 1] = (uint8_t)(address & 0xFF);
+			break;
+		}
+	}
+	return 0;
+}
+
+static void assembler_free(assembler* as) {
+	symbol_table_free(&as->labels);
+	symbol_table_free(&as->variables);
+
+	for (size_t i = 0; i < as->fixup_count; i++) {
+		free(as->fixups[i].name);
+	}
+	if (as->fixups) free(as->fixups);
+	if (as->tokens) free(as->tokens);
+
+	for (size_t i = 0; i < as->lookup_count; i++) {
+		free(as->lookups[i].name);
+	}
+	if (as->lookups) free(as->lookups);
+}
+
+// Find the next line, ending in \n, \r\n, or \r, same as reading the file in python's text mode. Returns false at the end of the source.
+static bool next_line(const char** cursor, const char* end, text_view* out_line) {
+	const char* line_start = *cursor;
+	if (line_start >= end) return false;
+
+	const char* line_end = line_start;
+	while (line_end < end && *line_end != '\n' && *line_end != '\r') line_end++;
+	*out_line = make_view(line_start, line_end - line_start);
+
+	if (line_end < end && *line_end == '\r') {
+		line_end++;
+		if (line_end < end && *line_end == '\n') line_end++;
+	}
+	else if (line_end < end) {
+		line_end++;
+	}
+	*cursor = line_end;
+	return true;
+}
+
+int kvm_assemble(const char* source, size_t length, uint16_t entry_point, kvm_assembly* out) {
+	if (!out) return -1;
+	out->bytes = NULL;
+	out->size = 0;
+	if (!source) return -1;
+
+	assembler as;
+	memset(&as, 0, sizeof(as));
+	as.entry_point = entry_point;
+
+	const char* cursor = source;
+	int line_number = 0;
+	int result = 0;
+	while (next_line(&cursor, source + length, &as.line)) {
+		as.line_number = line_number++;
+		result = process_line(&as, as.line);
+		if (result != 0) break;
+	}
+
+	if (result == 0) result = resolve_fixups(&as);
+
+	assembler_free(&as);
+
+	if (result != 0) {
+		if (as.bytes) free(as.bytes);
+		return -1;
+	}
+
+	out->bytes = as.bytes;
+	out->size = as.size;
+	return 0;
+}
+
+void kvm_assembly_free(kvm_assembly* assembly) {
+	if (!assembly) return;
+
+	if (assembly->bytes) free(assembly->bytes);
+	assembly->bytes = NULL;
+	assembly->size = 0;
+}
+
+#pragma region Incremental Assembly
+
+// Marks a cached fixup that hasn't been filled in yet. Real addresses never get this big.
+#define NO_ADDRESS UINT64_MAX
+
+typedef struct cached_fixup {
+	size_t offset;		// From the start of the line, where the instruction starts.
+	fixup_type type;
+	size_t label_id;
+	uint64_t patched_value;	// The address that's in the bytes right now, or NO_ADDRESS.
+} cached_fixup;
+
+// One line of source and what it assembled to. Lines with the same text can have different entries,
+// since each one gets its own labels filled in.
+typedef struct cached_line {
+	char* text;
+	size_t length;
+	uint64_t hash;
+
+	uint8_t* bytes;
+	size_t size;
+
+	cached_fixup* fixups;
+	size_t fixup_count;
+
+	// The line only encodes the same way if these variables still have the same values.
+	variable_lookup* lookups;
+	size_t lookup_count;
+
+	bool defines_label;
+	size_t label_id;
+	char* variable_name;	// NULL if the line doesn't define a variable.
+	uint64_t variable_value;
+
+	uint64_t last_used;	// The generation that last used the line.
+	struct cached_line* next;	// Next line in the same bucket.
+} cached_line;
+
+typedef struct cached_label {
+	char* name;
+	uint64_t value;
+	uint64_t defined_generation;	// Only defined in this assembly if this is the current generation.
+} cached_label;
+
+struct kvm_assembler_cache {
+	uint16_t entry_point;
+	uint64_t generation;	// Goes up once per kvm_assemble_cached().
+
+	// Every cached line, chained by hash of the text.
+	cached_line** buckets;
+	size_t bucket_count;
+	size_t line_count;
+
+	// Label names get a number the first time they're seen, so fixups don't have to look them up by name.
+	symbol_table label_ids;
+	cached_label* labels;
+	size_t label_count;
+	size_t label_capacity;
+
+	// Assembles the lines that aren't cached. Its variables table is the one for the whole program.
+	assembler scratch;
+
+	// The lines of the current program, in order.
+	cached_line** order;
+	size_t order_count;
+	size_t order_capacity;
+};
+
+static void cached_line_free(cached_line* line) {
+	free(line->text);
+	if (line->bytes) free(line->bytes);
+	if (line->fixups) free(line->fixups);
+	for (size_t i = 0; i < line->lookup_count; i++) {
+		free(line->lookups[i].name);
+	}
+	if (line->lookups) free(line->lookups);
+	if (line->variable_name) free(line->variable_name);
+	free(line);
+}
+
+static size_t get_label_id(kvm_assembler_cache* cache, text_view name) {
+	uint64_t id;
+	if (symbol_get(&cache->label_ids, name, &id)) return (size_t)id;
+
+	cache->labels = grow_array(cache->labels, cache->label_count, &cache->label_capacity, sizeof(cached_label), 64);
+	cached_label* label = &cache->labels[cache->label_count];
+	label->name = copy_string(name);
+	label->value = 0;
+	label->defined_generation = 0;
+
+	symbol_set(&cache->label_ids, name, cache->label_count);
+	return cache->label_count++;
+}
+
+static bool lookups_still_match(const symbol_table* variables, const cached_line* line) {
+	for (size_t i = 0; i < line->lookup_count; i++) {
+		const variable_lookup* lookup = &line->lookups[i];
+
+		uint64_t value;
+		bool found = symbol_get(variables, make_view(lookup->name, strlen(lookup->name)), &value);
+		if (found != lookup->found || (found && value != lookup->value)) return false;
+	}
+	return true;
+}
+
+// Find a cached line with the same text, that isn't already used in this assembly, and that still encodes the same way.
+static cached_line* find_cached_line(kvm_assembler_cache* cache, text_view text, uint64_t hash) {
+	for (cached_line* line = cache->buckets[hash & (cache->bucket_count - 1)]; line; line = line->next) {
+		if (line->hash != hash || line->last_used == cache->generation) continue;
+		if (!view_equals(make_view(line->text, line->length), text)) continue;
+		if (lookups_still_match(&cache->scratch.variables, line)) return line;
+	}
+	return NULL;
+}
+
+static void rehash_lines(kvm_assembler_cache* cache, size_t new_bucket_count) {
+	cached_line** new_buckets = malloc(new_bucket_count * sizeof(cached_line*));
+	memset(new_buckets, 0, new_bucket_count * sizeof(cached_line*));
+
+	for (size_t i = 0; i < cache->bucket_count; i++) {
+		cached_line* line = cache->buckets[i];
+		while (line) {
+			cached_line* next = line->next;
+			size_t bucket = line->hash & (new_bucket_count - 1);
+			line->next = new_buckets[bucket];
+			new_buckets[bucket] = line;
+			line = next;
+		}
+	}
+
+	if (cache->buckets) free(cache->buckets);
+	cache->buckets = new_buckets;
+	cache->bucket_count = new_bucket_count;
+}
+
+// Throw away what the last line left in the scratch assembler.
+static void clear_scratch_line(assembler* as) {
+	for (size_t i = 0; i < as->fixup_count; i++) {
+		free(as->fixups[i].name);
+	}
+	for (size_t i = 0; i < as->lookup_count; i++) {
+		free(as->lookups[i].name);
+	}
+	as->fixup_count = 0;
+	as->lookup_count = 0;
+	as->size = 0;
+	as->line_defines_label = false;
+	as->line_defines_variable = false;
+}
+
+// Assemble a line that isn't cached and cache it. Returns NULL on an error, which has already been printed.
+static cached_line* encode_line(kvm_assembler_cache* cache, text_view text, uint64_t hash, int line_number) {
+	assembler* as = &cache->scratch;
+	clear_scratch_line(as);
+	as->line = text;
+	as->line_number = line_number;
+
+	if (process_line(as, text) != 0) {
+		clear_scratch_line(as);
+		return NULL;
+	}
+
+	cached_line* line = malloc(sizeof(cached_line));
+	memset(line, 0, sizeof(cached_line));
+	line->text = copy_string(text);
+	line->length = text.length;
+	line->hash = hash;
+
+	if (as->size) {
+		line->bytes = malloc(as->size);
+		memcpy(line->bytes, as->bytes, as->size);
+		line->size = as->size;
+	}
+
+	if (as->fixup_count) {
+		line->fixups = malloc(as->fixup_count * sizeof(cached_fixup));
+		for (size_t i = 0; i < as->fixup_count; i++) {
+			const fixup* entry = &as->fixups[i];
+			line->fixups[i].offset = entry->position;
+			line->fixups[i].type = entry->type;
+			line->fixups[i].label_id = get_label_id(cache, make_view(entry->name, strlen(entry->name)));
+			line->fixups[i].patched_value = NO_ADDRESS;
+		}
+		line->fixup_count = as->fixup_count;
+	}
+
+	// The lookups move over as they are, names and all.
+	if (as->lookup_count) {
+		line->lookups = malloc(as->lookup_count * sizeof(variable_lookup));
+		memcpy(line->lookups, as->lookups, as->lookup_count * sizeof(variable_lookup));
+		line->lookup_count = as->lookup_count;
+		as->lookup_count = 0;
+	}
+
+	if (as->line_defines_label) {
+		line->defines_label = true;
+		line->label_id = get_label_id(cache, as->line_label);
+	}
+	if (as->line_defines_variable) {
+		line->variable_name = copy_string(as->line_variable);
+		line->variable_value = as->line_variable_value;
+	}
+
+	clear_scratch_line(as);
+
+	if (cache->line_count + 1 > cache->bucket_count) rehash_lines(cache, cache->bucket_count * 2);
+	size_t bucket = hash & (cache->bucket_count - 1);
+	line->next = cache->buckets[bucket];
+	cache->buckets[bucket] = line;
+	cache->line_count++;
+
+	return line;
+}
+
+// Fill in the labels that moved since the line was last assembled. Returns false if one isn't defined.
+static bool patch_line(kvm_assembler_cache* cache, cached_line* line, int line_number) {
+	for (size_t i = 0; i < line->fixup_count; i++) {
+		cached_fixup* entry = &line->fixups[i];
+		const cached_label* label = &cache->labels[entry->label_id];
+
+		if (label->defined_generation != cache->generation) {
+			cache->scratch.line = make_view(line->text, line->length);
+			cache->scratch.line_number = line_number;
+			assembler_error(&cache->scratch, "Address/Variable '%s' is not defined.", label->name);
+			return false;
+		}
+
+		if (label->value == entry->patched_value) continue;
+
+		uint64_t address = label->value;
+		switch (entry->type) {
+		case fixup_all:
+			line->bytes[entry->offset + 1] = (uint8_t)(address & 0xFF);
+			line->bytes[entry->offset + 2] = (uint8_t)((address >> 8) & 0xFF);
+			break;
+		case fixup_hi:
+			line->bytes[entry->offset + 1] = (uint8_t)((address >> 8) & 0xFF);
+			break;
+		case fixup_lo:
+			line->bytes[entry->offset + 1] = (uint8_t)(address & 0xFF);
+			break;
+		}
+		entry->patched_value = address;
+	}
+	return true;
+}
+
+// Free every line the last assembly didn't use.
+static void evict_unused_lines(kvm_assembler_cache* cache) {
+	for (size_t i = 0; i < cache->bucket_count; i++) {
+		cached_line** link = &cache->buckets[i];
+		while (*link) {
+			cached_line* line = *link;
+			if (line->last_used == cache->generation) {
+				link = &line->next;
+				continue;
+			}
+			*link = line->next;
+			cached_line_free(line);
+			cache->line_count--;
+		}
+	}
+}
+
+kvm_assembler_cache* kvm_assembler_cache_create(uint16_t entry_point) {
+	kvm_assembler_cache* cache = malloc(sizeof(kvm_assembler_cache));
+	memset(cache, 0, sizeof(kvm_assembler_cache));
+
+	cache->entry_point = entry_point;
+	cache->scratch.entry_point = entry_point;
+	cache->scratch.record_lookups = true;
+	rehash_lines(cache, 256);
+
+	return cache;
+}
+
+void kvm_assembler_cache_free(kvm_assembler_cache* cache) {
+	if (!cache) return;
+
+	for (size_t i = 0; i < cache->bucket_count; i++) {
+		cached_line* line = cache->buckets[i];
+		while (line) {
+			cached_line* next = line->next;
+			cached_line_free(line);
+			line = next;
+		}
+	}
+	free(cache->buckets);
+
+	for (size_t i = 0; i < cache->label_count; i++) {
+		free(cache->labels[i].name);
+	}
+	if (cache->labels) free(cache->labels);
+	symbol_table_free(&cache->label_ids);
+
+	clear_scratch_line(&cache->scratch);
+	assembler_free(&cache->scratch);
+	if (cache->scratch.bytes) free(cache->scratch.bytes);
+
+	if (cache->order) free(cache->order);
+	free(cache);
+}
+
+int kvm_assemble_cached(kvm_assembler_cache* cache, const char* source, size_t length, kvm_assembly* out) {
+	if (!out) return -1;
+	out->bytes = NULL;
+	out->size = 0;
+	if (!cache || !source) return -1;
+
+	cache->generation++;
+	cache->order_count = 0;
+	symbol_table_free(&cache->scratch.variables);
+	symbol_table_free(&cache->scratch.labels);
+
+	// First pass: find or assemble every line, and lay out the labels.
+	const char* cursor = source;
+	text_view text;
+	size_t size = 0;
+	while (next_line(&cursor, source + length, &text)) {
+		int line_number = (int)cache->order_count;
+		uint64_t hash = hash_name(text);
+
+		cached_line* line = find_cached_line(cache, text, hash);
+		if (line) {
+			if (line->variable_name) {
+				symbol_set(&cache->scratch.variables, make_view(line->variable_name, strlen(line->variable_name)), line->variable_value);
+			}
+		}
+		else {
+			line = encode_line(cache, text, hash, line_number);
+			if (!line) return -1;
+		}
+		line->last_used = cache->generation;
+
+		if (line->defines_label) {
+			cached_label* label = &cache->labels[line->label_id];
+			label->value = size + cache->entry_point;
+			label->defined_generation = cache->generation;
+		}
+		size += line->size;
+
+		cache->order = grow_array(cache->order, cache->order_count, &cache->order_capacity, sizeof(cached_line*), 256);
+		cache->order[cache->order_count++] = line;
+	}
+
+	// Second pass: fill in labels, but only where they've moved.
+	for (size_t i = 0; i < cache->order_count; i++) {
+		if (!patch_line(cache, cache->order[i], (int)i)) return -1;
+	}
+
+	evict_unused_lines(cache);
+
+	if (size) {
+		out->bytes = malloc(size);
+		size_t position = 0;
+		for (size_t i = 0; i < cache->order_count; i++) {
+			const cached_line* line = cache->order[i];
+			if (line->size) memcpy(out->bytes + position, line->bytes, line->size);
+			position += line->size;
+		}
+		out->size = size;
+	}
+	return 0;
+}
+
+#pragma endregion
@@ -0,0 +1,41 @@
+/*	Header for the built in assembler.
+*	Author: Matthew Watson
+*/
+
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+A C port of assembler.py, so programs can go straight from the editor into ROM without starting python or touching the disk.
+It gives the same bytes as assembler.py for any program assembler.py accepts, quirks included, and prints errors the same way.
+*/
+
+// Goes up whenever the same source would assemble differently, so programs saved in the build cache (see kvm_cache.h) get assembled again.
+#define KVM_ASSEMBLER_VERSION 1
+
+// The bytes of an assembled program. Free with kvm_assembly_free().
+typedef struct kvm_assembly {
+	uint8_t* bytes;
+	size_t size;
+} kvm_assembly;
+
+// Assemble length bytes of source (it doesn't need to be null terminated) for a program that starts at entry_point.
+// Returns 0 on success. On an error, it's printed and -1 is returned, and out is left empty.
+int kvm_assemble(const char* source, size_t length, uint16_t entry_point, kvm_assembly* out);
+
+void kvm_assembly_free(kvm_assembly* assembly);
+
+/*
+Incremental assembly, for programs that get assembled over and over while they're being edited.
+The cache remembers what every line assembled to. Next time, only lines that changed (or that use a variable whose value changed) get assembled again,
+and only the addresses of labels that moved get filled in again. The bytes come out the same as kvm_assemble().
+*/
+typedef struct kvm_assembler_cache kvm_assembler_cache;
+
+kvm_assembler_cache* kvm_assembler_cache_create(uint16_t entry_point);
+void kvm_assembler_cache_free(kvm_assembler_cache* cache);
+
+// Same as kvm_assemble(), using and updating the cache. Lines the program no longer has are dropped from the cache.
+int kvm_assemble_cached(kvm_assembler_cache* cache, const char* source, size_t length, kvm_assembly* out);
@@ -0,0 +1,313 @@
+/*	Batch runner for the KSU Micro VM.
+*	Runs a list of already assembled programs headless, with one VM per worker thread, and reports
+*	a hash of the final memory and frame for each one. Workers take jobs from their own queue first and
+*	steal from the back of the others' queues once theirs runs dry, so long jobs don't leave cores idle.
+*
+*	Usage: kvm_batch <job file> [-threads N] [-jit] [-o results.csv]
+*	Job file, one job per line ('#' starts a comment):
+*	    <binary file> <cycle budget> [input script]
+*	Results are CSV lines in job order:
+*	    binary,result,cycles,frames,memory_hash,frame_hash,milliseconds
+*	where result is quit, cycle_limit, or error.
+*
+*	Build with LEAKCHECK_DISABLE defined for timing runs, leakcheck puts every allocation behind one lock.
+*	Author: Matthew Watson
+*/
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <SDL.h>
+
+#include "kvm.h"
+#include "leakcheck_util.h"
+
+#define MAX_JOBS 4096
+#define MAX_PATH_LENGTH 260
+
+typedef struct batch_job {
+	char binary[MAX_PATH_LENGTH];
+	char input_script[MAX_PATH_LENGTH];	// Empty for no input.
+	int cycle_budget;
+
+	// Results
+	kvm_run_status result;
+	size_t cycles;
+	uint32_t frames;
+	uint64_t memory_hash;
+	uint64_t frame_hash;
+	double milliseconds;
+} batch_job;
+
+// Job indices owned by one worker. The owner takes from the front, thieves take from the back.
+typedef struct job_queue {
+	int* jobs;
+	int head, tail;
+	SDL_mutex* lock;
+} job_queue;
+
+typedef struct batch_worker {
+	int id;
+	kvm_context* kvm;
+	job_queue queue;
+
+	struct batch_worker* all_workers;
+	int worker_count;
+	batch_job* jobs;
+} batch_worker;
+
+#pragma region Job Queues
+
+static bool queue_pop_front(job_queue* queue, int* out_job) {
+	SDL_LockMutex(queue->lock);
+	bool found = queue->head < queue->tail;
+	if (found) *out_job = queue->jobs[queue->head++];
+	SDL_UnlockMutex(queue->lock);
+
+	return found;
+}
+
+static bool queue_pop_back(job_queue* queue, int* out_job) {
+	SDL_LockMutex(queue->lock);
+	bool found = queue->head < queue->tail;
+	if (found) *out_job = queue->jobs[--queue->tail];
+	SDL_UnlockMutex(queue->lock);
+
+	return found;
+}
+
+// Get the next job for a worker, stealing one if its own queue is empty. Returns -1 when every queue is empty.
+// Jobs are never added once the workers start, so empty queues stay empty.
+static int take_job(batch_worker* worker) {
+	int job;
+	if (queue_pop_front(&worker->queue, &job)) return job;
+
+	for (int i = 1; i < worker->worker_count; i++) {
+		batch_worker* victim = &worker->all_workers[(worker->id + i) % worker->worker_count];
+		if (queue_pop_back(&victim->queue, &job)) return job;
+	}
+
+	return -1;
+}
+
+static const char* result_name(kvm_run_status result) {
+	switch (result) {
+	case kvm_run_quit: return "quit";
+	case kvm_run_cycle_limit: return "cycle_limit";
+	default: return "error";
+	}
+}
+
+#pragma endregion
+
+static uint64_t fnv1a(uint64_t hash, const uint8_t* data, size_t length) {
+	for (size_t i = 0; i < length; i++) {
+		hash ^= data[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+
+static void run_job(kvm_context* kvm, batch_job* job) {
+	// Every job starts from a fresh machine.
+	kvm_quit(kvm);
+	kvm_set_input_script(kvm, job->input_script[0] ? job->input_script : NULL);
+
+	uint64_t start_time = SDL_GetPerformanceCounter();
+
+	job->result = kvm_run_error;
+	if (kvm_init(kvm) == 0 && kvm_load_binary(kvm, job->binary) == 0) {
+		kvm_set_cycle_limit(kvm, job->cycle_budget);
+		job->result = kvm_run(kvm, 0, false);
+	}
+
+	job->milliseconds = (double)(SDL_GetPerformanceCounter() - start_time) * 1000.0 / (double)SDL_GetPerformanceFrequency();
+
+	job->cycles = kvm_get_cycle_count(kvm);
+	job->frames = kvm_get_frame_count(kvm);
+	job->memory_hash = fnv1a(FNV_OFFSET_BASIS, kvm_get_memory_pointer(kvm), kvm_get_memory_size(kvm));
+
+	job->frame_hash = FNV_OFFSET_BASIS;
+	SDL_Surface* frame = kvm_get_display_surface(kvm);
+	if (frame) {
+		// Only hash the visible part of each row, the padding can hold anything.
+		for (int y = 0; y < frame->h; y++) {
+			const uint8_t* row = (const uint8_t*)frame->pixels + y * frame->pitch;
+			job->frame_hash = fnv1a(job->frame_hash, row, (size_t)frame->w * frame->format->BytesPerPixel);
+		}
+	}
+}
+
+static int worker_main(void* data) {
+	batch_worker* worker = (batch_worker*)data;
+
+	int job;
+	while ((job = take_job(worker)) >= 0) {
+		run_job(worker->kvm, &worker->jobs[job]);
+	}
+
+	return 0;
+}
+
+// Read the job file. Returns the number of jobs, or -1 if the file couldn't be read.
+static int load_jobs(const char* filename, batch_job* jobs, int max_jobs) {
+	FILE* job_file = fopen(filename, "r");
+	if (!job_file) {
+		printf("Error opening job file %s.\n", filename);
+		return -1;
+	}
+
+	int job_count = 0;
+	char line[2 * MAX_PATH_LENGTH + 32];
+	int line_number = 0;
+	while (fgets(line, sizeof(line), job_file)) {
+		line_number++;
+
+		char* comment = strchr(line, '#');
+		if (comment) *comment = '\0';
+
+		// Parse into a local first, jobs only has room for max_jobs of them.
+		batch_job job;
+		memset(&job, 0, sizeof(job));
+		int fields = sscanf(line, "%259s %d %259s", job.binary, &job.cycle_budget, job.input_script);
+		if (fields <= 0) continue; // Blank line
+
+		if (fields < 2) {
+			printf("Error in job file %s, line %d: %s\n", filename, line_number, line);
+			continue;
+		}
+
+		if (job_count == max_jobs) {
+			printf("Too many jobs in %s, only running the first %d.\n", filename, max_jobs);
+			break;
+		}
+		jobs[job_count++] = job;
+	}
+
+	fclose(job_file);
+	return job_count;
+}
+
+static void free_workers(batch_worker* workers, int worker_count) {
+	for (int i = 0; i < worker_count; i++) {
+		kvm_context_free(workers[i].kvm);
+		SDL_DestroyMutex(workers[i].queue.lock);
+		free(workers[i].queue.jobs);
+	}
+	free(workers);
+}
+
+int main(int argc, char* argv[]) {
+	if (argc < 2) {
+		printf("Usage: kvm_batch <job file> [-threads N] [-jit] [-o results.csv]\n");
+		return -1;
+	}
+
+	int thread_count = SDL_GetCPUCount();
+	bool use_jit = false;
+	const char* output_filename = NULL;
+
+	for (int i = 2; i < argc; i++) {
+		if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc) {
+			thread_count = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-jit") == 0) {
+			use_jit = true;
+		}
+		else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+			output_filename = argv[++i];
+		}
+		else {
+			printf("Unknown argument %s.\n", argv[i]);
+			return -1;
+		}
+	}
+
+	batch_job* jobs = malloc(MAX_JOBS * sizeof(batch_job));
+	int job_count = load_jobs(argv[1], jobs, MAX_JOBS);
+	if (job_count <= 0) {
+		free(jobs);
+		return -1;
+	}
+
+	if (thread_count < 1) thread_count = 1;
+	if (thread_count > job_count) thread_count = job_count;
+
+	// Deal the jobs out round robin, stealing evens things out from there.
+	batch_worker* workers = malloc(thread_count * sizeof(batch_worker));
+	for (int i = 0; i < thread_count; i++) {
+		batch_worker* worker = &workers[i];
+		worker->id = i;
+		worker->all_workers = workers;
+		worker->worker_count = thread_count;
+		worker->jobs = jobs;
+
+		worker->queue.jobs = malloc(job_count * sizeof(int));
+		worker->queue.head = 0;
+		worker->queue.tail = 0;
+		worker->queue.lock = SDL_CreateMutex();
+
+		worker->kvm = kvm_context_create();
+		kvm_set_headless(worker->kvm, true);
+		kvm_set_jit_enabled(worker->kvm, use_jit);
+	}
+
+	for (int i = 0; i < job_count; i++) {
+		job_queue* queue = &workers[i % thread_count].queue;
+		queue->jobs[queue->tail++] = i;
+	}
+
+	uint64_t start_time = SDL_GetPerformanceCounter();
+
+	// If a worker can't start, the ones that did still drain every queue, but the run doesn't count.
+	bool all_started = true;
+	SDL_Thread** threads = malloc(thread_count * sizeof(SDL_Thread*));
+	for (int i = 0; i < thread_count; i++) {
+		threads[i] = SDL_CreateThread(worker_main, "kvm_batch_worker", &workers[i]);
+		if (!threads[i]) {
+			printf("Error creating worker thread %d: %s\n", i, SDL_GetError());
+			all_started = false;
+		}
+	}
+	for (int i = 0; i < thread_count; i++) {
+		if (threads[i]) SDL_WaitThread(threads[i], NULL);
+	}
+
+	double total_seconds = (double)(SDL_GetPerformanceCounter() - start_time) / (double)SDL_GetPerformanceFrequency();
+
+	if (!all_started) {
+		free_workers(workers, thread_count);
+		free(threads);
+		free(jobs);
+		return -1;
+	}
+
+	FILE* output = stdout;
+	if (output_filename) {
+		output = fopen(output_filename, "w");
+		if (!output) {
+			printf("Error opening %s, writing results to stdout instead.\n", output_filename);
+			output = stdout;
+		}
+	}
+
+	fprintf(output, "binary,result,cycles,frames,memory_hash,frame_hash,milliseconds\n");
+	for (int i = 0; i < job_count; i++) {
+		const batch_job* job = &jobs[i];
+		fprintf(output, "%s,%s,%llu,%u,%016llx,%016llx,%.3f\n", job->binary, result_name(job->result), (unsigned long long)job->cycles, job->frames,
+			(unsigned long long)job->memory_hash, (unsigned long long)job->frame_hash, job->milliseconds);
+	}
+	if (output != stdout) fclose(output);
+
+	printf("Ran %d jobs on %d threads in %.3f seconds.\n", job_count, thread_count, total_seconds);
+
+	free_workers(workers, thread_count);
+	free(threads);
+	free(jobs);
+
+	return 0;
+}
@@ -0,0 +1,117 @@
+/*	Build cache, so unchanged graphics and programs don't get converted again on every run.
+*	Author: Matthew Watson
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#define make_directory(path) _mkdir(path)
+#else
+#include <sys/stat.h>
+#define make_directory(path) mkdir(path, 0777)
+#endif
+
+#include "kvm_cache.h"
+#include "leakcheck_util.h"
+
+#define CACHE_MAGIC "KVMC"
+
+// Comes before the output in every cache file.
+typedef struct cache_header {
+	char magic[4];
+	uint32_t size;
+	kvm_cache_key key;
+} cache_header;
+
+static void get_cache_filename(kvm_cache_key key, const char* extension, const char* suffix, char* filename, size_t filename_size) {
+	snprintf(filename, filename_size, "%s/%016llx.%s%s", KVM_CACHE_DIRECTORY, (unsigned long long)key, extension, suffix);
+}
+
+kvm_cache_key kvm_cache_hash(kvm_cache_key hash, const void* data, size_t length) {
+	// FNV-1a
+	const uint8_t* bytes = (const uint8_t*)data;
+	for (size_t i = 0; i < length; i++) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+bool kvm_cache_hash_file(kvm_cache_key hash, const char* filename, kvm_cache_key* out_key) {
+	FILE* file = fopen(filename, "rb");
+	if (!file) return false;
+
+	uint8_t buffer[4096];
+	size_t read;
+	while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+		hash = kvm_cache_hash(hash, buffer, read);
+	}
+	fclose(file);
+
+	*out_key = hash;
+	return true;
+}
+
+bool kvm_cache_read(kvm_cache_key key, const char* extension, void* dest, size_t capacity, size_t* out_size) {
+	char filename[128];
+	get_cache_filename(key, extension, "", filename, sizeof(filename));
+
+	FILE* file = fopen(filename, "rb");
+	if (!file) return false;
+
+	cache_header header;
+	bool hit = fread(&header, sizeof(header), 1, file) == 1
+		&& memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) == 0
+		&& header.key == key
+		&& header.size <= capacity;
+
+	// dest is often guest memory, so it's only touched once the whole entry has been read and checked.
+	// A truncated entry, or one with extra bytes after it, is a miss.
+	uint8_t* payload = NULL;
+	if (hit) {
+		payload = malloc(header.size ? header.size : 1);
+		hit = fread(payload, 1, header.size, file) == header.size && fgetc(file) == EOF;
+	}
+	fclose(file);
+
+	if (hit) {
+		memcpy(dest, payload, header.size);
+		*out_size = header.size;
+	}
+	if (payload) free(payload);
+	return hit;
+}
+
+void kvm_cache_write(kvm_cache_key key, const char* extension, const void* data, size_t size) {
+	if (size > UINT32_MAX) return;
+
+	// Fails harmlessly if it's already there.
+	make_directory(KVM_CACHE_DIRECTORY);
+
+	char filename[128];
+	char temp_filename[128];
+	get_cache_filename(key, extension, "", filename, sizeof(filename));
+	get_cache_filename(key, extension, ".tmp", temp_filename, sizeof(temp_filename));
+
+	// Write it somewhere else first, so nobody reads it half done. Two writers with the same key write the same bytes.
+	FILE* file = fopen(temp_filename, "wb");
+	if (!file) return;
+
+	cache_header header;
+	memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+	header.size = (uint32_t)size;
+	header.key = key;
+	bool written = fwrite(&header, sizeof(header), 1, file) == 1 && fwrite(data, 1, size, file) == size;
+	written = fclose(file) == 0 && written;
+
+	if (!written) {
+		remove(temp_filename);
+		return;
+	}
+
+	// rename() won't replace a file on Windows, but then the output is already cached.
+	if (rename(temp_filename, filename) != 0) remove(temp_filename);
+}
@@ -0,0 +1,32 @@
+/*	Header for the build cache
+*	Author: Matthew Watson
+*/
+
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+Outputs of slow conversions (like assembling a program) get saved in the cache folder, named by a hash of the input and the version
+of the tool that made them. If neither has changed, the saved output is read straight into memory and the tool doesn't run at all.
+Each file starts with a small header so a half written or mismatched file is treated as a miss instead of being loaded.
+*/
+
+#define KVM_CACHE_DIRECTORY "cache"
+
+typedef uint64_t kvm_cache_key;
+
+// Start of a hash, then feed in data with kvm_cache_hash(). The result is the key.
+#define KVM_CACHE_HASH_START 14695981039346656037ULL
+kvm_cache_key kvm_cache_hash(kvm_cache_key hash, const void* data, size_t length);
+
+// Hash the whole file into hash. Returns false if it can't be read.
+bool kvm_cache_hash_file(kvm_cache_key hash, const char* filename, kvm_cache_key* out_key);
+
+// Read the output saved under key (with an extension like "kvmpix") into dest, if it's there and fits in capacity.
+// Returns true on a hit, with the size in out_size.
+bool kvm_cache_read(kvm_cache_key key, const char* extension, void* dest, size_t capacity, size_t* out_size);
+
+// Save an output under key. Failing to save isn't an error, the output just gets made again next time.
+void kvm_cache_write(kvm_cache_key key, const char* extension, const void* data, size_t size);
@@ -2,6 +2,7 @@
 *	Author: Matthew Watson
 */
 
+#include <SDL.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -9,6 +10,8 @@
 #include "leakcheck_util.h"
 
 #include "kvm_cpu.h"
+#include "kvm_cpu_threaded.h"
+#include "kvm_cpu_blocks.h"
 #include "kvm_mem_map_constants.h"
 
 static uint8_t extract_bits(uint8_t target, uint8_t mask, uint8_t shift) {
@@ -19,6 +22,20 @@ uint8_t kvm_cpu_fetch_byte(kvm_memory* mem, size_t index) {
 	return kvm_memory_get_byte(mem, index);
 }
 
+// An opcode always decodes to the same instruction, so all 256 of them are decoded once at init time.
+// kvm_cpu_cycle() indexes this table instead of decoding every cycle.
+static kvm_instruction decoded_instructions[256];
+
+// Non-zero for opcodes that don't follow the usual encoding, so their class has to be picked by hand.
+static int odd_opcodes_out[256];
+
+// The tables above never change once built, so every CPU (and every VM) shares them.
+// CPUs can be made from several threads at once, so only the first one in builds them, and the rest wait until they're done.
+#define DECODE_TABLES_EMPTY 0
+#define DECODE_TABLES_BUILDING 1
+#define DECODE_TABLES_READY 2
+static SDL_atomic_t decode_tables_state;
+
 #pragma region Helper functions for decoding.
 
 static void instr_reset_defaults(kvm_instruction* out_instr) {
@@ -515,6 +532,10 @@ void kvm_cpu_decode_instr(kvm_instruction *out_instr, uint8_t instruction) {
 	//print_instr(cpu->current_instruction);
 }
 
+const kvm_instruction* kvm_cpu_get_decoded_instr(uint8_t opcode) {
+	return &decoded_instructions[opcode];
+}
+
 #pragma region Helper functions for execution.
 static void cpu_set_processor_status(kvm_cpu* cpu, bool carry, bool zero, bool interrupt_disable, bool break_command, bool twos_complement_overflow, bool negative) {
 	uint8_t carry_set = (uint8_t)carry;
@@ -568,11 +589,11 @@ static void push_stack(kvm_cpu* cpu, kvm_memory* mem, kvm_register_operand r) {
 		break;
 	}
 
-	mem->data[stptr + STACK_PTR_OFFSET] = highbyte;
+	kvm_memory_write_byte(mem, stptr + STACK_PTR_OFFSET, highbyte);
 	stptr--;
 
 	if (twobytes) {
-		mem->data[stptr + STACK_PTR_OFFSET] = lowbyte;
+		kvm_memory_write_byte(mem, stptr + STACK_PTR_OFFSET, lowbyte);
 		stptr--;
 	}
 	// TODO: add bounds checking, throw stack overflow error.
@@ -890,7 +911,7 @@ void kvm_cpu_execute_instr(kvm_cpu* cpu, kvm_memory* mem) {
 
 		switch (instr->register_operand) {
 		case kvmr_none:
-			mem->data[target_address] = current;
+			kvm_memory_write_byte(mem, target_address, current);
 			break;
 		case kvmr_x_index:
 			cpu->x_index = current;
@@ -932,7 +953,7 @@ void kvm_cpu_execute_instr(kvm_cpu* cpu, kvm_memory* mem) {
 
 		switch (instr->register_operand) {
 		case kvmr_none:
-			mem->data[target_address] = current;
+			kvm_memory_write_byte(mem, target_address, current);
 			break;
 		case kvmr_x_index:
 			cpu->x_index = current;
@@ -956,7 +977,7 @@ void kvm_cpu_execute_instr(kvm_cpu* cpu, kvm_memory* mem) {
 		else {
 			old_bit_7 = value_at_address & 0x80;
 			result = value_at_address << 1;
-			mem->data[target_address] = result;
+			kvm_memory_write_byte(mem, target_address, result);
 		}
 		update_zero_and_negative_flags(cpu, result);
 		cpu_set_status_flag(cpu, CPU_CARRY_FLAG, old_bit_7);
@@ -974,7 +995,7 @@ void kvm_cpu_execute_instr(kvm_cpu* cpu, kvm_memory* mem) {
 		else {
 			old_bit_0 = value_at_address & 0x01;
 			result = value_at_address >> 1;
-			mem->data[target_address] = result;
+			kvm_memory_write_byte(mem, target_address, result);
 		}
 		update_zero_and_negative_flags(cpu, result);
 		cpu_set_status_flag(cpu, CPU_CARRY_FLAG, old_bit_0);
@@ -993,7 +1014,7 @@ void kvm_cpu_execute_instr(kvm_cpu* cpu, kvm_memory* mem) {
 		else {
 			old_bit_7 = value_at_address & 0x80;
 			result = value_at_address << 1 | old_carry;
-			mem->data[target_address] = result;
+			kvm_memory_write_byte(mem, target_address, result);
 		}
 		update_zero_and_negative_flags(cpu, result);
 		cpu_set_status_flag(cpu, CPU_CARRY_FLAG, old_bit_7);
@@ -1012,7 +1033,7 @@ void kvm_cpu_execute_instr(kvm_cpu* cpu, kvm_memory* mem) {
 		else {
 			old_bit_0 = value_at_address & 0x01;
 			result = value_at_address >> 1 | old_carry;
-			mem->data[target_address] = result;
+			kvm_memory_write_byte(mem, target_address, result);
 		}
 		update_zero_and_negative_flags(cpu, result);
 		cpu_set_status_flag(cpu, CPU_CARRY_FLAG, old_bit_0);
@@ -1056,7 +1077,7 @@ void kvm_cpu_execute_instr(kvm_cpu* cpu, kvm_memory* mem) {
 			break;
 		}
 
-		mem->data[target_address] = value_at_address;
+		kvm_memory_write_byte(mem, target_address, value_at_address);
 	}
 		break;
 	case kvmc_branch_if_clear:
@@ -1156,11 +1177,17 @@ void kvm_cpu_execute_instr(kvm_cpu* cpu, kvm_memory* mem) {
 
 
 void kvm_cpu_cycle(kvm_cpu* cpu, kvm_memory* mem) {
+	if (cpu->core != kvm_core_switch) {
+		kvm_cpu_threaded_cycle(cpu, mem);
+		return;
+	}
+
 	uint16_t pc = cpu->program_counter;
 
 	uint8_t current_opcode = kvm_cpu_fetch_byte(mem, pc++);
 
-	kvm_cpu_decode_instr(cpu->current_instruction, current_opcode);
+	// Decoding was already done for every opcode in kvm_cpu_init(), so just copy it over.
+	*cpu->current_instruction = decoded_instructions[current_opcode];
 
 
 	// Operand fetch
@@ -1188,27 +1215,38 @@ void kvm_cpu_cycle(kvm_cpu* cpu, kvm_memory* mem) {
 	*/
 }
 
-void kvm_cpu_print_status(kvm_cpu* cpu) {
-	printf("Program Counter: %x\nAccumulator: %x\nX: %x\nY: %x\nStack Pointer: %x\nProcessor Status: %x\n", cpu->program_counter, cpu->accumulator, cpu->x_index, cpu->y_index, cpu->stack_ptr, cpu->processor_status);
-}
-
-kvm_cpu* kvm_cpu_init(void) {
-	kvm_cpu* cpu = malloc(sizeof(kvm_cpu));
+int kvm_cpu_run_block(kvm_cpu* cpu, kvm_memory* mem, int max_instructions) {
+	if (cpu->core == kvm_core_block || cpu->core == kvm_core_jit) {
+		return kvm_block_cache_run(cpu->block_cache, cpu, mem, max_instructions);
+	}
 
-	cpu->accumulator = 0;
-	cpu->x_index = 0;
-	cpu->y_index = 0;
+	kvm_cpu_cycle(cpu, mem);
+	return 1;
+}
 
-	cpu->stack_ptr = STACK_PTR_DEFAULT;
+int kvm_cpu_run(kvm_cpu* cpu, kvm_memory* mem, int max_instructions) {
+	int executed = 0;
 
-	cpu->program_counter = INSTRUCTION_ROM_MEM_LOC;
+	// Stores to the syscall address raise syscall_pending, so memory doesn't need to be checked between batches.
+	while (!mem->syscall_pending) {
+		if (max_instructions > 0) {
+			if (executed >= max_instructions) break;
+			executed += kvm_cpu_run_block(cpu, mem, max_instructions - executed);
+		}
+		else {
+			executed += kvm_cpu_run_block(cpu, mem, 0);
+		}
+	}
 
-	cpu->processor_status = DEFAULT_PROCESSOR_STATUS;
+	return executed;
+}
 
-	kvm_instruction* instruction = malloc(sizeof(kvm_instruction));
-	instr_reset_defaults(instruction);
+void kvm_cpu_print_status(kvm_cpu* cpu) {
+	printf("Program Counter: %x\nAccumulator: %x\nX: %x\nY: %x\nStack Pointer: %x\nProcessor Status: %x\n", cpu->program_counter, cpu->accumulator, cpu->x_index, cpu->y_index, cpu->stack_ptr, cpu->processor_status);
+}
 
-	cpu->current_instruction = instruction;
+// Builds odd_opcodes_out and the predecoded instruction table, the first time a CPU is made.
+static void build_decode_tables(void) {
 	/*
 	Idea is to check the opcode.
 	If it's not in odd opcodes out, you can easily set the type. Otherwise manually set the type.
@@ -1251,12 +1289,73 @@ kvm_cpu* kvm_cpu_init(void) {
 		odd_opcodes_out[i] = value;
 	}
 
+	// Fill in the predecoded instruction table. Needs odd_opcodes_out, so this goes after it.
+	for (int i = 0; i < 256; i++) {
+		kvm_cpu_decode_instr(&decoded_instructions[i], (uint8_t)i);
+	}
+
+	// The threaded core's handlers are picked from the decoded instructions.
+	kvm_cpu_threaded_init();
+}
+
+static void init_decode_tables(void) {
+	if (SDL_AtomicGet(&decode_tables_state) == DECODE_TABLES_READY) {
+		SDL_MemoryBarrierAcquire();
+		return;
+	}
+
+	if (SDL_AtomicCAS(&decode_tables_state, DECODE_TABLES_EMPTY, DECODE_TABLES_BUILDING)) {
+		build_decode_tables();
+
+		// The tables have to land before anyone sees them as ready.
+		SDL_MemoryBarrierRelease();
+		SDL_AtomicSet(&decode_tables_state, DECODE_TABLES_READY);
+		return;
+	}
+
+	// Another thread is building them, which only takes a moment.
+	while (SDL_AtomicGet(&decode_tables_state) != DECODE_TABLES_READY) {
+		SDL_Delay(0);
+	}
+	SDL_MemoryBarrierAcquire();
+}
+
+kvm_cpu* kvm_cpu_init(void) {
+	kvm_cpu* cpu = malloc(sizeof(kvm_cpu));
+
+	cpu->accumulator = 0;
+	cpu->x_index = 0;
+	cpu->y_index = 0;
+
+	cpu->stack_ptr = STACK_PTR_DEFAULT;
+
+	cpu->program_counter = INSTRUCTION_ROM_MEM_LOC;
+
+	cpu->processor_status = DEFAULT_PROCESSOR_STATUS;
+
+	kvm_instruction* instruction = malloc(sizeof(kvm_instruction));
+	instr_reset_defaults(instruction);
+
+	cpu->current_instruction = instruction;
+
+	cpu->core = kvm_core_block;
+
+	init_decode_tables();
+
+	cpu->block_cache = kvm_block_cache_init();
+
 	return cpu;
 }
 
+void kvm_cpu_set_core(kvm_cpu* cpu, kvm_cpu_core core) {
+	if (!cpu) return;
+	cpu->core = core;
+}
+
 void kvm_cpu_free(kvm_cpu* cpu) {
 	if (cpu) {
 		if (cpu->current_instruction) free(cpu->current_instruction);
+		kvm_block_cache_free(cpu->block_cache);
 		free(cpu);
 	}
 }
\ No newline at end of file
@@ -98,6 +98,16 @@ typedef struct kvm_instruction {
 	uint8_t lowbyte, highbyte; // lowbyte is used with instruction sizes kvms_med and kvms_large, while highbyte is only used with kvms_large.
 }kvm_instruction;
 
+// Which execution core the CPU uses. All of them give identical results.
+typedef enum kvm_cpu_core {
+	kvm_core_switch,	// Decode into a kvm_instruction, then run kvm_cpu_execute_instr().
+	kvm_core_threaded,	// Call the opcode's specialized handler from a table (see kvm_cpu_threaded.c).
+	kvm_core_block,		// Run whole cached basic blocks through kvm_cpu_run_block() (see kvm_cpu_blocks.c). Single cycles use the threaded core.
+	kvm_core_jit		// Same as the block core, but hot blocks are compiled to native code (see kvm_cpu_jit.c). Falls back to the block core on non-x86-64 hosts.
+}kvm_cpu_core;
+
+struct kvm_block_cache;
+
 typedef struct kvm_cpu {
 	uint16_t program_counter;
 
@@ -110,24 +120,43 @@ typedef struct kvm_cpu {
 	uint8_t processor_status;
 
 	kvm_instruction* current_instruction;
-} kvm_cpu;
 
-int odd_opcodes_out[256];
+	kvm_cpu_core core;
+	struct kvm_block_cache* block_cache;
+} kvm_cpu;
 
 uint8_t kvm_cpu_fetch_byte(kvm_memory* mem, size_t index);
 
 void kvm_cpu_decode_instr(kvm_instruction *out_instr, uint8_t instruction);
 
+// Get the predecoded form of an opcode (operand bytes are zeroed). Only valid after kvm_cpu_init() has been called.
+const kvm_instruction* kvm_cpu_get_decoded_instr(uint8_t opcode);
+
 void kvm_cpu_execute_instr(kvm_cpu* cpu, kvm_memory* mem);
 
 /* Perform fetch, decode, and execute operations.
 */
 void kvm_cpu_cycle(kvm_cpu* cpu, kvm_memory* mem);
 
+/* Run up to max_instructions (no limit if <= 0) instructions, stopping early at the end of a basic block or right after a syscall is written.
+*  Only the block and JIT cores run more than one instruction at a time, the others just do one kvm_cpu_cycle().
+*  Returns the number of instructions run.
+*/
+int kvm_cpu_run_block(kvm_cpu* cpu, kvm_memory* mem, int max_instructions);
+
+/* Keep running until mem->syscall_pending is raised, or max_instructions (no limit if <= 0) have been run.
+*  Returns the number of instructions run. Returns right away if a syscall is already pending.
+*/
+int kvm_cpu_run(kvm_cpu* cpu, kvm_memory* mem, int max_instructions);
+
 void kvm_cpu_print_status(kvm_cpu* cpu);
 
 // Initializes the CPU and zeroes out its values.
+// The first call also builds the decode tables every CPU shares. Safe to call from any number of threads at once.
 kvm_cpu* kvm_cpu_init(void);
 
 void kvm_cpu_free(kvm_cpu* cpu);
 
+// Switch between the execution cores. Can be done at any point between cycles.
+void kvm_cpu_set_core(kvm_cpu* cpu, kvm_cpu_core core);
+
@@ -0,0 +1,312 @@
+/*	Basic block cache for the KSU Micro CPU.
+*	Straight-line runs of instructions are decoded once into arrays of micro-ops (handler plus operands),
+*	keyed by the program counter they start at. Running a block is then just a loop over the handlers.
+*	Blocks are thrown away when memory inside them is written, so self-modifying code still works.
+*	Author: Matthew Watson
+*/
+
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "leakcheck_util.h"
+
+#include "kvm_cpu_blocks.h"
+#include "kvm_cpu_threaded.h"
+#include "kvm_cpu_jit.h"
+
+#define BLOCK_MAP_SIZE 0x10000
+
+typedef struct kvm_micro_op {
+	kvm_cpu_op_handler handler;
+	uint16_t next_pc;	// Program counter after this instruction, set before the handler is called.
+	uint8_t opcode;
+	uint8_t lowbyte, highbyte;
+	bool writes_memory;
+} kvm_micro_op;
+
+typedef struct kvm_block {
+	uint16_t start_pc;
+	uint32_t end;		// One past the last byte of the block.
+	int count;
+
+	// Used by the JIT core. Blocks get compiled once they have run KVM_JIT_HOT_THRESHOLD times.
+	kvm_jit_block_fn native;
+	uint32_t run_count;
+	bool jit_rejected;
+
+	kvm_micro_op ops[KVM_BLOCK_MAX_INSTRUCTIONS];
+} kvm_block;
+
+struct kvm_block_cache {
+	kvm_block** blocks;	// Indexed by starting program counter.
+
+	// Number of blocks covering each byte of memory. Writes to bytes with a count of zero can be ignored.
+	uint8_t* byte_block_count;
+
+	// Number of blocks touching each page. Pages are only watched for writes while this is above zero.
+	uint16_t page_block_count[KVM_MEMORY_PAGE_COUNT];
+
+	// Goes up every time a block is thrown away, so a running block can tell if it needs to stop.
+	uint32_t generation;
+
+	kvm_memory* mem;
+	int hook_id;
+
+	kvm_jit* jit;	// Created the first time the JIT core is used.
+};
+
+#pragma region Invalidation
+
+static void free_block(kvm_block_cache* cache, kvm_block* block) {
+	cache->blocks[block->start_pc] = NULL;
+
+	for (uint32_t i = block->start_pc; i < block->end; i++) {
+		cache->byte_block_count[i]--;
+	}
+
+	int last_page = (int)((block->end - 1) >> 8);
+	for (int page = block->start_pc >> 8; page <= last_page; page++) {
+		cache->page_block_count[page]--;
+		if (cache->page_block_count[page] == 0 && cache->mem) {
+			kvm_memory_watch_pages(cache->mem, cache->hook_id, page, 1, false);
+		}
+	}
+
+	cache->generation++;
+	free(block);
+}
+
+// Throw away every block that overlaps [address, address + length).
+static void invalidate_range(kvm_block_cache* cache, size_t address, size_t length) {
+	// Data often sits in the same page as code, so check that the write actually hit a block first.
+	bool hit = false;
+	for (size_t i = address; i < address + length && i < BLOCK_MAP_SIZE; i++) {
+		if (cache->byte_block_count[i]) {
+			hit = true;
+			break;
+		}
+	}
+	if (!hit) return;
+
+	// A block that starts before the address can still reach into it.
+	size_t start = (address >= KVM_BLOCK_MAX_BYTES - 1) ? address - (KVM_BLOCK_MAX_BYTES - 1) : 0;
+
+	for (size_t pc = start; pc < address + length && pc < BLOCK_MAP_SIZE; pc++) {
+		kvm_block* block = cache->blocks[pc];
+		if (block && block->end > address) {
+			free_block(cache, block);
+		}
+	}
+}
+
+static void on_memory_write(void* userdata, size_t address, size_t length) {
+	invalidate_range((kvm_block_cache*)userdata, address, length);
+}
+
+// Hook the cache up to the memory it is translating from.
+static void attach_memory(kvm_block_cache* cache, kvm_memory* mem) {
+	if (cache->mem == mem) return;
+
+	kvm_block_cache_flush(cache);
+	if (cache->mem) {
+		kvm_memory_remove_write_hook(cache->mem, cache->hook_id);
+	}
+
+	cache->mem = mem;
+	cache->hook_id = kvm_memory_add_write_hook(mem, on_memory_write, cache);
+}
+
+#pragma endregion
+
+static kvm_block* translate_block(kvm_block_cache* cache, kvm_memory* mem, uint16_t start_pc) {
+	kvm_block* block = malloc(sizeof(kvm_block));
+	block->start_pc = start_pc;
+	block->count = 0;
+	block->native = NULL;
+	block->run_count = 0;
+	block->jit_rejected = false;
+
+	uint32_t pc = start_pc;
+	while (block->count < KVM_BLOCK_MAX_INSTRUCTIONS) {
+		uint8_t opcode = kvm_cpu_fetch_byte(mem, pc);
+		const kvm_threaded_op* op = kvm_cpu_threaded_get_op(opcode);
+
+		// Don't let a block wrap around the end of the address space.
+		if (pc + op->size > BLOCK_MAP_SIZE) break;
+
+		kvm_micro_op* micro_op = &block->ops[block->count++];
+		micro_op->handler = op->handler;
+		micro_op->opcode = opcode;
+		micro_op->lowbyte = (op->size >= kvms_med) ? kvm_cpu_fetch_byte(mem, pc + 1) : 0;
+		micro_op->highbyte = (op->size == kvms_large) ? kvm_cpu_fetch_byte(mem, pc + 2) : 0;
+		micro_op->writes_memory = op->writes_memory;
+
+		pc += op->size;
+		micro_op->next_pc = (uint16_t)pc;
+
+		if (op->ends_block) break;
+	}
+
+	if (block->count == 0) {
+		free(block);
+		return NULL;
+	}
+
+	block->end = pc;
+	cache->blocks[start_pc] = block;
+
+	for (uint32_t i = start_pc; i < block->end; i++) {
+		cache->byte_block_count[i]++;
+	}
+
+	// Start watching the pages the block lives in.
+	int last_page = (int)((block->end - 1) >> 8);
+	for (int page = start_pc >> 8; page <= last_page; page++) {
+		if (cache->page_block_count[page]++ == 0) {
+			kvm_memory_watch_pages(mem, cache->hook_id, page, 1, true);
+		}
+	}
+
+	return block;
+}
+
+#pragma region JIT
+
+// Throw away all compiled code, but keep the blocks.
+static void reset_jit(kvm_block_cache* cache) {
+	kvm_jit_reset(cache->jit);
+
+	for (int i = 0; i < BLOCK_MAP_SIZE; i++) {
+		kvm_block* block = cache->blocks[i];
+		if (block) {
+			block->native = NULL;
+			block->run_count = 0;
+		}
+	}
+}
+
+static void compile_block(kvm_block_cache* cache, kvm_memory* mem, kvm_block* block) {
+	if (!cache->jit) cache->jit = kvm_jit_init();
+
+	uint8_t own_page_flags = (cache->hook_id >= 0) ? (uint8_t)(1 << cache->hook_id) : 0;
+	kvm_jit_result result = kvm_jit_compile(cache->jit, mem, block->start_pc, block->count, own_page_flags, &block->native);
+	if (result == kvm_jit_out_of_memory) {
+		// Start over with an empty code buffer.
+		reset_jit(cache);
+		result = kvm_jit_compile(cache->jit, mem, block->start_pc, block->count, own_page_flags, &block->native);
+	}
+
+	if (result != kvm_jit_ok) {
+		block->native = NULL;
+		block->jit_rejected = true;
+	}
+}
+
+#pragma endregion
+
+kvm_block_cache* kvm_block_cache_init(void) {
+	kvm_block_cache* cache = malloc(sizeof(kvm_block_cache));
+
+	cache->blocks = malloc(BLOCK_MAP_SIZE * sizeof(kvm_block*));
+	for (int i = 0; i < BLOCK_MAP_SIZE; i++) {
+		cache->blocks[i] = NULL;
+	}
+
+	cache->byte_block_count = malloc(BLOCK_MAP_SIZE);
+	for (int i = 0; i < BLOCK_MAP_SIZE; i++) {
+		cache->byte_block_count[i] = 0;
+	}
+
+	for (int i = 0; i < KVM_MEMORY_PAGE_COUNT; i++) {
+		cache->page_block_count[i] = 0;
+	}
+
+	cache->generation = 0;
+	cache->mem = NULL;
+	cache->hook_id = -1;
+	cache->jit = NULL;
+
+	return cache;
+}
+
+void kvm_block_cache_flush(kvm_block_cache* cache) {
+	if (!cache) return;
+
+	for (int i = 0; i < BLOCK_MAP_SIZE; i++) {
+		if (cache->blocks[i]) free_block(cache, cache->blocks[i]);
+	}
+
+	// No blocks left to point at the compiled code.
+	kvm_jit_reset(cache->jit);
+}
+
+void kvm_block_cache_free(kvm_block_cache* cache) {
+	if (!cache) return;
+
+	kvm_block_cache_flush(cache);
+	if (cache->mem) {
+		kvm_memory_remove_write_hook(cache->mem, cache->hook_id);
+	}
+
+	kvm_jit_free(cache->jit);
+	free(cache->blocks);
+	free(cache->byte_block_count);
+	free(cache);
+}
+
+int kvm_block_cache_run(kvm_block_cache* cache, kvm_cpu* cpu, kvm_memory* mem, int max_instructions) {
+	attach_memory(cache, mem);
+
+	kvm_block* block = cache->blocks[cpu->program_counter];
+	if (!block) {
+		block = translate_block(cache, mem, cpu->program_counter);
+
+		if (!block) {
+			// Nothing could be translated here, so just step once.
+			kvm_cpu_threaded_cycle(cpu, mem);
+			return 1;
+		}
+	}
+
+	int count = block->count;
+	if (max_instructions > 0 && max_instructions < count) {
+		count = max_instructions;
+	}
+
+	// Compiled blocks always run to the end, so they're only used when there's room for the whole block.
+	if (cpu->core == kvm_core_jit && count == block->count) {
+		if (!block->native && !block->jit_rejected && ++block->run_count >= KVM_JIT_HOT_THRESHOLD) {
+			compile_block(cache, mem, block);
+		}
+
+		if (block->native) {
+			kvm_jit_state state;
+			state.data = mem->data;
+			state.page_flags = mem->page_flags;
+			state.code_bytes = cache->byte_block_count;
+			state.max_instructions = (max_instructions > 0) ? max_instructions : KVM_JIT_MAX_RUN;
+
+			// Zero means it bailed out on the very first instruction, so interpret the block instead.
+			int executed = block->native(cpu, &state);
+			if (executed > 0) return executed;
+		}
+	}
+
+	uint32_t generation = cache->generation;
+	const kvm_micro_op* ops = block->ops;
+
+	for (int i = 0; i < count; i++) {
+		const kvm_micro_op* op = &ops[i];
+		bool writes_memory = op->writes_memory; // Read this first, the handler might free the block.
+
+		cpu->program_counter = op->next_pc;
+		op->handler(cpu, mem, op->opcode, op->lowbyte, op->highbyte);
+
+		// Hand control back right away on a syscall, or if this write threw away a block (possibly this one).
+		if (writes_memory && (cache->generation != generation || mem->syscall_pending)) {
+			return i + 1;
+		}
+	}
+
+	return count;
+}
@@ -0,0 +1,28 @@
+/*	Header for the basic block cache of the KSU Micro CPU.
+*	Author: Matthew Watson
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "kvm_cpu.h"
+#include "kvm_memory.h"
+
+// Longest run of instructions that gets put into one block. Blocks also end at any branch, jump, JSR, or return.
+#define KVM_BLOCK_MAX_INSTRUCTIONS 32
+#define KVM_BLOCK_MAX_BYTES (KVM_BLOCK_MAX_INSTRUCTIONS * kvms_large)
+
+typedef struct kvm_block_cache kvm_block_cache;
+
+kvm_block_cache* kvm_block_cache_init(void);
+void kvm_block_cache_free(kvm_block_cache* cache);
+
+// Throw away every cached block.
+void kvm_block_cache_flush(kvm_block_cache* cache);
+
+// Run the block starting at the program counter, translating it first if needed.
+// Stops early after max_instructions (if > 0), once a syscall is pending, or if a write invalidates a block.
+// Returns the number of instructions run.
+int kvm_block_cache_run(kvm_block_cache* cache, kvm_cpu* cpu, kvm_memory* mem, int max_instructions);
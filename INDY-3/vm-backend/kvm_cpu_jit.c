@@ -0,0 +1,960 @@
+/*	x86-64 JIT backend for the KSU Micro CPU.
+*	Hot basic blocks from the block cache are compiled into native code. The guest registers live in host registers
+*	for the whole block and guest memory is addressed directly off kvm_memory.data.
+*	Only instructions with a specialized handler in kvm_cpu_threaded.c are compiled, and each one is emitted to do
+*	exactly what that handler does, flag quirks included. Anything else leaves the block to the interpreter.
+*	Author: Matthew Watson
+*/
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "kvm_cpu_jit.h"
+
+// Executable memory. These go before leakcheck_util.h so its malloc/free macros don't reach them.
+#ifdef KVM_JIT_AVAILABLE
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+#endif
+
+#include "leakcheck_util.h"
+
+#include "kvm_cpu_threaded.h"
+#include "kvm_cpu_blocks.h"
+#include "kvm_mem_map_constants.h"
+
+#ifdef KVM_JIT_AVAILABLE
+
+// Stores anywhere in here are left to the interpreter.
+#define JIT_VRAM_START VRAM_BGCOLOR
+#define JIT_VRAM_END GRAPHICS_ROM_MEM_LOC
+
+// Up to three store checks per instruction, plus the taken side of a branch.
+#define JIT_MAX_BAILS (KVM_BLOCK_MAX_INSTRUCTIONS * 4)
+
+struct kvm_jit {
+	uint8_t* code;
+	size_t capacity;
+	size_t used;
+};
+
+#pragma region Emitter
+
+// Host registers.
+enum {
+	RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+	R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+// Where everything lives while a block runs. RAX, RCX, RDX, and R11 are scratch, and the operand of an instruction goes in DL.
+#define REG_A RBX
+#define REG_X R12
+#define REG_Y R13
+#define REG_SP R14
+#define REG_P R15
+#define REG_MEM RBP
+#define REG_PAGE_FLAGS RSI
+#define REG_CPU RDI
+#define REG_CODE_BYTES R8
+#define REG_BUDGET R9		// max_instructions
+#define REG_COUNT R10		// Instructions run by earlier trips around the loop
+
+#define NO_INDEX -1
+
+// Condition codes for jcc/setcc.
+enum {
+	CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_A = 0x7, CC_S = 0x8
+};
+
+// Early exit, patched in once the body of the block is done.
+typedef struct jit_bail {
+	size_t fixup;		// Offset of the rel32 to patch.
+	uint16_t pc;
+	int count;
+} jit_bail;
+
+typedef struct jit_emitter {
+	uint8_t* code;
+	size_t size;
+	size_t capacity;
+	bool overflow;
+
+	uint16_t start_pc;
+	size_t body;				// Offset of the first instruction, after the prologue.
+	uint8_t foreign_page_flags;	// Page flag bits of every other write hook.
+
+	jit_bail bails[JIT_MAX_BAILS];
+	int bail_count;
+	size_t epilogue_fixups[KVM_BLOCK_MAX_INSTRUCTIONS + JIT_MAX_BAILS];
+	int epilogue_fixup_count;
+} jit_emitter;
+
+static void emit8(jit_emitter* e, uint8_t b) {
+	if (e->size >= e->capacity) {
+		e->overflow = true;
+		return;
+	}
+	e->code[e->size++] = b;
+}
+
+static void emit16(jit_emitter* e, uint16_t v) {
+	emit8(e, v & 0xFF);
+	emit8(e, v >> 8);
+}
+
+static void emit32(jit_emitter* e, uint32_t v) {
+	for (int i = 0; i < 4; i++) {
+		emit8(e, (v >> (i * 8)) & 0xFF);
+	}
+}
+
+static void patch32(jit_emitter* e, size_t offset, uint32_t v) {
+	if (offset + 4 > e->size) return;
+	for (int i = 0; i < 4; i++) {
+		e->code[offset + i] = (v >> (i * 8)) & 0xFF;
+	}
+}
+
+// The REX prefix is always written for byte operations, so registers 4-7 mean SPL-DIL and never AH-BH.
+static void emit_rex(jit_emitter* e, bool wide, int reg, int index, int base, bool byte_op) {
+	uint8_t rex = 0x40;
+	if (wide) rex |= 0x08;
+	if (reg & 8) rex |= 0x04;
+	if (index >= 0 && (index & 8)) rex |= 0x02;
+	if (base & 8) rex |= 0x01;
+
+	if (rex != 0x40 || byte_op) emit8(e, rex);
+}
+
+// Register to register form. op1 is a second opcode byte for 0x0F instructions, or -1.
+static void emit_rr(jit_emitter* e, bool wide, bool byte_op, uint8_t op0, int op1, int reg, int rm) {
+	emit_rex(e, wide, reg, NO_INDEX, rm, byte_op);
+	emit8(e, op0);
+	if (op1 >= 0) emit8(e, (uint8_t)op1);
+	emit8(e, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// Memory form, always [base + index + disp32] through a SIB byte so that RBP/R12/R13 need no special cases.
+static void emit_rm(jit_emitter* e, bool prefix16, bool wide, bool byte_op, uint8_t op0, int op1, int reg, int base, int index, int32_t disp) {
+	if (prefix16) emit8(e, 0x66);
+	emit_rex(e, wide, reg, index, base, byte_op);
+	emit8(e, op0);
+	if (op1 >= 0) emit8(e, (uint8_t)op1);
+	emit8(e, 0x80 | ((reg & 7) << 3) | 0x04);
+	emit8(e, (((index >= 0 ? index : RSP) & 7) << 3) | (base & 7));
+	emit32(e, (uint32_t)disp);
+}
+
+// A few byte-sized instructions used all over.
+static void emit_mov8_imm(jit_emitter* e, int reg, uint8_t value) {
+	emit_rex(e, false, 0, NO_INDEX, reg, true);
+	emit8(e, 0xB0 + (reg & 7));
+	emit8(e, value);
+}
+
+static void emit_alu8(jit_emitter* e, uint8_t op, int dst, int src) { emit_rr(e, false, true, op, -1, src, dst); }
+static void emit_alu8_imm(jit_emitter* e, int digit, int dst, uint8_t value) { emit_rr(e, false, true, 0x80, -1, digit, dst); emit8(e, value); }
+static void emit_setcc(jit_emitter* e, int cc, int dst) { emit_rr(e, false, true, 0x0F, 0x90 + cc, 0, dst); }
+static void emit_shift8(jit_emitter* e, int digit, int dst, uint8_t count) { emit_rr(e, false, true, 0xC0, -1, digit, dst); emit8(e, count); }
+static void emit_movzx8(jit_emitter* e, int dst, int src) { emit_rr(e, false, true, 0x0F, 0xB6, dst, src); }
+
+#define ALU_ADD 0x00
+#define ALU_OR 0x08
+#define ALU_AND 0x20
+#define ALU_SUB 0x28
+#define ALU_XOR 0x30
+#define ALU_CMP 0x38
+#define ALU_TEST 0x84
+#define ALU_MOV 0x88
+
+// Digits for the 0x80/0x81 immediate group and the 0xC0/0xC1 shift group.
+#define DIGIT_ADD 0
+#define DIGIT_OR 1
+#define DIGIT_AND 4
+#define DIGIT_SUB 5
+#define DIGIT_XOR 6
+#define DIGIT_CMP 7
+#define DIGIT_SHL 4
+#define DIGIT_SHR 5
+
+static void emit_alu32_imm(jit_emitter* e, int digit, int dst, uint32_t value) { emit_rr(e, false, false, 0x81, -1, digit, dst); emit32(e, value); }
+
+static void emit_jcc(jit_emitter* e, int cc, uint16_t pc, int count) {
+	emit8(e, 0x0F);
+	emit8(e, 0x80 + cc);
+
+	if (e->bail_count < JIT_MAX_BAILS) {
+		jit_bail* bail = &e->bails[e->bail_count++];
+		bail->fixup = e->size;
+		bail->pc = pc;
+		bail->count = count;
+	}
+	else {
+		e->overflow = true;
+	}
+	emit32(e, 0);
+}
+
+// Jump to a known offset, or to a placeholder to be patched later. cc < 0 means an unconditional jump.
+static void emit_jcc_to(jit_emitter* e, int cc, size_t target, bool known) {
+	if (cc < 0) {
+		emit8(e, 0xE9);
+	}
+	else {
+		emit8(e, 0x0F);
+		emit8(e, 0x80 + cc);
+	}
+	emit32(e, known ? (uint32_t)(target - (e->size + 4)) : 0);
+}
+
+#pragma endregion
+
+#pragma region Guest state
+
+static void emit_update_zn(jit_emitter* e, int reg) {
+	emit_alu8_imm(e, DIGIT_AND, REG_P, 0xFF ^ (CPU_ZERO_FLAG | CPU_NEGATIVE_FLAG));
+	emit_alu8(e, ALU_MOV, RAX, reg);
+	emit_alu8_imm(e, DIGIT_AND, RAX, CPU_NEGATIVE_FLAG);
+	emit_alu8(e, ALU_OR, REG_P, RAX);
+	emit_alu8(e, ALU_TEST, reg, reg);
+	emit_setcc(e, CC_E, RAX);
+	emit_alu8(e, ALU_ADD, RAX, RAX); // 1 -> CPU_ZERO_FLAG
+	emit_alu8(e, ALU_OR, REG_P, RAX);
+}
+
+static void emit_set_pc(jit_emitter* e, uint16_t pc) {
+	emit_rm(e, true, false, false, 0xC7, -1, 0, REG_CPU, NO_INDEX, offsetof(kvm_cpu, program_counter));
+	emit16(e, pc);
+}
+
+static void emit_return(jit_emitter* e, int count) {
+	// lea eax, [count register + count]; jmp epilogue
+	emit_rm(e, false, false, false, 0x8D, -1, RAX, REG_COUNT, NO_INDEX, count);
+	emit8(e, 0xE9);
+	if (e->epilogue_fixup_count < KVM_BLOCK_MAX_INSTRUCTIONS + JIT_MAX_BAILS) {
+		e->epilogue_fixups[e->epilogue_fixup_count++] = e->size;
+	}
+	else {
+		e->overflow = true;
+	}
+	emit32(e, 0);
+}
+
+static const int saved_registers[] = { RBX, RBP, RSI, RDI, R12, R13, R14, R15 };
+#define SAVED_REGISTER_COUNT (int)(sizeof(saved_registers) / sizeof(saved_registers[0]))
+
+static void emit_push(jit_emitter* e, int reg) {
+	if (reg & 8) emit8(e, 0x41);
+	emit8(e, 0x50 + (reg & 7));
+}
+
+static void emit_pop(jit_emitter* e, int reg) {
+	if (reg & 8) emit8(e, 0x41);
+	emit8(e, 0x58 + (reg & 7));
+}
+
+static void emit_mov64(jit_emitter* e, int dst, int src) { emit_rr(e, true, false, 0x89, -1, src, dst); }
+
+static void emit_prologue(jit_emitter* e) {
+	for (int i = 0; i < SAVED_REGISTER_COUNT; i++) {
+		emit_push(e, saved_registers[i]);
+	}
+
+	// Arguments are (cpu, state). Move the state pointer into RAX.
+#ifdef _WIN32
+	emit_mov64(e, REG_CPU, RCX);
+	emit_mov64(e, RAX, RDX);
+#else
+	emit_mov64(e, RAX, RSI);
+#endif
+	emit_rm(e, false, true, false, 0x8B, -1, REG_MEM, RAX, NO_INDEX, offsetof(kvm_jit_state, data));
+	emit_rm(e, false, true, false, 0x8B, -1, REG_PAGE_FLAGS, RAX, NO_INDEX, offsetof(kvm_jit_state, page_flags));
+	emit_rm(e, false, true, false, 0x8B, -1, REG_CODE_BYTES, RAX, NO_INDEX, offsetof(kvm_jit_state, code_bytes));
+	emit_rm(e, false, false, false, 0x8B, -1, REG_BUDGET, RAX, NO_INDEX, offsetof(kvm_jit_state, max_instructions));
+	emit_rr(e, false, false, 0x31, -1, REG_COUNT, REG_COUNT); // xor
+
+	emit_rm(e, false, false, true, 0x0F, 0xB6, REG_A, REG_CPU, NO_INDEX, offsetof(kvm_cpu, accumulator));
+	emit_rm(e, false, false, true, 0x0F, 0xB6, REG_X, REG_CPU, NO_INDEX, offsetof(kvm_cpu, x_index));
+	emit_rm(e, false, false, true, 0x0F, 0xB6, REG_Y, REG_CPU, NO_INDEX, offsetof(kvm_cpu, y_index));
+	emit_rm(e, false, false, true, 0x0F, 0xB6, REG_SP, REG_CPU, NO_INDEX, offsetof(kvm_cpu, stack_ptr));
+	emit_rm(e, false, false, true, 0x0F, 0xB6, REG_P, REG_CPU, NO_INDEX, offsetof(kvm_cpu, processor_status));
+}
+
+// Write the registers back and return. EAX already holds the instruction count.
+static void emit_epilogue(jit_emitter* e) {
+	emit_rm(e, false, false, true, ALU_MOV, -1, REG_A, REG_CPU, NO_INDEX, offsetof(kvm_cpu, accumulator));
+	emit_rm(e, false, false, true, ALU_MOV, -1, REG_X, REG_CPU, NO_INDEX, offsetof(kvm_cpu, x_index));
+	emit_rm(e, false, false, true, ALU_MOV, -1, REG_Y, REG_CPU, NO_INDEX, offsetof(kvm_cpu, y_index));
+	emit_rm(e, false, false, true, ALU_MOV, -1, REG_SP, REG_CPU, NO_INDEX, offsetof(kvm_cpu, stack_ptr));
+	emit_rm(e, false, false, true, ALU_MOV, -1, REG_P, REG_CPU, NO_INDEX, offsetof(kvm_cpu, processor_status));
+
+	for (int i = SAVED_REGISTER_COUNT - 1; i >= 0; i--) {
+		emit_pop(e, saved_registers[i]);
+	}
+	emit8(e, 0xC3);
+}
+
+#pragma endregion
+
+#pragma region Addressing
+
+// Either a fixed address, or one computed into RCX at runtime.
+typedef struct jit_address {
+	bool is_static;
+	uint16_t address;
+} jit_address;
+
+// Matches the addr_* helpers in kvm_cpu_threaded.c. Returns false for modes without a memory operand.
+static bool emit_address(jit_emitter* e, kvm_addressing_mode mode, uint8_t lowbyte, uint8_t highbyte, jit_address* out) {
+	uint16_t absolute = lowbyte | ((uint16_t)highbyte << 8);
+	out->is_static = false;
+	out->address = 0;
+
+	switch (mode) {
+	case kvma_zeropage:
+		out->is_static = true;
+		out->address = lowbyte;
+		return true;
+	case kvma_absolute:
+		out->is_static = true;
+		out->address = absolute;
+		return true;
+	case kvma_zpx:
+	case kvma_zpy:
+		// No zero page wrapping, same as the interpreter.
+		emit_movzx8(e, RCX, mode == kvma_zpx ? REG_X : REG_Y);
+		emit_alu32_imm(e, DIGIT_ADD, RCX, lowbyte);
+		return true;
+	case kvma_abx:
+	case kvma_aby:
+		emit_movzx8(e, RCX, mode == kvma_abx ? REG_X : REG_Y);
+		emit_alu32_imm(e, DIGIT_ADD, RCX, absolute);
+		emit_alu32_imm(e, DIGIT_AND, RCX, 0xFFFF);
+		return true;
+	case kvma_indx:
+		emit_movzx8(e, RCX, REG_X);
+		emit_alu32_imm(e, DIGIT_ADD, RCX, absolute);
+		emit_alu32_imm(e, DIGIT_AND, RCX, 0xFFFF);
+		emit_rm(e, false, false, false, 0x0F, 0xB7, RCX, REG_MEM, RCX, 0);
+		return true;
+	case kvma_yind:
+		emit_rm(e, false, false, false, 0x0F, 0xB7, RCX, REG_MEM, NO_INDEX, absolute);
+		emit_movzx8(e, RAX, REG_Y);
+		emit_rr(e, false, false, 0x01, -1, RAX, RCX);
+		emit_alu32_imm(e, DIGIT_AND, RCX, 0xFFFF);
+		return true;
+	default:
+		return false;
+	}
+}
+
+static void emit_load(jit_emitter* e, int reg, const jit_address* address) {
+	if (address->is_static) {
+		emit_rm(e, false, false, true, 0x8A, -1, reg, REG_MEM, NO_INDEX, address->address);
+	}
+	else {
+		emit_rm(e, false, false, true, 0x8A, -1, reg, REG_MEM, RCX, 0);
+	}
+}
+
+static bool address_is_unsafe(uint16_t address) {
+	return address == 0 || (address >= JIT_VRAM_START && address < JIT_VRAM_END);
+}
+
+// Bail out if a page watched by another write hook is written. The page number is in EAX if page < 0.
+static void emit_page_check(jit_emitter* e, int page, uint16_t pc, int index) {
+	if (!e->foreign_page_flags) return;
+
+	if (page >= 0) {
+		emit_rm(e, false, false, false, 0x0F, 0xB6, RAX, REG_PAGE_FLAGS, NO_INDEX, page);
+	}
+	else {
+		emit_rm(e, false, false, false, 0x0F, 0xB6, RAX, REG_PAGE_FLAGS, RAX, 0);
+	}
+	emit_alu32_imm(e, DIGIT_AND, RAX, e->foreign_page_flags);
+	emit_jcc(e, CC_NE, pc, index);
+}
+
+// Bail out if a byte of code is written, so the block cache gets to throw the block away.
+static void emit_code_check(jit_emitter* e, const jit_address* address, uint16_t pc, int index) {
+	if (address->is_static) {
+		emit_rm(e, false, false, false, 0x80, -1, DIGIT_CMP, REG_CODE_BYTES, NO_INDEX, address->address);
+	}
+	else {
+		emit_rm(e, false, false, false, 0x80, -1, DIGIT_CMP, REG_CODE_BYTES, RCX, 0);
+	}
+	emit8(e, 0);
+	emit_jcc(e, CC_NE, pc, index);
+}
+
+/* Bail out before a store if it would hit code, another hook's page, the syscall byte, or VRAM.
+*  Returns false if a fixed address is the syscall byte or VRAM, in which case the block isn't compiled at all.
+*/
+static bool emit_store_check(jit_emitter* e, const jit_address* address, uint16_t pc, int index) {
+	if (address->is_static) {
+		if (address_is_unsafe(address->address)) return false;
+
+		emit_page_check(e, address->address >> 8, pc, index);
+		emit_code_check(e, address, pc, index);
+		return true;
+	}
+
+	// mov eax, ecx; shr eax, 8
+	emit_rr(e, false, false, 0x89, -1, RCX, RAX);
+	emit_rr(e, false, false, 0xC1, -1, DIGIT_SHR, RAX);
+	emit8(e, 8);
+	emit_page_check(e, -1, pc, index);
+	emit_code_check(e, address, pc, index);
+
+	// test ecx, ecx
+	emit_rr(e, false, false, 0x85, -1, RCX, RCX);
+	emit_jcc(e, CC_E, pc, index);
+
+	// (address - VRAM start) < VRAM size, unsigned
+	emit_rr(e, false, false, 0x89, -1, RCX, RAX);
+	emit_alu32_imm(e, DIGIT_SUB, RAX, JIT_VRAM_START);
+	emit_alu32_imm(e, DIGIT_CMP, RAX, JIT_VRAM_END - JIT_VRAM_START);
+	emit_jcc(e, CC_B, pc, index);
+	return true;
+}
+
+static void emit_store(jit_emitter* e, int reg, const jit_address* address) {
+	if (address->is_static) {
+		emit_rm(e, false, false, true, ALU_MOV, -1, reg, REG_MEM, NO_INDEX, address->address);
+	}
+	else {
+		emit_rm(e, false, false, true, ALU_MOV, -1, reg, REG_MEM, RCX, 0);
+	}
+}
+
+// Same as emit_store_check(), for the next push_count bytes pushed onto the stack. The stack is always in page 1.
+static void emit_stack_check(jit_emitter* e, int push_count, uint16_t pc, int index) {
+	emit_page_check(e, STACK_PTR_OFFSET >> 8, pc, index);
+
+	jit_address address = { false, 0 };
+	for (int i = 0; i < push_count; i++) {
+		emit_movzx8(e, RCX, REG_SP);
+		if (i > 0) {
+			emit_alu32_imm(e, DIGIT_SUB, RCX, i);
+			emit_alu32_imm(e, DIGIT_AND, RCX, 0xFF);
+		}
+		emit_alu32_imm(e, DIGIT_ADD, RCX, STACK_PTR_OFFSET);
+		emit_code_check(e, &address, pc, index);
+	}
+}
+
+static void emit_stack_push(jit_emitter* e, int reg) {
+	emit_movzx8(e, RCX, REG_SP);
+	emit_rm(e, false, false, true, ALU_MOV, -1, reg, REG_MEM, RCX, STACK_PTR_OFFSET);
+	emit_rr(e, false, true, 0xFE, -1, 1, REG_SP); // dec
+}
+
+static void emit_stack_pull(jit_emitter* e, int reg) {
+	emit_rr(e, false, true, 0xFE, -1, 0, REG_SP); // inc
+	emit_movzx8(e, RCX, REG_SP);
+	emit_rm(e, false, false, true, 0x8A, -1, reg, REG_MEM, RCX, STACK_PTR_OFFSET);
+}
+
+#pragma endregion
+
+#pragma region Operations
+// These follow the exec_* functions in kvm_cpu_threaded.c. The operand is always in DL.
+
+static void emit_adc(jit_emitter* e) {
+	emit_alu8(e, ALU_MOV, RCX, REG_A);						// cl = op1
+	emit_alu8(e, ALU_MOV, RAX, REG_P);
+	emit_alu8_imm(e, DIGIT_AND, RAX, CPU_CARRY_FLAG);		// al = carry
+	emit_alu8(e, ALU_ADD, REG_A, RDX);
+	emit_alu8(e, ALU_ADD, REG_A, RAX);						// A = result
+
+	emit_alu8_imm(e, DIGIT_AND, REG_P, 0xFF ^ (CPU_CARRY_FLAG | CPU_OVERFLOW_FLAG));
+	emit_alu8(e, ALU_CMP, REG_A, RCX);
+	emit_setcc(e, CC_B, RAX);								// Carry is result < op1
+	emit_alu8(e, ALU_OR, REG_P, RAX);
+
+	// Overflow is ~(op1 ^ value) & (op1 ^ result) & 0x80
+	emit_alu8(e, ALU_MOV, RAX, RCX);
+	emit_alu8(e, ALU_XOR, RAX, RDX);
+	emit_rr(e, false, true, 0xF6, -1, 2, RAX);				// not
+	emit_alu8(e, ALU_MOV, R11, RCX);
+	emit_alu8(e, ALU_XOR, R11, REG_A);
+	emit_alu8(e, ALU_AND, RAX, R11);
+	emit_alu8_imm(e, DIGIT_AND, RAX, 0x80);
+	emit_shift8(e, DIGIT_SHR, RAX, 1);						// 0x80 -> CPU_OVERFLOW_FLAG
+	emit_alu8(e, ALU_OR, REG_P, RAX);
+
+	emit_update_zn(e, REG_A);
+}
+
+static void emit_sbc(jit_emitter* e) {
+	emit_alu8(e, ALU_MOV, RCX, REG_A);
+	emit_alu8(e, ALU_MOV, RAX, REG_P);
+	emit_alu8_imm(e, DIGIT_AND, RAX, CPU_CARRY_FLAG);
+	emit_alu8_imm(e, DIGIT_XOR, RAX, 1);					// al = 1 - carry
+	emit_alu8(e, ALU_SUB, REG_A, RDX);
+	emit_alu8(e, ALU_SUB, REG_A, RAX);
+
+	emit_alu8_imm(e, DIGIT_AND, REG_P, 0xFF ^ (CPU_CARRY_FLAG | CPU_OVERFLOW_FLAG));
+	emit_alu8(e, ALU_CMP, REG_A, RCX);
+	emit_setcc(e, CC_B, RAX);
+	emit_alu8(e, ALU_OR, REG_P, RAX);
+
+	// Overflow is (op1 ^ value) & (op1 ^ result) & 0x80
+	emit_alu8(e, ALU_MOV, RAX, RCX);
+	emit_alu8(e, ALU_XOR, RAX, RDX);
+	emit_alu8(e, ALU_MOV, R11, RCX);
+	emit_alu8(e, ALU_XOR, R11, REG_A);
+	emit_alu8(e, ALU_AND, RAX, R11);
+	emit_alu8_imm(e, DIGIT_AND, RAX, 0x80);
+	emit_shift8(e, DIGIT_SHR, RAX, 1);
+	emit_alu8(e, ALU_OR, REG_P, RAX);
+
+	emit_update_zn(e, REG_A);
+}
+
+static void emit_compare(jit_emitter* e, int reg) {
+	emit_alu8_imm(e, DIGIT_AND, REG_P, 0xFF ^ (CPU_CARRY_FLAG | CPU_ZERO_FLAG | CPU_NEGATIVE_FLAG));
+	emit_alu8(e, ALU_MOV, RAX, reg);
+	emit_alu8(e, ALU_SUB, RAX, RDX);
+	emit_setcc(e, CC_AE, RCX);
+	emit_setcc(e, CC_E, R11);
+	emit_setcc(e, CC_S, RAX);
+	emit_alu8(e, ALU_ADD, R11, R11);
+	emit_shift8(e, DIGIT_SHL, RAX, 7);
+	emit_alu8(e, ALU_OR, REG_P, RCX);
+	emit_alu8(e, ALU_OR, REG_P, R11);
+	emit_alu8(e, ALU_OR, REG_P, RAX);
+}
+
+static void emit_bit(jit_emitter* e) {
+	emit_alu8_imm(e, DIGIT_AND, REG_P, 0xFF ^ (CPU_ZERO_FLAG | CPU_NEGATIVE_FLAG | CPU_OVERFLOW_FLAG));
+	emit_alu8(e, ALU_MOV, RAX, REG_A);
+	emit_alu8(e, ALU_AND, RAX, RDX);
+	emit_setcc(e, CC_E, RAX);
+	emit_alu8(e, ALU_ADD, RAX, RAX);
+	emit_alu8(e, ALU_OR, REG_P, RAX);
+	emit_alu8(e, ALU_MOV, RAX, RDX);
+	emit_alu8_imm(e, DIGIT_AND, RAX, CPU_NEGATIVE_FLAG | CPU_OVERFLOW_FLAG); // Bits 7 and 6 line up with the flags.
+	emit_alu8(e, ALU_OR, REG_P, RAX);
+}
+
+// Shifts and rotates on DL.
+static void emit_shift_op(jit_emitter* e, kvm_instruction_class instr_class) {
+	bool left = (instr_class == kvmc_shift_left || instr_class == kvmc_rotate_left);
+	bool rotate = (instr_class == kvmc_rotate_left || instr_class == kvmc_rotate_right);
+
+	// Carry going in, for rotates.
+	if (rotate) {
+		emit_alu8(e, ALU_MOV, R11, REG_P);
+		emit_alu8_imm(e, DIGIT_AND, R11, CPU_CARRY_FLAG);
+		if (!left) emit_shift8(e, DIGIT_SHL, R11, 7);
+	}
+
+	// Carry coming out. RCX may still hold the address for the write back, so use AL.
+	emit_alu8(e, ALU_MOV, RAX, RDX);
+	if (left) {
+		emit_shift8(e, DIGIT_SHR, RAX, 7);
+	}
+	else {
+		emit_alu8_imm(e, DIGIT_AND, RAX, 0x01);
+	}
+
+	emit_shift8(e, left ? DIGIT_SHL : DIGIT_SHR, RDX, 1);
+	if (rotate) emit_alu8(e, ALU_OR, RDX, R11);
+
+	emit_alu8_imm(e, DIGIT_AND, REG_P, 0xFF ^ CPU_CARRY_FLAG);
+	emit_alu8(e, ALU_OR, REG_P, RAX);
+	emit_update_zn(e, RDX);
+}
+
+static int register_for(kvm_register_operand r) {
+	switch (r) {
+	case kvmr_accumulator: return REG_A;
+	case kvmr_x_index: return REG_X;
+	case kvmr_y_index: return REG_Y;
+	default: return -1;
+	}
+}
+
+static int branch_flag(kvm_register_operand r) {
+	switch (r) {
+	case kvmr_flag_carry: return CPU_CARRY_FLAG;
+	case kvmr_flag_zero: return CPU_ZERO_FLAG;
+	case kvmr_flag_negative: return CPU_NEGATIVE_FLAG;
+	case kvmr_flag_overflow: return CPU_OVERFLOW_FLAG;
+	default: return 0;
+	}
+}
+
+// Read instructions: get the operand into DL, then run the operation.
+static bool emit_read_instr(jit_emitter* e, const kvm_instruction* instr, uint8_t lowbyte, uint8_t highbyte) {
+	if (instr->addressing_mode == kvma_immediate) {
+		emit_mov8_imm(e, RDX, lowbyte);
+	}
+	else {
+		jit_address address;
+		if (!emit_address(e, instr->addressing_mode, lowbyte, highbyte, &address)) return false;
+		emit_load(e, RDX, &address);
+	}
+
+	int reg = register_for(instr->register_operand);
+	switch (instr->instruction_class) {
+	case kvmc_load:
+		if (reg < 0) return false;
+		emit_alu8(e, ALU_MOV, reg, RDX);
+		emit_update_zn(e, reg);
+		return true;
+	case kvmc_and:
+	case kvmc_or:
+	case kvmc_xor:
+		emit_alu8(e, instr->instruction_class == kvmc_and ? ALU_AND : (instr->instruction_class == kvmc_or ? ALU_OR : ALU_XOR), REG_A, RDX);
+		emit_update_zn(e, REG_A);
+		return true;
+	case kvmc_bit_test:
+		emit_bit(e);
+		return true;
+	case kvmc_add:
+		emit_adc(e);
+		return true;
+	case kvmc_subtract:
+		emit_sbc(e);
+		return true;
+	case kvmc_compare:
+		if (reg < 0) return false;
+		emit_compare(e, reg);
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Emit one instruction that doesn't end the block. Returns false if it can't be compiled.
+static bool emit_instr(jit_emitter* e, const kvm_instruction* instr, uint16_t pc, int index, uint8_t lowbyte, uint8_t highbyte) {
+	kvm_addressing_mode mode = instr->addressing_mode;
+	kvm_register_operand r = instr->register_operand;
+	int reg = register_for(r);
+
+	switch (instr->instruction_class) {
+	case kvmc_no_op:
+	case kvmc_force_interrupt:
+		return true;
+
+	case kvmc_transfer:			// TXA, TYA
+		emit_alu8(e, ALU_MOV, REG_A, r == kvmr_x_index ? REG_X : REG_Y);
+		emit_update_zn(e, REG_A);
+		return true;
+	case kvmc_transfer_accumulator: // TAX, TAY
+		emit_alu8(e, ALU_MOV, r == kvmr_x_index ? REG_X : REG_Y, REG_A);
+		emit_update_zn(e, REG_A);
+		return true;
+	case kvmc_transfer_stack:
+		if (r == kvmr_x_index) {	// TXS
+			emit_alu8(e, ALU_MOV, REG_SP, REG_X);
+		}
+		else {						// TSX
+			emit_alu8(e, ALU_MOV, REG_X, REG_SP);
+			emit_update_zn(e, REG_X);
+		}
+		return true;
+
+	case kvmc_stack_push:
+		emit_stack_check(e, 1, pc, index);
+		emit_stack_push(e, r == kvmr_accumulator ? REG_A : REG_P);
+		return true;
+	case kvmc_stack_pull:
+		emit_stack_pull(e, r == kvmr_accumulator ? REG_A : REG_P);
+		if (r == kvmr_accumulator) emit_update_zn(e, REG_A);
+		return true;
+
+	case kvmc_set_flag:			// SEC
+		emit_alu8_imm(e, DIGIT_OR, REG_P, CPU_CARRY_FLAG);
+		return true;
+	case kvmc_clear_flag:		// CLC, CLV
+		emit_alu8_imm(e, DIGIT_AND, REG_P, 0xFF ^ (r == kvmr_flag_carry ? CPU_CARRY_FLAG : CPU_OVERFLOW_FLAG));
+		return true;
+
+	case kvmc_and:
+	case kvmc_or:
+	case kvmc_xor:
+	case kvmc_bit_test:
+	case kvmc_add:
+	case kvmc_subtract:
+	case kvmc_compare:
+	case kvmc_load:
+		return emit_read_instr(e, instr, lowbyte, highbyte);
+
+	case kvmc_store:
+	{
+		if (reg < 0) return false;
+
+		jit_address address;
+		if (!emit_address(e, mode, lowbyte, highbyte, &address)) return false;
+		if (!emit_store_check(e, &address, pc, index)) return false;
+		emit_store(e, reg, &address);
+		return true;
+	}
+
+	case kvmc_increment:
+	case kvmc_decrement:
+	{
+		bool inc = instr->instruction_class == kvmc_increment;
+		if (r == kvmr_none) {
+			jit_address address;
+			if (!emit_address(e, mode, lowbyte, highbyte, &address)) return false;
+			if (!emit_store_check(e, &address, pc, index)) return false;
+			emit_load(e, RDX, &address);
+			emit_rr(e, false, true, 0xFE, -1, inc ? 0 : 1, RDX);
+			emit_update_zn(e, RDX);
+			emit_store(e, RDX, &address);
+			return true;
+		}
+
+		if (reg != REG_X && reg != REG_Y) return false;
+		if (mode == kvma_implicit) {
+			emit_rr(e, false, true, 0xFE, -1, inc ? 0 : 1, reg);
+		}
+		else {
+			emit_alu8_imm(e, inc ? DIGIT_ADD : DIGIT_SUB, reg, lowbyte);
+		}
+		emit_update_zn(e, reg);
+		return true;
+	}
+
+	case kvmc_shift_left:
+	case kvmc_shift_right:
+	case kvmc_rotate_left:
+	case kvmc_rotate_right:
+		if (mode == kvma_implicit) {
+			emit_alu8(e, ALU_MOV, RDX, REG_A);
+			emit_shift_op(e, instr->instruction_class);
+			emit_alu8(e, ALU_MOV, REG_A, RDX);
+		}
+		else {
+			jit_address address;
+			if (!emit_address(e, mode, lowbyte, highbyte, &address)) return false;
+			if (!emit_store_check(e, &address, pc, index)) return false;
+			emit_load(e, RDX, &address);
+			emit_shift_op(e, instr->instruction_class);
+			emit_store(e, RDX, &address);
+		}
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+// Emit the instruction that ends the block, along with the exits. next_pc is the address right after it.
+static bool emit_block_end(jit_emitter* e, const kvm_instruction* instr, uint16_t pc, int index, uint16_t next_pc, uint8_t lowbyte, uint8_t highbyte) {
+	uint16_t absolute = lowbyte | ((uint16_t)highbyte << 8);
+	int count = index + 1;
+
+	switch (instr->instruction_class) {
+	case kvmc_branch_if_clear:
+	case kvmc_branch_if_set:
+	{
+		uint8_t flag = (uint8_t)branch_flag(instr->register_operand);
+		uint16_t target = (instr->addressing_mode == kvma_relative) ? (uint16_t)(next_pc + (int8_t)lowbyte) : absolute;
+
+		// test P, flag
+		emit_rr(e, false, true, 0xF6, -1, 0, REG_P);
+		emit8(e, flag);
+		int taken = (instr->instruction_class == kvmc_branch_if_set) ? CC_NE : CC_E;
+
+		if (target == e->start_pc) {
+			// Loop back to the top without leaving, while there's room for another trip.
+			emit_jcc_to(e, taken ^ 1, 0, false); // Skip the loop code when not taken. Patched below.
+			size_t skip = e->size - 4;
+
+			emit_alu32_imm(e, DIGIT_ADD, REG_COUNT, count);
+			emit_rm(e, false, false, false, 0x8D, -1, RAX, REG_COUNT, NO_INDEX, count); // lea eax, [count + block length]
+			emit_rr(e, false, false, 0x39, -1, REG_BUDGET, RAX); // cmp eax, budget
+			emit_jcc(e, CC_A, target, 0);
+			emit_jcc_to(e, -1, e->body, true);
+
+			patch32(e, skip, (uint32_t)(e->size - (skip + 4)));
+		}
+		else {
+			emit_jcc(e, taken, target, count);
+		}
+
+		emit_set_pc(e, next_pc);
+		emit_return(e, count);
+		return true;
+	}
+	case kvmc_jump:
+		if (instr->addressing_mode == kvma_absolute) {
+			if (absolute == e->start_pc) {
+				emit_alu32_imm(e, DIGIT_ADD, REG_COUNT, count);
+				emit_rm(e, false, false, false, 0x8D, -1, RAX, REG_COUNT, NO_INDEX, count);
+				emit_rr(e, false, false, 0x39, -1, REG_BUDGET, RAX);
+				emit_jcc(e, CC_A, absolute, 0);
+				emit_jcc_to(e, -1, e->body, true);
+				return true;
+			}
+			emit_set_pc(e, absolute);
+		}
+		else {
+			emit_rm(e, false, false, false, 0x0F, 0xB7, RCX, REG_MEM, NO_INDEX, absolute);
+			emit_rm(e, true, false, false, 0x89, -1, RCX, REG_CPU, NO_INDEX, offsetof(kvm_cpu, program_counter));
+		}
+		emit_return(e, count);
+		return true;
+	case kvmc_jump_to_subroutine:
+		// High byte first.
+		emit_stack_check(e, 2, pc, index);
+		emit_mov8_imm(e, RDX, next_pc >> 8);
+		emit_stack_push(e, RDX);
+		emit_mov8_imm(e, RDX, next_pc & 0xFF);
+		emit_stack_push(e, RDX);
+		emit_set_pc(e, absolute);
+		emit_return(e, count);
+		return true;
+	case kvmc_return:
+		emit_stack_pull(e, RDX);
+		emit_stack_pull(e, R11);
+		emit_movzx8(e, RAX, RDX);
+		emit_movzx8(e, RCX, R11);
+		emit_rr(e, false, false, 0xC1, -1, DIGIT_SHL, RCX);
+		emit8(e, 8);
+		emit_rr(e, false, false, 0x09, -1, RCX, RAX);
+		emit_rm(e, true, false, false, 0x89, -1, RAX, REG_CPU, NO_INDEX, offsetof(kvm_cpu, program_counter));
+		emit_return(e, count);
+		return true;
+	default:
+		return false;
+	}
+}
+
+#pragma endregion
+
+kvm_jit* kvm_jit_init(void) {
+#ifdef _WIN32
+	uint8_t* code = VirtualAlloc(NULL, KVM_JIT_CODE_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+	if (!code) return NULL;
+#else
+	uint8_t* code = mmap(NULL, KVM_JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (code == MAP_FAILED) return NULL;
+#endif
+
+	kvm_jit* jit = malloc(sizeof(kvm_jit));
+	jit->code = code;
+	jit->capacity = KVM_JIT_CODE_SIZE;
+	jit->used = 0;
+
+	return jit;
+}
+
+void kvm_jit_free(kvm_jit* jit) {
+	if (!jit) return;
+
+#ifdef _WIN32
+	VirtualFree(jit->code, 0, MEM_RELEASE);
+#else
+	munmap(jit->code, jit->capacity);
+#endif
+	free(jit);
+}
+
+void kvm_jit_reset(kvm_jit* jit) {
+	if (jit) jit->used = 0;
+}
+
+kvm_jit_result kvm_jit_compile(kvm_jit* jit, kvm_memory* mem, uint16_t start_pc, int instruction_count, uint8_t own_page_flags, kvm_jit_block_fn* out_fn) {
+	if (!jit || !mem || instruction_count <= 0 || instruction_count > KVM_BLOCK_MAX_INSTRUCTIONS) return kvm_jit_unsupported;
+
+	// The emitter is too big for the stack.
+	jit_emitter* e = malloc(sizeof(jit_emitter));
+	e->code = jit->code + jit->used;
+	e->size = 0;
+	e->capacity = jit->capacity - jit->used;
+	e->overflow = false;
+	e->bail_count = 0;
+	e->epilogue_fixup_count = 0;
+	e->start_pc = start_pc;
+	e->foreign_page_flags = 0xFF ^ own_page_flags;
+
+	emit_prologue(e);
+	e->body = e->size;
+
+	bool ok = true;
+	bool ended = false;
+	uint32_t pc = start_pc;
+	for (int i = 0; i < instruction_count && ok; i++) {
+		uint8_t opcode = kvm_cpu_fetch_byte(mem, pc);
+		const kvm_threaded_op* op = kvm_cpu_threaded_get_op(opcode);
+		if (op->is_generic) {
+			ok = false;
+			break;
+		}
+
+		const kvm_instruction* instr = kvm_cpu_get_decoded_instr(opcode);
+		uint8_t lowbyte = (op->size >= kvms_med) ? kvm_cpu_fetch_byte(mem, pc + 1) : 0;
+		uint8_t highbyte = (op->size == kvms_large) ? kvm_cpu_fetch_byte(mem, pc + 2) : 0;
+		uint16_t next_pc = (uint16_t)(pc + op->size);
+
+		if (op->ends_block) {
+			ok = (i == instruction_count - 1) && emit_block_end(e, instr, (uint16_t)pc, i, next_pc, lowbyte, highbyte);
+			ended = true;
+		}
+		else {
+			ok = emit_instr(e, instr, (uint16_t)pc, i, lowbyte, highbyte);
+		}
+
+		pc += op->size;
+	}
+
+	if (ok && !ended) {
+		// Block was cut off at the length limit, so just carry on after it.
+		emit_set_pc(e, (uint16_t)pc);
+		emit_return(e, instruction_count);
+	}
+
+	// Early exits.
+	for (int i = 0; ok && i < e->bail_count; i++) {
+		patch32(e, e->bails[i].fixup, (uint32_t)(e->size - (e->bails[i].fixup + 4)));
+		emit_set_pc(e, e->bails[i].pc);
+		emit_return(e, e->bails[i].count);
+	}
+
+	size_t epilogue = e->size;
+	emit_epilogue(e);
+	for (int i = 0; ok && i < e->epilogue_fixup_count; i++) {
+		patch32(e, e->epilogue_fixups[i], (uint32_t)(epilogue - (e->epilogue_fixups[i] + 4)));
+	}
+
+	kvm_jit_result result = kvm_jit_ok;
+	if (e->overflow) {
+		result = kvm_jit_out_of_memory;
+	}
+	else if (!ok) {
+		result = kvm_jit_unsupported;
+	}
+	else {
+		*out_fn = (kvm_jit_block_fn)(void*)e->code;
+
+		// Keep the next block 16-byte aligned.
+		jit->used += (e->size + 15) & ~(size_t)15;
+		if (jit->used > jit->capacity) jit->used = jit->capacity;
+	}
+
+	free(e);
+	return result;
+}
+
+#else
+
+// No JIT on this host.
+kvm_jit* kvm_jit_init(void) { return NULL; }
+void kvm_jit_free(kvm_jit* jit) {}
+void kvm_jit_reset(kvm_jit* jit) {}
+
+kvm_jit_result kvm_jit_compile(kvm_jit* jit, kvm_memory* mem, uint16_t start_pc, int instruction_count, uint8_t own_page_flags, kvm_jit_block_fn* out_fn) {
+	return kvm_jit_unsupported;
+}
+
+#endif
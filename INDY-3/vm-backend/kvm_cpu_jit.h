@@ -0,0 +1,61 @@
+/*	Header for the x86-64 JIT backend of the KSU Micro CPU.
+*	Author: Matthew Watson
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "kvm_cpu.h"
+#include "kvm_memory.h"
+
+// The JIT only exists on x86-64 hosts. Everywhere else kvm_jit_init() returns NULL and the block core is used instead.
+#if defined(_M_X64) || defined(__x86_64__)
+#define KVM_JIT_AVAILABLE
+#endif
+
+// How many times a block has to be run by the interpreter before it gets compiled.
+#ifndef KVM_JIT_HOT_THRESHOLD
+#define KVM_JIT_HOT_THRESHOLD 16
+#endif
+
+// Most instructions a compiled block that loops back to itself will run in one go, when there's no other limit.
+#define KVM_JIT_MAX_RUN 0x10000
+
+// Size of the executable memory that compiled blocks are put in. When it fills up, everything is thrown away and compiled again.
+#define KVM_JIT_CODE_SIZE (4 * 1024 * 1024)
+
+// What a compiled block needs besides the CPU.
+typedef struct kvm_jit_state {
+	uint8_t* data;				// kvm_memory.data
+	const uint8_t* page_flags;	// kvm_memory.page_flags
+	const uint8_t* code_bytes;	// Non-zero for every byte of memory that is part of a cached block.
+	int max_instructions;		// Never run more than this many instructions.
+} kvm_jit_state;
+
+/* A compiled block. Runs the block (over and over if it loops back to itself) and returns the number of instructions run,
+*  leaving the program counter after the last one.
+*  If a store would hit code, a page watched by another write hook, the syscall byte, or VRAM, it returns early
+*  with the program counter on that store instead, so the interpreter can do it. This can mean returning 0.
+*/
+typedef int (*kvm_jit_block_fn)(kvm_cpu* cpu, const kvm_jit_state* state);
+
+typedef enum kvm_jit_result {
+	kvm_jit_ok,
+	kvm_jit_unsupported,	// The block has an instruction the JIT can't compile. Don't try it again.
+	kvm_jit_out_of_memory	// No room left for the code. Call kvm_jit_reset() and try again.
+}kvm_jit_result;
+
+typedef struct kvm_jit kvm_jit;
+
+kvm_jit* kvm_jit_init(void);
+void kvm_jit_free(kvm_jit* jit);
+
+// Throw away all compiled code. Every kvm_jit_block_fn from this JIT is invalid afterwards.
+void kvm_jit_reset(kvm_jit* jit);
+
+/* Compile instruction_count instructions starting at start_pc. The last one may be a branch, jump, JSR, or return.
+*  own_page_flags are the page flag bits of the caller's own write hook. Stores to those pages only bail out if they hit code_bytes.
+*/
+kvm_jit_result kvm_jit_compile(kvm_jit* jit, kvm_memory* mem, uint16_t start_pc, int instruction_count, uint8_t own_page_flags, kvm_jit_block_fn* out_fn);
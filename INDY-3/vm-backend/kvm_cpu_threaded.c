@@ -0,0 +1,589 @@
+/*	Threaded-dispatch execution core for the KSU Micro CPU.
+*	Instead of decoding into a kvm_instruction and switching on its class, register, and addressing mode,
+*	every opcode is mapped to a specialized handler once at init time, and each cycle just calls through the table.
+*	The results are identical to kvm_cpu_execute_instr(), which is still used for any opcode without its own handler.
+*	Author: Matthew Watson
+*/
+
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "kvm_cpu_threaded.h"
+#include "kvm_mem_map_constants.h"
+
+static kvm_threaded_op op_table[256];
+
+#pragma region Shared helpers
+
+static inline uint16_t merge_bytes(uint8_t lowbyte, uint8_t highbyte) {
+	return lowbyte | ((uint16_t)highbyte << 8);
+}
+
+static inline void set_flag(kvm_cpu* cpu, uint8_t flag, bool set) {
+	if (set) {
+		cpu->processor_status |= flag;
+	}
+	else {
+		cpu->processor_status &= (0xFF ^ flag);
+	}
+}
+
+static inline void update_zn(kvm_cpu* cpu, uint8_t value) {
+	set_flag(cpu, CPU_ZERO_FLAG, value == 0);
+	set_flag(cpu, CPU_NEGATIVE_FLAG, value & 0x80);
+}
+
+static inline void stack_push_byte(kvm_cpu* cpu, kvm_memory* mem, uint8_t value) {
+	kvm_memory_write_byte(mem, cpu->stack_ptr + STACK_PTR_OFFSET, value);
+	cpu->stack_ptr--;
+}
+
+static inline uint8_t stack_pull_byte(kvm_cpu* cpu, kvm_memory* mem) {
+	cpu->stack_ptr++;
+	return mem->data[cpu->stack_ptr + STACK_PTR_OFFSET];
+}
+
+#pragma endregion
+
+#pragma region Addressing modes
+// These match get_address_and_value() in kvm_cpu.c, including the lack of zero page wrapping.
+
+static inline uint16_t addr_zeropage(kvm_cpu* cpu, kvm_memory* mem, uint8_t lowbyte, uint8_t highbyte) {
+	return lowbyte;
+}
+
+static inline uint16_t addr_zpx(kvm_cpu* cpu, kvm_memory* mem, uint8_t lowbyte, uint8_t highbyte) {
+	return (uint16_t)(lowbyte + cpu->x_index);
+}
+
+static inline uint16_t addr_zpy(kvm_cpu* cpu, kvm_memory* mem, uint8_t lowbyte, uint8_t highbyte) {
+	return (uint16_t)(lowbyte + cpu->y_index);
+}
+
+static inline uint16_t addr_absolute(kvm_cpu* cpu, kvm_memory* mem, uint8_t lowbyte, uint8_t highbyte) {
+	return merge_bytes(lowbyte, highbyte);
+}
+
+static inline uint16_t addr_abx(kvm_cpu* cpu, kvm_memory* mem, uint8_t lowbyte, uint8_t highbyte) {
+	return (uint16_t)(merge_bytes(lowbyte, highbyte) + cpu->x_index);
+}
+
+static inline uint16_t addr_aby(kvm_cpu* cpu, kvm_memory* mem, uint8_t lowbyte, uint8_t highbyte) {
+	return (uint16_t)(merge_bytes(lowbyte, highbyte) + cpu->y_index);
+}
+
+static inline uint16_t addr_indx(kvm_cpu* cpu, kvm_memory* mem, uint8_t lowbyte, uint8_t highbyte) {
+	uint16_t pointer = (uint16_t)(merge_bytes(lowbyte, highbyte) + cpu->x_index);
+	return mem->data[pointer] | ((uint16_t)mem->data[pointer + 1] << 8);
+}
+
+static inline uint16_t addr_yind(kvm_cpu* cpu, kvm_memory* mem, uint8_t lowbyte, uint8_t highbyte) {
+	uint16_t pointer = merge_bytes(lowbyte, highbyte);
+	uint16_t target = mem->data[pointer] | ((uint16_t)mem->data[pointer + 1] << 8);
+	return (uint16_t)(target + cpu->y_index);
+}
+
+#pragma endregion
+
+#pragma region Operations
+// Read operations take the operand value, read-modify-write operations return the value to write back.
+
+static inline void exec_lda(kvm_cpu* cpu, uint8_t value) {
+	cpu->accumulator = value;
+	update_zn(cpu, value);
+}
+
+static inline void exec_ldx(kvm_cpu* cpu, uint8_t value) {
+	cpu->x_index = value;
+	update_zn(cpu, value);
+}
+
+static inline void exec_ldy(kvm_cpu* cpu, uint8_t value) {
+	cpu->y_index = value;
+	update_zn(cpu, value);
+}
+
+static inline void exec_and(kvm_cpu* cpu, uint8_t value) {
+	cpu->accumulator &= value;
+	update_zn(cpu, cpu->accumulator);
+}
+
+static inline void exec_ora(kvm_cpu* cpu, uint8_t value) {
+	cpu->accumulator |= value;
+	update_zn(cpu, cpu->accumulator);
+}
+
+static inline void exec_xor(kvm_cpu* cpu, uint8_t value) {
+	cpu->accumulator ^= value;
+	update_zn(cpu, cpu->accumulator);
+}
+
+static inline void exec_bit(kvm_cpu* cpu, uint8_t value) {
+	set_flag(cpu, CPU_ZERO_FLAG, (cpu->accumulator & value) == 0);
+	set_flag(cpu, CPU_NEGATIVE_FLAG, value & 0x80);
+	set_flag(cpu, CPU_OVERFLOW_FLAG, value & 0x40);
+}
+
+static inline void exec_adc(kvm_cpu* cpu, uint8_t value) {
+	uint8_t carry = cpu->processor_status & CPU_CARRY_FLAG;
+	uint8_t op1 = cpu->accumulator;
+	uint8_t result = op1 + value + carry;
+
+	bool same_sign = !((op1 ^ value) >> 7);
+	set_flag(cpu, CPU_CARRY_FLAG, result < op1);
+	set_flag(cpu, CPU_OVERFLOW_FLAG, same_sign && op1 >> 7 != result >> 7);
+	update_zn(cpu, result);
+
+	cpu->accumulator = result;
+}
+
+static inline void exec_sbc(kvm_cpu* cpu, uint8_t value) {
+	uint8_t carry = cpu->processor_status & CPU_CARRY_FLAG;
+	uint8_t op1 = cpu->accumulator;
+	uint8_t result = op1 - value - (1 - carry);
+
+	bool same_sign = !((op1 ^ value) >> 7);
+	set_flag(cpu, CPU_CARRY_FLAG, result < op1);
+	set_flag(cpu, CPU_OVERFLOW_FLAG, !same_sign && op1 >> 7 != result >> 7);
+	update_zn(cpu, result);
+
+	cpu->accumulator = result;
+}
+
+static inline void exec_compare(kvm_cpu* cpu, uint8_t current, uint8_t value) {
+	uint8_t result = current - value;
+	set_flag(cpu, CPU_CARRY_FLAG, current >= value);
+	set_flag(cpu, CPU_ZERO_FLAG, result == 0);
+	set_flag(cpu, CPU_NEGATIVE_FLAG, result >> 7);
+}
+
+static inline void exec_cmp(kvm_cpu* cpu, uint8_t value) { exec_compare(cpu, cpu->accumulator, value); }
+static inline void exec_cpx(kvm_cpu* cpu, uint8_t value) { exec_compare(cpu, cpu->x_index, value); }
+static inline void exec_cpy(kvm_cpu* cpu, uint8_t value) { exec_compare(cpu, cpu->y_index, value); }
+
+static inline uint8_t exec_inc(kvm_cpu* cpu, uint8_t value) {
+	value++;
+	update_zn(cpu, value);
+	return value;
+}
+
+static inline uint8_t exec_dec(kvm_cpu* cpu, uint8_t value) {
+	value--;
+	update_zn(cpu, value);
+	return value;
+}
+
+static inline uint8_t exec_shl(kvm_cpu* cpu, uint8_t value) {
+	uint8_t result = value << 1;
+	update_zn(cpu, result);
+	set_flag(cpu, CPU_CARRY_FLAG, value & 0x80);
+	return result;
+}
+
+static inline uint8_t exec_shr(kvm_cpu* cpu, uint8_t value) {
+	uint8_t result = value >> 1;
+	update_zn(cpu, result);
+	set_flag(cpu, CPU_CARRY_FLAG, value & 0x01);
+	return result;
+}
+
+static inline uint8_t exec_rol(kvm_cpu* cpu, uint8_t value) {
+	uint8_t result = value << 1 | (cpu->processor_status & CPU_CARRY_FLAG);
+	update_zn(cpu, result);
+	set_flag(cpu, CPU_CARRY_FLAG, value & 0x80);
+	return result;
+}
+
+static inline uint8_t exec_ror(kvm_cpu* cpu, uint8_t value) {
+	uint8_t result = value >> 1 | ((cpu->processor_status & CPU_CARRY_FLAG) << 7);
+	update_zn(cpu, result);
+	set_flag(cpu, CPU_CARRY_FLAG, value & 0x01);
+	return result;
+}
+
+#pragma endregion
+
+#pragma region Handler generation
+
+#define HANDLER_ARGS kvm_cpu* cpu, kvm_memory* mem, uint8_t opcode, uint8_t lowbyte, uint8_t highbyte
+
+#define READ_HANDLER(name, mode) \
+	static void op_##name##_##mode(HANDLER_ARGS) { \
+		exec_##name(cpu, mem->data[addr_##mode(cpu, mem, lowbyte, highbyte)]); \
+	}
+
+#define STORE_HANDLER(name, reg, mode) \
+	static void op_##name##_##mode(HANDLER_ARGS) { \
+		kvm_memory_write_byte(mem, addr_##mode(cpu, mem, lowbyte, highbyte), cpu->reg); \
+	}
+
+#define RMW_HANDLER(name, mode) \
+	static void op_##name##_##mode(HANDLER_ARGS) { \
+		uint16_t address = addr_##mode(cpu, mem, lowbyte, highbyte); \
+		kvm_memory_write_byte(mem, address, exec_##name(cpu, mem->data[address])); \
+	}
+
+#define READ_HANDLERS(name) \
+	static void op_##name##_immediate(HANDLER_ARGS) { exec_##name(cpu, lowbyte); } \
+	READ_HANDLER(name, zeropage) READ_HANDLER(name, zpx) READ_HANDLER(name, zpy) READ_HANDLER(name, absolute) \
+	READ_HANDLER(name, abx) READ_HANDLER(name, aby) READ_HANDLER(name, indx) READ_HANDLER(name, yind)
+
+#define STORE_HANDLERS(name, reg) \
+	STORE_HANDLER(name, reg, zeropage) STORE_HANDLER(name, reg, zpx) STORE_HANDLER(name, reg, zpy) STORE_HANDLER(name, reg, absolute) \
+	STORE_HANDLER(name, reg, abx) STORE_HANDLER(name, reg, aby) STORE_HANDLER(name, reg, indx) STORE_HANDLER(name, reg, yind)
+
+#define RMW_HANDLERS(name) \
+	RMW_HANDLER(name, zeropage) RMW_HANDLER(name, zpx) RMW_HANDLER(name, zpy) RMW_HANDLER(name, absolute) \
+	RMW_HANDLER(name, abx) RMW_HANDLER(name, aby) RMW_HANDLER(name, indx) RMW_HANDLER(name, yind)
+
+// Lookup tables indexed by kvm_addressing_mode. NULL entries fall back to the generic handler.
+#define MEMORY_MODE_TABLE(name, immediate) { \
+	NULL, NULL, immediate, NULL, \
+	op_##name##_zeropage, op_##name##_zpx, op_##name##_zpy, op_##name##_absolute, NULL, \
+	op_##name##_abx, op_##name##_aby, op_##name##_indx, op_##name##_yind }
+
+#define READ_MODE_TABLE(name) MEMORY_MODE_TABLE(name, op_##name##_immediate)
+
+READ_HANDLERS(lda)
+READ_HANDLERS(ldx)
+READ_HANDLERS(ldy)
+READ_HANDLERS(and)
+READ_HANDLERS(ora)
+READ_HANDLERS(xor)
+READ_HANDLERS(bit)
+READ_HANDLERS(adc)
+READ_HANDLERS(sbc)
+READ_HANDLERS(cmp)
+READ_HANDLERS(cpx)
+READ_HANDLERS(cpy)
+
+STORE_HANDLERS(sta, accumulator)
+STORE_HANDLERS(stx, x_index)
+STORE_HANDLERS(sty, y_index)
+
+RMW_HANDLERS(inc)
+RMW_HANDLERS(dec)
+RMW_HANDLERS(shl)
+RMW_HANDLERS(shr)
+RMW_HANDLERS(rol)
+RMW_HANDLERS(ror)
+
+typedef kvm_cpu_op_handler mode_table[kvma_yind + 1];
+
+static const mode_table lda_modes = READ_MODE_TABLE(lda);
+static const mode_table ldx_modes = READ_MODE_TABLE(ldx);
+static const mode_table ldy_modes = READ_MODE_TABLE(ldy);
+static const mode_table and_modes = READ_MODE_TABLE(and);
+static const mode_table ora_modes = READ_MODE_TABLE(ora);
+static const mode_table xor_modes = READ_MODE_TABLE(xor);
+static const mode_table bit_modes = READ_MODE_TABLE(bit);
+static const mode_table adc_modes = READ_MODE_TABLE(adc);
+static const mode_table sbc_modes = READ_MODE_TABLE(sbc);
+static const mode_table cmp_modes = READ_MODE_TABLE(cmp);
+static const mode_table cpx_modes = READ_MODE_TABLE(cpx);
+static const mode_table cpy_modes = READ_MODE_TABLE(cpy);
+
+static const mode_table sta_modes = MEMORY_MODE_TABLE(sta, NULL);
+static const mode_table stx_modes = MEMORY_MODE_TABLE(stx, NULL);
+static const mode_table sty_modes = MEMORY_MODE_TABLE(sty, NULL);
+
+static const mode_table inc_modes = MEMORY_MODE_TABLE(inc, NULL);
+static const mode_table dec_modes = MEMORY_MODE_TABLE(dec, NULL);
+static const mode_table shl_modes = MEMORY_MODE_TABLE(shl, NULL);
+static const mode_table shr_modes = MEMORY_MODE_TABLE(shr, NULL);
+static const mode_table rol_modes = MEMORY_MODE_TABLE(rol, NULL);
+static const mode_table ror_modes = MEMORY_MODE_TABLE(ror, NULL);
+
+#pragma endregion
+
+#pragma region Implicit, register, and control flow handlers
+
+static void op_nop(HANDLER_ARGS) {}
+
+static void op_return(HANDLER_ARGS) {
+	uint8_t lbyte = stack_pull_byte(cpu, mem);
+	uint8_t hbyte = stack_pull_byte(cpu, mem);
+	cpu->program_counter = merge_bytes(lbyte, hbyte);
+}
+
+static void op_tax(HANDLER_ARGS) { update_zn(cpu, cpu->accumulator); cpu->x_index = cpu->accumulator; }
+static void op_tay(HANDLER_ARGS) { update_zn(cpu, cpu->accumulator); cpu->y_index = cpu->accumulator; }
+static void op_txa(HANDLER_ARGS) { cpu->accumulator = cpu->x_index; update_zn(cpu, cpu->accumulator); }
+static void op_tya(HANDLER_ARGS) { cpu->accumulator = cpu->y_index; update_zn(cpu, cpu->accumulator); }
+static void op_txs(HANDLER_ARGS) { cpu->stack_ptr = cpu->x_index; }
+static void op_tsx(HANDLER_ARGS) { cpu->x_index = cpu->stack_ptr; update_zn(cpu, cpu->x_index); }
+
+static void op_pha(HANDLER_ARGS) { stack_push_byte(cpu, mem, cpu->accumulator); }
+static void op_php(HANDLER_ARGS) { stack_push_byte(cpu, mem, cpu->processor_status); }
+static void op_pla(HANDLER_ARGS) { cpu->accumulator = stack_pull_byte(cpu, mem); update_zn(cpu, cpu->accumulator); }
+static void op_plp(HANDLER_ARGS) { cpu->processor_status = stack_pull_byte(cpu, mem); }
+
+static void op_sec(HANDLER_ARGS) { cpu->processor_status |= CPU_CARRY_FLAG; }
+static void op_clc(HANDLER_ARGS) { cpu->processor_status &= (0xFF ^ CPU_CARRY_FLAG); }
+static void op_clv(HANDLER_ARGS) { cpu->processor_status &= (0xFF ^ CPU_OVERFLOW_FLAG); }
+
+// INX/INY/DEX/DEY, plus the immediate forms which add or subtract the operand instead of 1.
+static void op_inx(HANDLER_ARGS) { cpu->x_index = exec_inc(cpu, cpu->x_index); }
+static void op_iny(HANDLER_ARGS) { cpu->y_index = exec_inc(cpu, cpu->y_index); }
+static void op_dex(HANDLER_ARGS) { cpu->x_index = exec_dec(cpu, cpu->x_index); }
+static void op_dey(HANDLER_ARGS) { cpu->y_index = exec_dec(cpu, cpu->y_index); }
+
+static void op_inx_immediate(HANDLER_ARGS) { cpu->x_index += lowbyte; update_zn(cpu, cpu->x_index); }
+static void op_iny_immediate(HANDLER_ARGS) { cpu->y_index += lowbyte; update_zn(cpu, cpu->y_index); }
+static void op_dex_immediate(HANDLER_ARGS) { cpu->x_index -= lowbyte; update_zn(cpu, cpu->x_index); }
+static void op_dey_immediate(HANDLER_ARGS) { cpu->y_index -= lowbyte; update_zn(cpu, cpu->y_index); }
+
+static void op_shl_accumulator(HANDLER_ARGS) { cpu->accumulator = exec_shl(cpu, cpu->accumulator); }
+static void op_shr_accumulator(HANDLER_ARGS) { cpu->accumulator = exec_shr(cpu, cpu->accumulator); }
+static void op_rol_accumulator(HANDLER_ARGS) { cpu->accumulator = exec_rol(cpu, cpu->accumulator); }
+static void op_ror_accumulator(HANDLER_ARGS) { cpu->accumulator = exec_ror(cpu, cpu->accumulator); }
+
+#define BRANCH_HANDLERS(name, condition) \
+	static void op_##name##_relative(HANDLER_ARGS) { \
+		if (condition) cpu->program_counter += (int8_t)lowbyte; \
+	} \
+	static void op_##name##_absolute(HANDLER_ARGS) { \
+		if (condition) cpu->program_counter = merge_bytes(lowbyte, highbyte); \
+	}
+
+BRANCH_HANDLERS(bcc, !(cpu->processor_status & CPU_CARRY_FLAG))
+BRANCH_HANDLERS(bcs, cpu->processor_status & CPU_CARRY_FLAG)
+BRANCH_HANDLERS(bne, !(cpu->processor_status & CPU_ZERO_FLAG))
+BRANCH_HANDLERS(beq, cpu->processor_status & CPU_ZERO_FLAG)
+BRANCH_HANDLERS(bpl, !(cpu->processor_status & CPU_NEGATIVE_FLAG))
+BRANCH_HANDLERS(bmi, cpu->processor_status & CPU_NEGATIVE_FLAG)
+BRANCH_HANDLERS(bvc, !(cpu->processor_status & CPU_OVERFLOW_FLAG))
+BRANCH_HANDLERS(bvs, cpu->processor_status & CPU_OVERFLOW_FLAG)
+
+static void op_jmp_absolute(HANDLER_ARGS) {
+	cpu->program_counter = merge_bytes(lowbyte, highbyte);
+}
+
+static void op_jmp_indirect(HANDLER_ARGS) {
+	uint16_t pointer = merge_bytes(lowbyte, highbyte);
+	cpu->program_counter = mem->data[pointer] | ((uint16_t)mem->data[pointer + 1] << 8);
+}
+
+static void op_jsr(HANDLER_ARGS) {
+	// Store the current program counter, high byte first.
+	stack_push_byte(cpu, mem, cpu->program_counter >> 8);
+	stack_push_byte(cpu, mem, cpu->program_counter & 0x00FF);
+	cpu->program_counter = merge_bytes(lowbyte, highbyte);
+}
+
+// Anything without a specialized handler (mostly opcodes that the assembler never emits) goes through the switch core.
+static void op_generic(HANDLER_ARGS) {
+	kvm_instruction* instr = cpu->current_instruction;
+	*instr = *kvm_cpu_get_decoded_instr(opcode);
+	instr->lowbyte = lowbyte;
+	instr->highbyte = highbyte;
+
+	kvm_cpu_execute_instr(cpu, mem);
+}
+
+#pragma endregion
+
+static kvm_cpu_op_handler pick_mode(const mode_table table, kvm_addressing_mode mode) {
+	kvm_cpu_op_handler handler = NULL;
+	if (mode <= kvma_yind) handler = table[mode];
+
+	return handler ? handler : op_generic;
+}
+
+// Choose a register-specific handler, or the generic one if the register is not one of the three.
+static kvm_cpu_op_handler pick_register(kvm_register_operand r, kvm_cpu_op_handler a, kvm_cpu_op_handler x, kvm_cpu_op_handler y) {
+	switch (r) {
+	case kvmr_accumulator:
+		return a ? a : op_generic;
+	case kvmr_x_index:
+		return x ? x : op_generic;
+	case kvmr_y_index:
+		return y ? y : op_generic;
+	default:
+		return op_generic;
+	}
+}
+
+static kvm_cpu_op_handler pick_branch(const kvm_instruction* instr, bool if_set) {
+	kvm_cpu_op_handler relative = NULL, absolute = NULL;
+
+	switch (instr->register_operand) {
+	case kvmr_flag_carry:
+		relative = if_set ? op_bcs_relative : op_bcc_relative;
+		absolute = if_set ? op_bcs_absolute : op_bcc_absolute;
+		break;
+	case kvmr_flag_zero:
+		relative = if_set ? op_beq_relative : op_bne_relative;
+		absolute = if_set ? op_beq_absolute : op_bne_absolute;
+		break;
+	case kvmr_flag_negative:
+		relative = if_set ? op_bmi_relative : op_bpl_relative;
+		absolute = if_set ? op_bmi_absolute : op_bpl_absolute;
+		break;
+	case kvmr_flag_overflow:
+		relative = if_set ? op_bvs_relative : op_bvc_relative;
+		absolute = if_set ? op_bvs_absolute : op_bvc_absolute;
+		break;
+	default:
+		return op_generic;
+	}
+
+	if (instr->addressing_mode == kvma_relative) return relative;
+	if (instr->instruction_size == kvms_large) return absolute;
+	return op_generic;
+}
+
+// Pick the handler which does exactly what kvm_cpu_execute_instr() would do for this decoded instruction.
+static kvm_cpu_op_handler select_handler(const kvm_instruction* instr) {
+	kvm_addressing_mode mode = instr->addressing_mode;
+	kvm_register_operand r = instr->register_operand;
+
+	switch (instr->instruction_class) {
+	case kvmc_no_op:
+	case kvmc_force_interrupt:
+		return op_nop;
+	case kvmc_return:
+		return op_return;
+	case kvmc_transfer:
+		return (r == kvmr_x_index) ? op_txa : op_tya;
+	case kvmc_transfer_accumulator:
+		return (r == kvmr_x_index) ? op_tax : op_tay;
+	case kvmc_transfer_stack:
+		return (r == kvmr_x_index) ? op_txs : op_tsx;
+	case kvmc_stack_push:
+		if (r == kvmr_accumulator) return op_pha;
+		if (r == kvmr_processor_status) return op_php;
+		return op_generic;
+	case kvmc_stack_pull:
+		if (r == kvmr_accumulator) return op_pla;
+		if (r == kvmr_processor_status) return op_plp;
+		return op_generic;
+	case kvmc_set_flag:
+		return (r == kvmr_flag_carry) ? op_sec : op_generic;
+	case kvmc_clear_flag:
+		if (r == kvmr_flag_carry) return op_clc;
+		if (r == kvmr_flag_overflow) return op_clv;
+		return op_generic;
+
+	case kvmc_and: return pick_mode(and_modes, mode);
+	case kvmc_or: return pick_mode(ora_modes, mode);
+	case kvmc_xor: return pick_mode(xor_modes, mode);
+	case kvmc_bit_test: return pick_mode(bit_modes, mode);
+	case kvmc_add: return pick_mode(adc_modes, mode);
+	case kvmc_subtract: return pick_mode(sbc_modes, mode);
+	case kvmc_compare:
+		return pick_register(r, pick_mode(cmp_modes, mode), pick_mode(cpx_modes, mode), pick_mode(cpy_modes, mode));
+
+	case kvmc_increment:
+	case kvmc_decrement:
+	{
+		bool inc = instr->instruction_class == kvmc_increment;
+		if (r == kvmr_none) return pick_mode(inc ? inc_modes : dec_modes, mode);
+
+		if (mode == kvma_implicit) {
+			return pick_register(r, NULL, inc ? op_inx : op_dex, inc ? op_iny : op_dey);
+		}
+		if (mode == kvma_immediate) {
+			return pick_register(r, NULL, inc ? op_inx_immediate : op_dex_immediate, inc ? op_iny_immediate : op_dey_immediate);
+		}
+		return op_generic;
+	}
+
+	case kvmc_shift_left:
+		return (mode == kvma_implicit) ? op_shl_accumulator : pick_mode(shl_modes, mode);
+	case kvmc_shift_right:
+		return (mode == kvma_implicit) ? op_shr_accumulator : pick_mode(shr_modes, mode);
+	case kvmc_rotate_left:
+		return (mode == kvma_implicit) ? op_rol_accumulator : pick_mode(rol_modes, mode);
+	case kvmc_rotate_right:
+		return (mode == kvma_implicit) ? op_ror_accumulator : pick_mode(ror_modes, mode);
+
+	case kvmc_load:
+		return pick_register(r, pick_mode(lda_modes, mode), pick_mode(ldx_modes, mode), pick_mode(ldy_modes, mode));
+	case kvmc_store:
+		return pick_register(r, pick_mode(sta_modes, mode), pick_mode(stx_modes, mode), pick_mode(sty_modes, mode));
+
+	case kvmc_branch_if_clear:
+		return pick_branch(instr, false);
+	case kvmc_branch_if_set:
+		return pick_branch(instr, true);
+
+	case kvmc_jump:
+		if (mode == kvma_indirect) return op_jmp_indirect;
+		if (mode == kvma_absolute) return op_jmp_absolute;
+		return op_generic;
+	case kvmc_jump_to_subroutine:
+		return (instr->instruction_size == kvms_large) ? op_jsr : op_generic;
+
+	default:
+		return op_generic;
+	}
+}
+
+static bool instr_writes_memory(const kvm_instruction* instr) {
+	switch (instr->instruction_class) {
+	case kvmc_store:
+	case kvmc_stack_push:
+	case kvmc_jump_to_subroutine:
+		return true;
+	case kvmc_increment:
+	case kvmc_decrement:
+		return instr->register_operand == kvmr_none;
+	case kvmc_shift_left:
+	case kvmc_shift_right:
+	case kvmc_rotate_left:
+	case kvmc_rotate_right:
+		return instr->addressing_mode != kvma_implicit;
+	default:
+		return false;
+	}
+}
+
+static bool instr_ends_block(const kvm_instruction* instr) {
+	switch (instr->instruction_class) {
+	case kvmc_return:
+	case kvmc_branch_if_clear:
+	case kvmc_branch_if_set:
+	case kvmc_jump:
+	case kvmc_jump_to_subroutine:
+		return true;
+	default:
+		return false;
+	}
+}
+
+void kvm_cpu_threaded_init(void) {
+	for (int i = 0; i < 256; i++) {
+		const kvm_instruction* instr = kvm_cpu_get_decoded_instr((uint8_t)i);
+		kvm_threaded_op* op = &op_table[i];
+
+		op->handler = select_handler(instr);
+		op->size = (uint8_t)instr->instruction_size;
+
+		// The generic handler could do anything, so assume the worst.
+		bool generic = (op->handler == op_generic);
+		op->writes_memory = generic || instr_writes_memory(instr);
+		op->ends_block = generic || instr_ends_block(instr);
+		op->is_generic = generic;
+	}
+}
+
+const kvm_threaded_op* kvm_cpu_threaded_get_op(uint8_t opcode) {
+	return &op_table[opcode];
+}
+
+void kvm_cpu_threaded_cycle(kvm_cpu* cpu, kvm_memory* mem) {
+	uint16_t pc = cpu->program_counter;
+
+	uint8_t opcode = kvm_cpu_fetch_byte(mem, pc++);
+	const kvm_threaded_op* op = &op_table[opcode];
+
+	// Operand fetch
+	uint8_t lowbyte = 0, highbyte = 0;
+	if (op->size >= kvms_med) lowbyte = kvm_cpu_fetch_byte(mem, pc++);
+	if (op->size == kvms_large) highbyte = kvm_cpu_fetch_byte(mem, pc++);
+
+	cpu->program_counter = pc;
+
+	op->handler(cpu, mem, opcode, lowbyte, highbyte);
+}
@@ -0,0 +1,33 @@
+/*	Header for the threaded-dispatch execution core of the KSU Micro CPU.
+*	Author: Matthew Watson
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "kvm_cpu.h"
+#include "kvm_memory.h"
+
+/* Every opcode gets its own handler, which only does the memory reads that its addressing mode needs.
+*  The program counter has already been moved past the instruction when a handler is called.
+*/
+typedef void (*kvm_cpu_op_handler)(kvm_cpu* cpu, kvm_memory* mem, uint8_t opcode, uint8_t lowbyte, uint8_t highbyte);
+
+typedef struct kvm_threaded_op {
+	kvm_cpu_op_handler handler;
+	uint8_t size;
+
+	bool writes_memory;	// Stores, read-modify-writes, pushes, JSR, and anything handled generically.
+	bool ends_block;	// Branches, jumps, JSR, returns, and anything handled generically. Used by the block cache.
+	bool is_generic;	// No specialized handler, so it runs through kvm_cpu_execute_instr(). The JIT won't touch these.
+} kvm_threaded_op;
+
+// Fill the handler table. Called by kvm_cpu_init(), after the predecoded instruction table is ready.
+void kvm_cpu_threaded_init(void);
+
+const kvm_threaded_op* kvm_cpu_threaded_get_op(uint8_t opcode);
+
+// Fetch one instruction and run it through the handler table.
+void kvm_cpu_threaded_cycle(kvm_cpu* cpu, kvm_memory* mem);
@@ -6,58 +6,532 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
 
 #include "kvm_gpu.h"
+#include "leakcheck_util.h"
+
 #include "kvm_mem_map_constants.h"
 
-SDL_Window* main_window = NULL;
-SDL_Renderer* main_renderer = NULL;
+// x64 always has SSE2, AVX2 is checked for when the GPU starts.
+#if defined(_M_X64) || defined(__x86_64__)
+#define KVM_GPU_SIMD
+#include <immintrin.h>
+
+// MSVC lets any function use AVX2 intrinsics, GCC and Clang have to be told per function.
+#if defined(__GNUC__)
+#define KVM_GPU_AVX2_FUNCTION __attribute__((target("avx2")))
+#else
+#define KVM_GPU_AVX2_FUNCTION
+#endif
+#endif
+
+#define TILE_COUNT 256
+#define TILE_ROM_BYTES 16	// 2 bits a pixel
+#define TILE_PIXELS 64
+#define TILE_ROM_SIZE (TILE_COUNT * TILE_ROM_BYTES)
+
+#define PALETTE_COUNT 16
+#define PALETTE_COLORS 4
+#define PALETTE_BYTES (PALETTE_COLORS * 3)
+
+#define MAP_ENTRIES 1024	// 32x32 tiles
+
+#define SPRITE_COUNT 256
+#define BAND_COUNT 32	// 8 lines each
+#define NO_BAND 0xFF
+
+// Draws one 8 pixel row of a tile. indices are the row's color indices (0 to 3), flip reverses them,
+// and when transparent_zero is set, pixels with color 0 are left alone.
+typedef void (*blit_row_function)(uint32_t* dest, const uint8_t* indices, const uint32_t* colors, bool flip, bool transparent_zero);
+
+struct kvm_gpu {
+	SDL_Window* main_window;
+	SDL_Renderer* main_renderer;
+	SDL_Texture* screen_texture;	// Each frame is uploaded here, and the renderer scales it up to the window.
+	bool integer_scale;
+
+	SDL_Surface* target_surface;
+
+	uint32_t frame_count;
+
+	// One write hook covers every page the caches below depend on, so each GPU only takes one of the memory's hook slots.
+	int vram_hook_id;
+
+	// Tile ROM unpacked to one color index (0 to 3) a pixel, in the same order as the ROM: rows top to bottom, pixels left to right.
+	// Tiles are only unpacked again after their bytes in ROM are written.
+	kvm_memory* mem;
+	uint8_t decoded_tiles[TILE_COUNT][TILE_PIXELS];
+	uint32_t dirty_tiles[TILE_COUNT / 32];	// One bit a tile.
+	bool any_dirty_tiles;
+
+	// Every palette color and the background color, already in the target surface's pixel format.
+	// Only rebuilt after the palettes or the background color are written.
+	uint32_t palette_lut[PALETTE_COUNT][PALETTE_COLORS];
+	uint32_t bg_pixel;
+	bool palettes_dirty;
+
+	// The whole tile field drawn without any scrolling, one row of WINDOW_SIZE pixels after another.
+	// A map entry is only drawn again after it, its attributes, its tile, or its palette changes. Scrolling happens when the layer is copied to the target surface.
+	uint32_t background[WINDOW_SIZE * WINDOW_SIZE];
+	uint32_t dirty_map_entries[MAP_ENTRIES / 32];	// One bit an entry.
+	bool any_dirty_map_entries;
+
+	kvm_gpu_blitter blitter;
+	blit_row_function blit_row;
+
+	// Which sprites touch each band of 8 lines, one bit a sprite. Hidden sprites aren't in any band.
+	// A sprite is only binned again after its x or y is written.
+	uint32_t band_sprites[BAND_COUNT][SPRITE_COUNT / 32];
+	uint8_t sprite_bands[SPRITE_COUNT];	// The first band each sprite is in, or NO_BAND.
+	int visible_sprites;
+	uint32_t dirty_sprites[SPRITE_COUNT / 32];
+	bool any_dirty_sprites;
+};
+
+#pragma region Background Layer
+
+static void mark_map_entry_dirty(kvm_gpu* gpu, size_t entry) {
+	gpu->dirty_map_entries[entry / 32] |= 1u << (entry % 32);
+	gpu->any_dirty_map_entries = true;
+}
 
-SDL_Surface* target_surface = NULL;
+static void mark_background_dirty(kvm_gpu* gpu) {
+	memset(gpu->dirty_map_entries, 0xFF, sizeof(gpu->dirty_map_entries));
+	gpu->any_dirty_map_entries = true;
+}
 
-int kvm_gpu_init(kvm_memory* mem) {
-	main_window = SDL_CreateWindow(
-		NULL,
-		SDL_WINDOWPOS_CENTERED,
-		SDL_WINDOWPOS_CENTERED,
-		OUTER_WINDOW_SIZE,
-		OUTER_WINDOW_SIZE,
-		SDL_WINDOW_BORDERLESS | SDL_WINDOW_ALWAYS_ON_TOP
-	);
+// Mark every map entry that uses one of the tiles (a bit for each tile id, can be NULL) or palettes (a bit for each palette).
+static void mark_map_entries_using(kvm_gpu* gpu, const uint32_t* tiles, uint16_t palettes) {
+	const uint8_t* tile_map = gpu->mem->data + VRAM_TILE_MAP_TABLE;
+	const uint8_t* tile_attributes = gpu->mem->data + VRAM_TILE_ATTRIBUTE_TABLE;
 
-	if (!main_window) {
-		printf("Error creating SDL window.\n");
-		return -1;
+	for (int entry = 0; entry < MAP_ENTRIES; entry++) {
+		uint8_t tile_id = tile_map[entry];
+		bool uses_tile = tiles && (tiles[tile_id / 32] >> (tile_id % 32)) & 1;
+		bool uses_palette = (palettes >> (tile_attributes[entry] & 0b1111)) & 1;
+		if (uses_tile || uses_palette) mark_map_entry_dirty(gpu, entry);
 	}
+}
 
-	SDL_WarpMouseInWindow(main_window, 128, 128);
+static void on_tile_map_write(void* userdata, size_t address, size_t length) {
+	kvm_gpu* gpu = (kvm_gpu*)userdata;
 
-	main_renderer = SDL_CreateRenderer(
-		main_window,
-		-1,
-		SDL_RENDERER_ACCELERATED
-	);
+	// The map and the attributes are back to back, and entry i is at the same offset in both.
+	size_t start = address > VRAM_TILE_MAP_TABLE ? address : VRAM_TILE_MAP_TABLE;
+	size_t end = address + length < VRAM_TILE_ATTRIBUTE_TABLE + MAP_ENTRIES ? address + length : VRAM_TILE_ATTRIBUTE_TABLE + MAP_ENTRIES;
+	if (start >= end) return;
+	if (end - start >= MAP_ENTRIES) {
+		mark_background_dirty(gpu);
+		return;
+	}
 
-	if (!main_renderer) {
-		printf("Error creating SDL renderer.\n");
-		return -1;
+	for (size_t addr = start; addr < end; addr++) {
+		mark_map_entry_dirty(gpu, (addr - VRAM_TILE_MAP_TABLE) % MAP_ENTRIES);
+	}
+}
+
+#pragma endregion
+
+#pragma region Tile Cache
+
+static void on_tile_rom_write(void* userdata, size_t address, size_t length) {
+	kvm_gpu* gpu = (kvm_gpu*)userdata;
+
+	// Told about every write to the watched pages, so clip to the ROM.
+	size_t start = address > GRAPHICS_ROM_MEM_LOC ? address : GRAPHICS_ROM_MEM_LOC;
+	size_t end = address + length < GRAPHICS_ROM_MEM_LOC + TILE_ROM_SIZE ? address + length : GRAPHICS_ROM_MEM_LOC + TILE_ROM_SIZE;
+	if (start >= end) return;
+
+	size_t first_tile = (start - GRAPHICS_ROM_MEM_LOC) / TILE_ROM_BYTES;
+	size_t last_tile = (end - 1 - GRAPHICS_ROM_MEM_LOC) / TILE_ROM_BYTES;
+	for (size_t tile = first_tile; tile <= last_tile; tile++) {
+		gpu->dirty_tiles[tile / 32] |= 1u << (tile % 32);
+	}
+	gpu->any_dirty_tiles = true;
+}
+
+static void decode_tile(kvm_gpu* gpu, int tile_id) {
+	const uint8_t* rom = gpu->mem->data + GRAPHICS_ROM_MEM_LOC + tile_id * TILE_ROM_BYTES;
+	uint8_t* pixels = gpu->decoded_tiles[tile_id];
+
+	// Four pixels a byte, the first one in the low bits.
+	for (int i = 0; i < TILE_ROM_BYTES; i++) {
+		uint8_t byte = rom[i];
+		pixels[i * 4] = byte & 0b11;
+		pixels[i * 4 + 1] = (byte >> 2) & 0b11;
+		pixels[i * 4 + 2] = (byte >> 4) & 0b11;
+		pixels[i * 4 + 3] = (byte >> 6) & 0b11;
+	}
+}
+
+// Unpack any tiles written since the last frame.
+static void update_tile_cache(kvm_gpu* gpu) {
+	if (!gpu->any_dirty_tiles) return;
+
+	mark_map_entries_using(gpu, gpu->dirty_tiles, 0);
+
+	for (int word = 0; word < TILE_COUNT / 32; word++) {
+		uint32_t bits = gpu->dirty_tiles[word];
+		for (int bit = 0; bits; bit++, bits >>= 1) {
+			if (bits & 1) decode_tile(gpu, word * 32 + bit);
+		}
+		gpu->dirty_tiles[word] = 0;
+	}
+	gpu->any_dirty_tiles = false;
+}
+
+static void mark_all_tiles_dirty(kvm_gpu* gpu) {
+	memset(gpu->dirty_tiles, 0xFF, sizeof(gpu->dirty_tiles));
+	gpu->any_dirty_tiles = true;
+}
+
+#pragma endregion
+
+#pragma region Palette Cache
+
+static void on_palette_write(void* userdata, size_t address, size_t length) {
+	kvm_gpu* gpu = (kvm_gpu*)userdata;
+
+	// The background color and the palettes sit next to each other, anything else on the page doesn't matter.
+	if (address < VRAM_COLOR_PALETTES + PALETTE_COUNT * PALETTE_BYTES && address + length > VRAM_BGCOLOR) {
+		gpu->palettes_dirty = true;
+	}
+}
+
+static uint32_t map_color(SDL_Surface* surf, const uint8_t* rgb) {
+	return SDL_MapRGB(surf->format, rgb[0], rgb[1], rgb[2]);
+}
+
+static void update_palette_cache(kvm_gpu* gpu) {
+	if (!gpu->palettes_dirty) return;
+
+	// Only the map entries using a color that's actually different have to be drawn again.
+	const uint8_t* palettes = gpu->mem->data + VRAM_COLOR_PALETTES;
+	uint16_t changed_palettes = 0;
+	for (int palette = 0; palette < PALETTE_COUNT; palette++) {
+		for (int color = 0; color < PALETTE_COLORS; color++) {
+			uint32_t pixel = map_color(gpu->target_surface, palettes + palette * PALETTE_BYTES + color * 3);
+			if (pixel != gpu->palette_lut[palette][color]) {
+				gpu->palette_lut[palette][color] = pixel;
+				changed_palettes |= 1 << palette;
+			}
+		}
+	}
+
+	uint32_t bg_pixel = map_color(gpu->target_surface, gpu->mem->data + VRAM_BGCOLOR);
+	if (bg_pixel != gpu->bg_pixel) {
+		// Any entry can show the background color.
+		gpu->bg_pixel = bg_pixel;
+		mark_background_dirty(gpu);
+	}
+	else if (changed_palettes) {
+		mark_map_entries_using(gpu, NULL, changed_palettes);
+	}
+
+	gpu->palettes_dirty = false;
+}
+
+#pragma endregion
+
+#pragma region Sprite Bins
+
+static void on_sprite_position_write(void* userdata, size_t address, size_t length) {
+	kvm_gpu* gpu = (kvm_gpu*)userdata;
+
+	// Entry i of the x and y tables is sprite i.
+	size_t start = address > VRAM_SPRITE_X_TABLE ? address : VRAM_SPRITE_X_TABLE;
+	size_t end = address + length < VRAM_SPRITE_Y_TABLE + SPRITE_COUNT ? address + length : VRAM_SPRITE_Y_TABLE + SPRITE_COUNT;
+	if (start >= end) return;
+
+	if (end - start >= SPRITE_COUNT) {
+		memset(gpu->dirty_sprites, 0xFF, sizeof(gpu->dirty_sprites));
+	}
+	else {
+		for (size_t addr = start; addr < end; addr++) {
+			size_t sprite = (addr - VRAM_SPRITE_X_TABLE) % SPRITE_COUNT;
+			gpu->dirty_sprites[sprite / 32] |= 1u << (sprite % 32);
+		}
+	}
+	gpu->any_dirty_sprites = true;
+}
+
+static void bin_sprite(kvm_gpu* gpu, int sprite) {
+	uint32_t bit = 1u << (sprite % 32);
+
+	// Take it out of the bands it was in.
+	uint8_t band = gpu->sprite_bands[sprite];
+	if (band != NO_BAND) {
+		gpu->band_sprites[band][sprite / 32] &= ~bit;
+		gpu->band_sprites[(band + 1) % BAND_COUNT][sprite / 32] &= ~bit;
+		gpu->visible_sprites--;
+	}
+
+	uint8_t t_x = gpu->mem->data[VRAM_SPRITE_X_TABLE + sprite];
+	uint8_t t_y = gpu->mem->data[VRAM_SPRITE_Y_TABLE + sprite];
+	if ((uint8_t)(t_x - 1) > 248 || (uint8_t)(t_y - 1) > 248) {
+		// Illegal sprite position, do not render.
+		gpu->sprite_bands[sprite] = NO_BAND;
+		return;
 	}
 
-	SDL_Surface* window_surface = SDL_GetWindowSurface(main_window);
-	target_surface = SDL_CreateRGBSurfaceWithFormat(0, 256, 256, window_surface->format->BitsPerPixel, window_surface->format->format);
+	// 8 lines touch at most two bands. A sprite at y 249 wraps around into band 0.
+	uint8_t first_band = t_y / 8;
+	uint8_t last_band = (uint8_t)(t_y + 7) % WINDOW_SIZE / 8;
+	gpu->band_sprites[first_band][sprite / 32] |= bit;
+	gpu->band_sprites[last_band][sprite / 32] |= bit;
+	gpu->sprite_bands[sprite] = first_band;
+	gpu->visible_sprites++;
+}
 
-	SDL_ShowCursor(SDL_DISABLE);
+static void update_sprite_bins(kvm_gpu* gpu) {
+	if (!gpu->any_dirty_sprites) return;
+
+	for (int word = 0; word < SPRITE_COUNT / 32; word++) {
+		uint32_t bits = gpu->dirty_sprites[word];
+		for (int bit = 0; bits; bit++, bits >>= 1) {
+			if (bits & 1) bin_sprite(gpu, word * 32 + bit);
+		}
+		gpu->dirty_sprites[word] = 0;
+	}
+	gpu->any_dirty_sprites = false;
+}
+
+#pragma endregion
+
+#pragma region Row Blitters
+
+// The reference, every other blitter has to match it pixel for pixel.
+static void blit_row_scalar(uint32_t* dest, const uint8_t* indices, const uint32_t* colors, bool flip, bool transparent_zero) {
+	for (int i = 0; i < 8; i++) {
+		uint8_t color_index = indices[flip ? 7 - i : i];
+		if (!transparent_zero || color_index != 0) dest[i] = colors[color_index];
+	}
+}
+
+#ifdef KVM_GPU_SIMD
+// Look up 4 pixels at once. There are only 4 colors, so compare against each one instead of gathering.
+static __m128i lookup_colors_sse2(__m128i indices, const uint32_t* colors) {
+	__m128i pixels = _mm_and_si128(_mm_cmpeq_epi32(indices, _mm_set1_epi32(0)), _mm_set1_epi32((int)colors[0]));
+	pixels = _mm_or_si128(pixels, _mm_and_si128(_mm_cmpeq_epi32(indices, _mm_set1_epi32(1)), _mm_set1_epi32((int)colors[1])));
+	pixels = _mm_or_si128(pixels, _mm_and_si128(_mm_cmpeq_epi32(indices, _mm_set1_epi32(2)), _mm_set1_epi32((int)colors[2])));
+	pixels = _mm_or_si128(pixels, _mm_and_si128(_mm_cmpeq_epi32(indices, _mm_set1_epi32(3)), _mm_set1_epi32((int)colors[3])));
+	return pixels;
+}
+
+static void store_pixels_sse2(uint32_t* dest, __m128i indices, __m128i pixels, bool transparent_zero) {
+	if (transparent_zero) {
+		// Keep what's already there wherever the color is 0.
+		__m128i keep = _mm_cmpeq_epi32(indices, _mm_setzero_si128());
+		pixels = _mm_or_si128(_mm_and_si128(keep, _mm_loadu_si128((const __m128i*)dest)), _mm_andnot_si128(keep, pixels));
+	}
+	_mm_storeu_si128((__m128i*)dest, pixels);
+}
+
+static void blit_row_sse2(uint32_t* dest, const uint8_t* indices, const uint32_t* colors, bool flip, bool transparent_zero) {
+	// Widen the 8 index bytes to two sets of 4 dwords.
+	__m128i zero = _mm_setzero_si128();
+	__m128i words = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)indices), zero);
+	__m128i left = _mm_unpacklo_epi16(words, zero);
+	__m128i right = _mm_unpackhi_epi16(words, zero);
+
+	if (flip) {
+		__m128i reversed_right = _mm_shuffle_epi32(right, _MM_SHUFFLE(0, 1, 2, 3));
+		right = _mm_shuffle_epi32(left, _MM_SHUFFLE(0, 1, 2, 3));
+		left = reversed_right;
+	}
+
+	store_pixels_sse2(dest, left, lookup_colors_sse2(left, colors), transparent_zero);
+	store_pixels_sse2(dest + 4, right, lookup_colors_sse2(right, colors), transparent_zero);
+}
+
+KVM_GPU_AVX2_FUNCTION
+static void blit_row_avx2(uint32_t* dest, const uint8_t* indices, const uint32_t* colors, bool flip, bool transparent_zero) {
+	__m256i color_indices = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)indices));
+	if (flip) color_indices = _mm256_permutevar8x32_epi32(color_indices, _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+
+	// The 4 colors fit in one register, so the lookup is a single permute.
+	__m256i palette = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)colors));
+	__m256i pixels = _mm256_permutevar8x32_epi32(palette, color_indices);
+
+	if (transparent_zero) {
+		__m256i draw = _mm256_cmpgt_epi32(color_indices, _mm256_setzero_si256());
+		_mm256_maskstore_epi32((int*)dest, draw, pixels);
+	}
+	else {
+		_mm256_storeu_si256((__m256i*)dest, pixels);
+	}
+}
+#endif
+
+static bool blitter_supported(kvm_gpu_blitter blitter) {
+	switch (blitter) {
+	case kvm_gpu_blitter_scalar:
+		return true;
+#ifdef KVM_GPU_SIMD
+	case kvm_gpu_blitter_sse2:
+		return true;
+	case kvm_gpu_blitter_avx2:
+		return SDL_HasAVX2() == SDL_TRUE;
+#endif
+	default:
+		return false;
+	}
+}
+
+static blit_row_function get_blit_row_function(kvm_gpu_blitter blitter) {
+	switch (blitter) {
+#ifdef KVM_GPU_SIMD
+	case kvm_gpu_blitter_sse2:
+		return blit_row_sse2;
+	case kvm_gpu_blitter_avx2:
+		return blit_row_avx2;
+#endif
+	default:
+		return blit_row_scalar;
+	}
+}
+
+// The color indices for row `row` of a tile after flipping and mirroring, still to be reversed if *flip is set.
+// A mirrored tile's rows are the tile's columns, which are copied out to column.
+static const uint8_t* get_tile_row(const uint8_t* tile_pixels, int row, uint8_t fliph, uint8_t flipv, uint8_t mirror, uint8_t* column, bool* flip) {
+	if (!mirror) {
+		*flip = fliph;
+		return tile_pixels + (flipv ? 7 - row : row) * 8;
+	}
+
+	int column_x = fliph ? 7 - row : row;
+	for (int i = 0; i < 8; i++) {
+		column[i] = tile_pixels[i * 8 + column_x];
+	}
+	*flip = flipv;
+	return column;
+}
+
+#pragma endregion
+
+// Hand each write to the caches that care about it. Every handler clips to its own tables.
+static void on_vram_write(void* userdata, size_t address, size_t length) {
+	on_palette_write(userdata, address, length);
+	on_tile_map_write(userdata, address, length);
+	on_sprite_position_write(userdata, address, length);
+	on_tile_rom_write(userdata, address, length);
+}
+
+kvm_gpu* kvm_gpu_init(kvm_memory* mem, bool headless) {
+	kvm_gpu* gpu = malloc(sizeof(kvm_gpu));
+	gpu->main_window = NULL;
+	gpu->main_renderer = NULL;
+	gpu->screen_texture = NULL;
+	gpu->integer_scale = false;
+	gpu->target_surface = NULL;
+	gpu->frame_count = 0;
+
+	gpu->blitter = kvm_gpu_blitter_scalar;
+	if (blitter_supported(kvm_gpu_blitter_sse2)) gpu->blitter = kvm_gpu_blitter_sse2;
+	if (blitter_supported(kvm_gpu_blitter_avx2)) gpu->blitter = kvm_gpu_blitter_avx2;
+	gpu->blit_row = get_blit_row_function(gpu->blitter);
+
+	gpu->mem = mem;
+	gpu->vram_hook_id = kvm_memory_add_write_hook(mem, on_vram_write, gpu);
+	if (gpu->vram_hook_id < 0) {
+		kvm_gpu_quit(gpu);
+		return NULL;
+	}
+	kvm_memory_watch_pages(mem, gpu->vram_hook_id, VRAM_BGCOLOR >> 8, 1, true);
+	kvm_memory_watch_pages(mem, gpu->vram_hook_id, VRAM_TILE_MAP_TABLE >> 8, (MAP_ENTRIES * 2) >> 8, true);
+	kvm_memory_watch_pages(mem, gpu->vram_hook_id, VRAM_SPRITE_X_TABLE >> 8, 2, true);
+	kvm_memory_watch_pages(mem, gpu->vram_hook_id, GRAPHICS_ROM_MEM_LOC >> 8, TILE_ROM_SIZE >> 8, true);
+
+	mark_all_tiles_dirty(gpu);
+
+	memset(gpu->palette_lut, 0, sizeof(gpu->palette_lut));
+	gpu->bg_pixel = 0;
+	gpu->palettes_dirty = true;
+
+	mark_background_dirty(gpu);
+
+	memset(gpu->band_sprites, 0, sizeof(gpu->band_sprites));
+	memset(gpu->sprite_bands, NO_BAND, sizeof(gpu->sprite_bands));
+	gpu->visible_sprites = 0;
+	memset(gpu->dirty_sprites, 0xFF, sizeof(gpu->dirty_sprites));
+	gpu->any_dirty_sprites = true;
+
+	if (headless) {
+		// No window to match the format of, so just use 32 bit color.
+		gpu->target_surface = SDL_CreateRGBSurfaceWithFormat(0, 256, 256, 32, SDL_PIXELFORMAT_ARGB8888);
+	}
+	else {
+		gpu->main_window = SDL_CreateWindow(
+			NULL,
+			SDL_WINDOWPOS_CENTERED,
+			SDL_WINDOWPOS_CENTERED,
+			OUTER_WINDOW_SIZE,
+			OUTER_WINDOW_SIZE,
+			SDL_WINDOW_BORDERLESS | SDL_WINDOW_ALWAYS_ON_TOP
+		);
+
+		if (!gpu->main_window) {
+			printf("Error creating SDL window.\n");
+			kvm_gpu_quit(gpu);
+			return NULL;
+		}
+
+		SDL_WarpMouseInWindow(gpu->main_window, 128, 128);
+
+		gpu->main_renderer = SDL_CreateRenderer(
+			gpu->main_window,
+			-1,
+			SDL_RENDERER_ACCELERATED
+		);
+
+		if (!gpu->main_renderer) {
+			printf("Error creating SDL renderer.\n");
+			kvm_gpu_quit(gpu);
+			return NULL;
+		}
+
+		// Match the window's format so the upload is a straight copy, as long as it's 32 bit like everything here draws.
+		Uint32 format = SDL_GetWindowPixelFormat(gpu->main_window);
+		if (SDL_BYTESPERPIXEL(format) != 4) format = SDL_PIXELFORMAT_ARGB8888;
+
+		gpu->screen_texture = SDL_CreateTexture(gpu->main_renderer, format, SDL_TEXTUREACCESS_STREAMING, 256, 256);
+		if (!gpu->screen_texture) {
+			printf("Error creating SDL texture: %s\n", SDL_GetError());
+			kvm_gpu_quit(gpu);
+			return NULL;
+		}
+		SDL_SetTextureScaleMode(gpu->screen_texture, SDL_ScaleModeNearest);
+
+		gpu->target_surface = SDL_CreateRGBSurfaceWithFormat(0, 256, 256, 32, format);
+
+		SDL_ShowCursor(SDL_DISABLE);
+	}
+
+	if (!gpu->target_surface) {
+		printf("Error creating SDL surface: %s\n", SDL_GetError());
+		kvm_gpu_quit(gpu);
+		return NULL;
+	}
 
 	for (int i = 0; i < 1024; i++) {
 		mem->data[VRAM_TILE_MAP_TABLE + i] = 0xFF;
 	}
+	kvm_memory_notify_write(mem, VRAM_TILE_MAP_TABLE, 1024);
 
-	return 0;
+	return gpu;
 }
 
-void kvm_gpu_quit(void) {
-	SDL_DestroyRenderer(main_renderer);
-	SDL_DestroyWindow(main_window);
+void kvm_gpu_quit(kvm_gpu* gpu) {
+	if (!gpu) return;
+
+	if (gpu->target_surface) SDL_FreeSurface(gpu->target_surface);
+	if (gpu->screen_texture) SDL_DestroyTexture(gpu->screen_texture);
+	if (gpu->main_renderer) SDL_DestroyRenderer(gpu->main_renderer);
+	if (gpu->main_window) SDL_DestroyWindow(gpu->main_window);
+	if (gpu->vram_hook_id >= 0) kvm_memory_remove_write_hook(gpu->mem, gpu->vram_hook_id);
+
+	free(gpu);
 }
 
 #pragma region Drawing Functions
@@ -85,39 +559,105 @@ void tile_lock_update(kvm_memory* mem) {
 
 	uint8_t* screen_flags = mem->data + VRAM_SCREEN_FLAGS;
 	*screen_flags &= 0b11111101; // Clear the lock update flag
+	kvm_memory_notify_write(mem, VRAM_SCREEN_FLAGS, 1);
 }
 
-// Tile rendering algorithm. Will always render the entire field of tiles, which is 32x32.
-int render_tiles(SDL_Surface* surf, kvm_memory *mem) {
-	if (!surf) {
-		printf("Could not get window surface.");
-		return -1;
+// Draw one entry of the tile map into the background layer, where it covers its own 8x8 square.
+static void draw_background_tile(kvm_gpu* gpu, kvm_memory* mem, int tile_i) {
+	int t_x = (tile_i * 8) % 256;
+	int t_y = (tile_i * 8) / 256 * 8;
+
+	uint8_t tile_id = mem->data[VRAM_TILE_MAP_TABLE + tile_i];
+
+	uint8_t attributes = mem->data[VRAM_TILE_ATTRIBUTE_TABLE + tile_i];
+
+	uint8_t fliph = extract_bits(attributes, 0b10000000, 7); // horizontal flip
+	uint8_t flipv = extract_bits(attributes, 0b01000000, 6); // vertical flip
+	uint8_t mirror = extract_bits(attributes, 0b00100000, 5); // reverse x and y
+	uint8_t zeroc = extract_bits(attributes, 0b00010000, 4); // Whether or not to use the zero color (if no, bg color is used)
+
+	uint8_t palette = extract_bits(attributes, 0b00001111, 0); // The color palette to use
+
+	const uint8_t* tile_pixels = gpu->decoded_tiles[tile_id];
+
+	// The colors this tile can use, with the background color already swapped in where it applies.
+	uint32_t colors[PALETTE_COLORS];
+	for (int c = 0; c < PALETTE_COLORS; c++) {
+		colors[c] = gpu->palette_lut[palette][c];
+	}
+	if (zeroc) colors[0] = gpu->bg_pixel;
+	if (tile_id == 0xff) {
+		for (int c = 0; c < PALETTE_COLORS; c++) colors[c] = gpu->bg_pixel;
 	}
 
-	uint8_t* mem_data = mem->data;
-	uint8_t* tile_map = mem_data + VRAM_TILE_MAP_TABLE;
-	uint8_t* tile_attributes = mem_data + VRAM_TILE_ATTRIBUTE_TABLE;
-	uint8_t* tile_rom = mem_data + GRAPHICS_ROM_MEM_LOC;
-	uint8_t* palettes = mem_data + VRAM_COLOR_PALETTES;
+	for (int row = 0; row < 8; row++) {
+		uint8_t column[8];
+		bool flip;
+		const uint8_t* indices = get_tile_row(tile_pixels, row, fliph, flipv, mirror, column, &flip);
 
-	uint8_t screen_flags = mem_data[VRAM_SCREEN_FLAGS]; // Currently, screen flags will only test bit 1 for x/y scroll mode.
-	uint8_t* scroll_table = mem_data + VRAM_TILE_LINE_SHIFT_TABLE;
-	uint8_t* lock_table = mem_data + VRAM_TILE_LINE_LOCK_TABLE;
+		gpu->blit_row(gpu->background + (t_y + row) * WINDOW_SIZE + t_x, indices, colors, flip, false);
+	}
+}
 
-	uint8_t perpendicular_scroll = mem_data[VRAM_PERPENDICULAR_SCROLL];
+static void update_background(kvm_gpu* gpu, kvm_memory* mem) {
+	if (!gpu->any_dirty_map_entries) return;
+
+	for (int word = 0; word < MAP_ENTRIES / 32; word++) {
+		uint32_t bits = gpu->dirty_map_entries[word];
+		for (int bit = 0; bits; bit++, bits >>= 1) {
+			if (bits & 1) draw_background_tile(gpu, mem, word * 32 + bit);
+		}
+		gpu->dirty_map_entries[word] = 0;
+	}
+	gpu->any_dirty_map_entries = false;
+}
 
-	// Get the background color
-	uint8_t* bg_color_ptr = mem_data + VRAM_BGCOLOR;
-	uint32_t bg_color = (bg_color_ptr[0] << 16) | (bg_color_ptr[1] << 8) | (bg_color_ptr[2]);
+// Line i (a row of tiles in y-scroll mode, a column in x-scroll mode) is moved by the perpendicular scroll unless it's locked.
+// When that comes out the same for every line, each screen pixel is covered by exactly one tile and the screen can be built a row at a time.
+static bool lines_move_together(const uint8_t* lock_table, uint8_t perpendicular_scroll) {
+	if (perpendicular_scroll == 0) return true;
 
-	uint8_t scroll_mode = extract_bits(screen_flags, 0b1, 0); // zero represents x-scroll, 1 is y-scroll
+	for (int line = 1; line < 32; line++) {
+		if (!lock_table[line] != !lock_table[0]) return false;
+	}
+	return true;
+}
 
-	uint8_t lock_update = extract_bits(screen_flags, 0b10, 1);
-	if (lock_update) {
-		tile_lock_update(mem);
+// Copy a row of WINDOW_SIZE pixels, moved right by shift and wrapped around, in two spans.
+static void copy_shifted_row(uint32_t* dest, const uint32_t* src, uint8_t shift) {
+	memcpy(dest + shift, src, (WINDOW_SIZE - shift) * sizeof(uint32_t));
+	memcpy(dest, src + WINDOW_SIZE - shift, shift * sizeof(uint32_t));
+}
+
+// Y-scroll mode: each row of tiles has its own x scroll, and every row shares the same y scroll.
+static void draw_scrolled_rows(kvm_gpu* gpu, SDL_Surface* surf, const uint8_t* scroll_table, uint8_t y_scroll) {
+	for (int y = 0; y < WINDOW_SIZE; y++) {
+		uint8_t src_y = (uint8_t)(y - y_scroll);
+		uint32_t* dest = (uint32_t*)((uint8_t*)surf->pixels + y * surf->pitch);
+
+		copy_shifted_row(dest, gpu->background + src_y * WINDOW_SIZE, scroll_table[src_y >> 3]);
 	}
+}
 
-	SDL_LockSurface(surf);
+// X-scroll mode: each column of tiles has its own y scroll, and every column shares the same x scroll.
+static void draw_scrolled_columns(kvm_gpu* gpu, SDL_Surface* surf, const uint8_t* scroll_table, uint8_t x_scroll) {
+	uint32_t line[WINDOW_SIZE];
+
+	for (int y = 0; y < WINDOW_SIZE; y++) {
+		// Gather the row before the x scroll, a tile row from each column.
+		for (int column = 0; column < 32; column++) {
+			uint8_t src_y = (uint8_t)(y - scroll_table[column]);
+			memcpy(line + column * 8, gpu->background + src_y * WINDOW_SIZE + column * 8, 8 * sizeof(uint32_t));
+		}
+
+		uint32_t* dest = (uint32_t*)((uint8_t*)surf->pixels + y * surf->pitch);
+		copy_shifted_row(dest, line, x_scroll);
+	}
+}
+
+// For when lines are scrolled by different amounts. They can overlap (the later tile in the map wins) or leave gaps (whatever was there stays),
+// so copy each tile's 8x8 block to wherever its scroll puts it, in map order.
+static void draw_scrolled_tiles(kvm_gpu* gpu, SDL_Surface* surf, uint8_t scroll_mode, const uint8_t* scroll_table, const uint8_t* lock_table, uint8_t perpendicular_scroll) {
 	for (int tile_i = 0; tile_i < 1024; tile_i++) {
 		int t_x = (tile_i * 8) % 256;
 		int t_y = (tile_i * 8) / 256 * 8;
@@ -139,215 +679,201 @@ int render_tiles(SDL_Surface* surf, kvm_memory *mem) {
 			if(!lock_table[t_xcoord]) x_scroll = perpendicular_scroll;
 		}
 
-		uint8_t tile_id = tile_map[tile_i];
+		// Split each row in two where it wraps around the right edge.
+		int dest_x = (t_x + x_scroll) % WINDOW_SIZE;
+		int left_pixels = WINDOW_SIZE - dest_x < 8 ? WINDOW_SIZE - dest_x : 8;
 
-		uint8_t attributes = tile_attributes[tile_i];
+		for (int row = 0; row < 8; row++) {
+			const uint32_t* src = gpu->background + (t_y + row) * WINDOW_SIZE + t_x;
+			int dest_y = (t_y + row + y_scroll) % WINDOW_SIZE;
+			uint32_t* dest = (uint32_t*)((uint8_t*)surf->pixels + dest_y * surf->pitch);
 
-		uint8_t fliph = extract_bits(attributes, 0b10000000, 7); // horizontal flip
-		uint8_t flipv = extract_bits(attributes, 0b01000000, 6); // vertical flip
-		uint8_t mirror = extract_bits(attributes, 0b00100000, 5); // reverse x and y
-		uint8_t zeroc = extract_bits(attributes, 0b00010000, 4); // Whether or not to use the zero color (if no, bg color is used)
+			memcpy(dest + dest_x, src, left_pixels * sizeof(uint32_t));
+			if (left_pixels < 8) memcpy(dest, src + left_pixels, (8 - left_pixels) * sizeof(uint32_t));
+		}
+	}
+}
 
-		uint8_t palette = extract_bits(attributes, 0b00001111, 0); // The color palette to use
-		int palette_ptr = palette * 12;
+// Tile rendering algorithm. Will always render the entire field of tiles, which is 32x32.
+// Tiles come from the background layer, so this only has to copy them to where the scroll puts them.
+int render_tiles(kvm_gpu* gpu, SDL_Surface* surf, kvm_memory *mem) {
+	if (!surf) {
+		printf("Could not get window surface.");
+		return -1;
+	}
 
-		int tile_rom_ptr = tile_id * 16; // 16 bytes per tile in ROM
+	uint8_t* mem_data = mem->data;
 
-		//printf("x: %d, y: %d, i: (%d), id: %x, trp: %d, p: %d, p_ptr: %d, fh: %d, fv: %d, mir: %d, zc: %d, atts: %x\n", t_x, t_y, tile_i, tile_id, tile_rom_ptr, palette, palette_ptr, fliph, flipv, mirror, zeroc, attributes);
+	uint8_t screen_flags = mem_data[VRAM_SCREEN_FLAGS]; // Currently, screen flags will only test bit 1 for x/y scroll mode.
+	uint8_t* scroll_table = mem_data + VRAM_TILE_LINE_SHIFT_TABLE;
+	uint8_t* lock_table = mem_data + VRAM_TILE_LINE_LOCK_TABLE;
 
-		// Set up initial drawing values for the tile
-		int x = 0, x_init = 0;
-		int y = 0, y_init = 0;
-		int x_increment = 1;
-		int y_increment = 1;
+	uint8_t perpendicular_scroll = mem_data[VRAM_PERPENDICULAR_SCROLL];
 
-		if (fliph) {
-			x += 7;
-			x_init = 7;
-			x_increment = -1;
-		}
+	uint8_t scroll_mode = extract_bits(screen_flags, 0b1, 0); // zero represents x-scroll, 1 is y-scroll
+
+	uint8_t lock_update = extract_bits(screen_flags, 0b10, 1);
+	if (lock_update) {
+		tile_lock_update(mem);
+	}
 
-		if (flipv) {
-			y += 7;
-			y_init = 7;
-			y_increment = -1;
+	update_background(gpu, mem);
+
+	SDL_LockSurface(surf);
+	if (!lines_move_together(lock_table, perpendicular_scroll)) {
+		draw_scrolled_tiles(gpu, surf, scroll_mode, scroll_table, lock_table, perpendicular_scroll);
+	}
+	else {
+		uint8_t shared_scroll = lock_table[0] ? 0 : perpendicular_scroll;
+		if (scroll_mode == 1) {
+			draw_scrolled_rows(gpu, surf, scroll_table, shared_scroll);
 		}
+		else {
+			draw_scrolled_columns(gpu, surf, scroll_table, shared_scroll);
+		}
+	}
+	SDL_UnlockSurface(surf);
 
-		int shift = 0;
-		int byte_offset = 0;
-		int bit_pos = 0;
+	return 0;
+}
 
-		// Counts to 8 and then resets
-		int count = 0;
+// Draw the rows of a sprite that fall in one band of 8 lines.
+static void draw_sprite_band(kvm_gpu* gpu, SDL_Surface* surf, kvm_memory* mem, int sprite_i, int band) {
+	uint8_t t_x = mem->data[VRAM_SPRITE_X_TABLE + sprite_i];
+	uint8_t t_y = mem->data[VRAM_SPRITE_Y_TABLE + sprite_i];
 
-		for (int pix_i = 0; pix_i < 64; pix_i++) {
-			// Get the color for the pixel.
-			uint8_t color_index = extract_bits(tile_rom[tile_rom_ptr + byte_offset], 0b11 << shift, shift);
+	// Get info about the sprite.
+	uint8_t tile_id = mem->data[VRAM_SPRITE_TILE_TABLE + sprite_i];
 
-			uint32_t color = bg_color;
-			if ((!zeroc || color_index != 0) && tile_id != 0xff) {
-				int i0 = palette_ptr + (3 * color_index);
-				color = (palettes[i0] << 16) | (palettes[i0 + 1] << 8) | (palettes[i0 + 2]);
-			}
-			
-			if (mirror) {
-				// Flip the pixel x and y within the tile if it's mirrored.
-				set_pixel(surf, y + t_x + x_scroll, x + t_y + y_scroll, color);
-			}
-			else {
-				set_pixel(surf, x + t_x + x_scroll, y + t_y + y_scroll, color);
-			}
+	uint8_t attributes = mem->data[VRAM_SPRITE_ATTRIBUTE_TABLE + sprite_i];
 
-			// Increment pixel drawing values
-			count++;
-			x += x_increment;
-			if (count > 7) {
-				x = x_init;
-				y += y_increment;
-				count = 0;
-			}
+	uint8_t fliph = extract_bits(attributes, 0b10000000, 7); // horizontal flip
+	uint8_t flipv = extract_bits(attributes, 0b01000000, 6); // vertical flip
+	uint8_t mirror = extract_bits(attributes, 0b00100000, 5); // reverse x and y
+	uint8_t zeroc = extract_bits(attributes, 0b00010000, 4); // Whether or not to use the zero color (if no, color is not drawn)
 
-			bit_pos++;
-			if (bit_pos > 3) {
-				bit_pos = 0;
-				byte_offset++;
-			}
+	uint8_t palette = extract_bits(attributes, 0b00001111, 0); // The color palette to use
+	const uint32_t* colors = gpu->palette_lut[palette];
 
-			shift += 2;
-			if (shift > 6) {
-				shift = 0;
-			}
+	const uint8_t* tile_pixels = gpu->decoded_tiles[tile_id];
+
+	// The sprite's rows in this band. It starts either above the band, or somewhere inside it.
+	int first_row = (uint8_t)(band * 8 - t_y);
+	if (first_row >= 8) first_row = 0;
+	int first_y = (t_y + first_row) % WINDOW_SIZE;
+	int end_row = first_row + (band * 8 + 8 - first_y);
+	if (end_row > 8) end_row = 8;
+
+	for (int row = first_row; row < end_row; row++) {
+		int y = (t_y + row) % WINDOW_SIZE;
+
+		uint8_t column[8];
+		bool flip;
+		const uint8_t* indices = get_tile_row(tile_pixels, row, fliph, flipv, mirror, column, &flip);
+
+		uint32_t* dest = (uint32_t*)((uint8_t*)surf->pixels + y * surf->pitch);
+		if (t_x + 8 <= WINDOW_SIZE) {
+			gpu->blit_row(dest + t_x, indices, colors, flip, zeroc);
 		}
+		else {
+			// The last pixel wraps around to the left edge, so draw the row somewhere it fits and copy it back.
+			uint32_t wrapped[8];
+			int left_pixels = WINDOW_SIZE - t_x;
+			memcpy(wrapped, dest + t_x, left_pixels * sizeof(uint32_t));
+			memcpy(wrapped + left_pixels, dest, (8 - left_pixels) * sizeof(uint32_t));
 
-	}
-	SDL_UnlockSurface(surf);
+			gpu->blit_row(wrapped, indices, colors, flip, zeroc);
 
-	return 0;
+			memcpy(dest + t_x, wrapped, left_pixels * sizeof(uint32_t));
+			memcpy(dest, wrapped + left_pixels, (8 - left_pixels) * sizeof(uint32_t));
+		}
+	}
 }
 
 // Sprite rendering routine.
 // Very similar to tiles, except they aren't locked to a grid, and you can render between 0 and 256 of them.
-int render_sprites(SDL_Surface* surf, kvm_memory* mem) {
+// Goes a band of 8 lines at a time, only through the sprites binned there. Each band still draws its sprites in table order, so later sprites end up on top.
+int render_sprites(kvm_gpu* gpu, SDL_Surface* surf, kvm_memory* mem) {
 	if (!surf) {
 		printf("Could not get window surface.");
 		return -1;
 	}
 
-	uint8_t* mem_data = mem->data;
-	uint8_t* sprite_x = mem_data + VRAM_SPRITE_X_TABLE;
-	uint8_t* sprite_y = mem_data + VRAM_SPRITE_Y_TABLE;
-	uint8_t* sprite_tiles = mem_data + VRAM_SPRITE_TILE_TABLE;
-	uint8_t* sprite_attributes = mem_data + VRAM_SPRITE_ATTRIBUTE_TABLE;
-
-	uint8_t* tile_rom = mem_data + GRAPHICS_ROM_MEM_LOC;
-	uint8_t* palettes = mem_data + VRAM_COLOR_PALETTES;
+	update_sprite_bins(gpu);
+	if (gpu->visible_sprites == 0) return 0;
 
 	SDL_LockSurface(surf);
-	for (int sprite_i = 0; sprite_i < 256; sprite_i++) {
-		uint8_t t_x = sprite_x[sprite_i];
-		uint8_t t_y = sprite_y[sprite_i];
-		if ((uint8_t)(t_x - 1) > 248 || (uint8_t)(t_y - 1) > 248) {
-			// Illegal sprite position, do not render.
-			continue;
+	for (int band = 0; band < BAND_COUNT; band++) {
+		for (int word = 0; word < SPRITE_COUNT / 32; word++) {
+			uint32_t bits = gpu->band_sprites[band][word];
+			for (int bit = 0; bits; bit++, bits >>= 1) {
+				if (bits & 1) draw_sprite_band(gpu, surf, mem, word * 32 + bit, band);
+			}
 		}
+	}
+	SDL_UnlockSurface(surf);
+	return 0;
+}
 
-		// Get info about the sprite.
-		uint8_t tile_id = sprite_tiles[sprite_i];
-
-		uint8_t attributes = sprite_attributes[sprite_i];
-
-		uint8_t fliph = extract_bits(attributes, 0b10000000, 7); // horizontal flip
-		uint8_t flipv = extract_bits(attributes, 0b01000000, 6); // vertical flip
-		uint8_t mirror = extract_bits(attributes, 0b00100000, 5); // reverse x and y
-		uint8_t zeroc = extract_bits(attributes, 0b00010000, 4); // Whether or not to use the zero color (if no, color is not drawn)
-
-		uint8_t palette = extract_bits(attributes, 0b00001111, 0); // The color palette to use
-		int palette_ptr = palette * 12;
 
-		int tile_rom_ptr = tile_id * 16; // 16 bytes per tile in ROM
 
-		//printf("x: %d, y: %d, i: (%d), id: %x, trp: %d, p: %d, p_ptr: %d, fh: %d, fv: %d, mir: %d, zc: %d, atts: %x\n", t_x, t_y, tile_i, tile_id, tile_rom_ptr, palette, palette_ptr, fliph, flipv, mirror, zeroc, attributes);
+#pragma endregion
 
-		int x = 0, x_init = 0;
-		int y = 0, y_init = 0;
-		int x_increment = 1;
-		int y_increment = 1;
+#pragma region Presenting
 
-		if (fliph) {
-			x += 7;
-			x_init = 7;
-			x_increment = -1;
-		}
-
-		if (flipv) {
-			y += 7;
-			y_init = 7;
-			y_increment = -1;
-		}
+// Where the frame goes in the window: as big as fits, centered. With integer_scale, only whole multiples of 256 are used.
+static SDL_Rect get_present_rect(kvm_gpu* gpu) {
+	int width, height;
+	if (SDL_GetRendererOutputSize(gpu->main_renderer, &width, &height) != 0) {
+		width = OUTER_WINDOW_SIZE;
+		height = OUTER_WINDOW_SIZE;
+	}
 
-		int shift = 0;
-		int byte_offset = 0;
-		int bit_pos = 0;
-
-		// Counts to 8 and then resets
-		int count = 0;
-
-		for (int pix_i = 0; pix_i < 64; pix_i++) {
-			uint8_t color_index = extract_bits(tile_rom[tile_rom_ptr + byte_offset], 0b11 << shift, shift);
-			//printf("TRptr: %d, offset: %d, shift: %d, ci: %d\n", tile_rom_ptr, byte_offset, shift, color_index);
-
-			if (!zeroc || color_index != 0) {
-				int i0 = palette_ptr + (3 * color_index);
-				uint32_t color = (palettes[i0] << 16) | (palettes[i0 + 1] << 8) | (palettes[i0 + 2]);
-
-				//printf("x: %d, y:%d, c:%x, ci:%d", x, y, color, color_index);
-				if (mirror) {
-					set_pixel(surf, y + t_x, x + t_y, color);
-					//printf("x: %d, y:%d, c:%x\n", y, x, color);
-				}
-				else {
-					set_pixel(surf, x + t_x, y + t_y, color);
-				}
-			}
+	int size = width < height ? width : height;
+	if (gpu->integer_scale && size >= WINDOW_SIZE) size -= size % WINDOW_SIZE;
 
-			count++;
-			x += x_increment;
-			if (count > 7) {
-				x = x_init;
-				y += y_increment;
-				count = 0;
-			}
+	SDL_Rect rect = { (width - size) / 2, (height - size) / 2, size, size };
+	return rect;
+}
 
-			bit_pos++;
-			if (bit_pos > 3) {
-				bit_pos = 0;
-				byte_offset++;
-			}
+// Upload the frame to the streaming texture and let the renderer scale it up.
+static int present_frame(kvm_gpu* gpu) {
+	SDL_Surface* surf = gpu->target_surface;
 
-			shift += 2;
-			if (shift > 6) {
-				shift = 0;
-			}
-		}
+	void* pixels;
+	int pitch;
+	if (SDL_LockTexture(gpu->screen_texture, NULL, &pixels, &pitch) != 0) {
+		printf("Error locking SDL texture: %s\n", SDL_GetError());
+		return -1;
 	}
-	SDL_UnlockSurface(surf);
+	for (int y = 0; y < WINDOW_SIZE; y++) {
+		memcpy((uint8_t*)pixels + y * pitch, (const uint8_t*)surf->pixels + y * surf->pitch, WINDOW_SIZE * sizeof(uint32_t));
+	}
+	SDL_UnlockTexture(gpu->screen_texture);
+
+	SDL_Rect dest = get_present_rect(gpu);
+	SDL_SetRenderDrawColor(gpu->main_renderer, 0, 0, 0, 255);
+	SDL_RenderClear(gpu->main_renderer);
+	SDL_RenderCopy(gpu->main_renderer, gpu->screen_texture, NULL, &dest);
+	SDL_RenderPresent(gpu->main_renderer);
 	return 0;
 }
 
-
-
 #pragma endregion
 
-int kvm_gpu_refresh_graphics(kvm_memory* mem) {
+int kvm_gpu_refresh_graphics(kvm_gpu* gpu, kvm_memory* mem) {
+	SDL_Surface* target_surface = gpu->target_surface;
 
+	update_tile_cache(gpu);
+	update_palette_cache(gpu);
 
-	if (render_tiles(target_surface, mem) != 0)
+	if (render_tiles(gpu, target_surface, mem) != 0)
 	{
 		printf("Error rendering tiles.\n");
 		return -1;
 	}
 
-	if (render_sprites(target_surface, mem) != 0)
+	if (render_sprites(gpu, target_surface, mem) != 0)
 	{
 		printf("Error rendering sprites.\n");
 		return -1;
@@ -355,23 +881,45 @@ int kvm_gpu_refresh_graphics(kvm_memory* mem) {
 
 
 
-	//renderTarget = SDL_CreateTextureFromSurface(main_renderer, surf);
-	SDL_Rect inner_resolution = {
-		0,
-		0,
-		256,
-		256
-	};
+	gpu->frame_count++;
 
-	SDL_Rect outer_resolution = {
-		0,
-		0,
-		OUTER_WINDOW_SIZE,
-		OUTER_WINDOW_SIZE
-	};
+	// Headless, the frame stays in target_surface.
+	if (!gpu->main_window) return 0;
 
-	SDL_BlitScaled(target_surface, &inner_resolution, SDL_GetWindowSurface(main_window), &outer_resolution);
+	return present_frame(gpu);
+}
 
-	SDL_UpdateWindowSurface(main_window);
-	return 0;
+SDL_Surface* kvm_gpu_get_surface(kvm_gpu* gpu) {
+	return gpu ? gpu->target_surface : NULL;
+}
+
+uint32_t kvm_gpu_get_frame_count(kvm_gpu* gpu) {
+	return gpu ? gpu->frame_count : 0;
+}
+
+bool kvm_gpu_set_blitter(kvm_gpu* gpu, kvm_gpu_blitter blitter) {
+	if (!gpu || !blitter_supported(blitter)) return false;
+
+	gpu->blitter = blitter;
+	gpu->blit_row = get_blit_row_function(blitter);
+
+	// Redraw the background layer with the new blitter too.
+	mark_background_dirty(gpu);
+	return true;
+}
+
+void kvm_gpu_set_vsync(kvm_gpu* gpu, bool enabled) {
+	if (!gpu || !gpu->main_renderer) return;
+
+	if (SDL_RenderSetVSync(gpu->main_renderer, enabled ? 1 : 0) != 0) {
+		printf("Error setting vsync: %s\n", SDL_GetError());
+	}
+}
+
+void kvm_gpu_set_integer_scale(kvm_gpu* gpu, bool enabled) {
+	if (gpu) gpu->integer_scale = enabled;
+}
+
+kvm_gpu_blitter kvm_gpu_get_blitter(kvm_gpu* gpu) {
+	return gpu ? gpu->blitter : kvm_gpu_blitter_scalar;
 }
@@ -3,14 +3,46 @@
 */
 
 #pragma once
+#include <SDL.h>
+#include <stdbool.h>
+#include <stdint.h>
+
 #include "kvm_memory.h"
 
 
-// Create the SDL window and renderer, and set up the display surface.
-int kvm_gpu_init(kvm_memory* mem);
+typedef struct kvm_gpu kvm_gpu;
+
+// Create the SDL window and renderer, and set up the display surface. Returns NULL on failure.
+// When headless, no window is made and frames are only drawn to the display surface (see kvm_gpu_get_surface()).
+kvm_gpu* kvm_gpu_init(kvm_memory* mem, bool headless);
 
 // Tear down the things that were created with kvm_gpu_init()
-void kvm_gpu_quit(void);
+void kvm_gpu_quit(kvm_gpu* gpu);
 
 // Access memory and draw the proper pixels to the screen, then refresh the display.
-int kvm_gpu_refresh_graphics(kvm_memory* mem);
\ No newline at end of file
+// The frame is uploaded to a streaming texture, and the window's renderer does the scaling.
+int kvm_gpu_refresh_graphics(kvm_gpu* gpu, kvm_memory* mem);
+
+// The 256x256 surface every frame is drawn to, before it gets scaled up to the window.
+SDL_Surface* kvm_gpu_get_surface(kvm_gpu* gpu);
+
+// Wait for the display to refresh each time a frame is shown, which also limits the program to the display's frame rate. Off by default.
+// Needs a window, does nothing when headless.
+void kvm_gpu_set_vsync(kvm_gpu* gpu, bool enabled);
+
+// Only scale frames up by whole numbers, with a black border around them if the window isn't a multiple of 256. Off by default, which fills the window.
+void kvm_gpu_set_integer_scale(kvm_gpu* gpu, bool enabled);
+
+// Number of times kvm_gpu_refresh_graphics() has been called since kvm_gpu_init().
+uint32_t kvm_gpu_get_frame_count(kvm_gpu* gpu);
+
+// The routines that draw tile and sprite rows. kvm_gpu_init() picks the fastest one this CPU has. They all draw exactly the same pixels.
+typedef enum kvm_gpu_blitter {
+	kvm_gpu_blitter_scalar,
+	kvm_gpu_blitter_sse2,	// x64 only
+	kvm_gpu_blitter_avx2	// x64 only, and only if the CPU has AVX2
+} kvm_gpu_blitter;
+
+// Switch to another blitter, mostly for testing them against each other. Returns false (and keeps the current one) if this CPU can't run it.
+bool kvm_gpu_set_blitter(kvm_gpu* gpu, kvm_gpu_blitter blitter);
+kvm_gpu_blitter kvm_gpu_get_blitter(kvm_gpu* gpu);
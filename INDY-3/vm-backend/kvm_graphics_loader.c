@@ -0,0 +1,236 @@
+/*	Loads graphics from bitmaps, like graphics_loader.py
+*	Author: Matthew Watson
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kvm_graphics_loader.h"
+#include "leakcheck_util.h"
+
+#define BMP_FILE_HEADER_SIZE 14
+#define BMP_INFO_HEADER_SIZE 40
+#define BMP_RGB 0	// No compression
+
+#pragma region Bitmaps
+
+static uint16_t read_u16(const uint8_t* data) {
+	return (uint16_t)(data[0] | (data[1] << 8));
+}
+
+static uint32_t read_u32(const uint8_t* data) {
+	return (uint32_t)data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+int kvm_bitmap_decode(const uint8_t* data, size_t size, kvm_bitmap* out) {
+	out->width = 0;
+	out->height = 0;
+	out->pixels = NULL;
+
+	if (size < BMP_FILE_HEADER_SIZE + BMP_INFO_HEADER_SIZE || data[0] != 'B' || data[1] != 'M') {
+		printf("Not a bitmap file.\n");
+		return -1;
+	}
+
+	uint32_t pixel_offset = read_u32(data + 10);
+	uint32_t header_size = read_u32(data + 14);
+	int32_t width = (int32_t)read_u32(data + 18);
+	int32_t height = (int32_t)read_u32(data + 22);
+	uint16_t bits_per_pixel = read_u16(data + 28);
+	uint32_t compression = read_u32(data + 30);
+	uint32_t colors_used = read_u32(data + 46);
+
+	// A negative height means the rows are stored from the top down instead of the bottom up.
+	bool top_down = height < 0;
+	if (top_down) height = -height;
+
+	if (header_size < BMP_INFO_HEADER_SIZE || compression != BMP_RGB || width <= 0 || height <= 0 || width > 4096 || height > 4096) {
+		printf("Unsupported bitmap format.\n");
+		return -1;
+	}
+	if (bits_per_pixel != 1 && bits_per_pixel != 4 && bits_per_pixel != 8 && bits_per_pixel != 24 && bits_per_pixel != 32) {
+		printf("Unsupported bitmap format, %d bits per pixel.\n", bits_per_pixel);
+		return -1;
+	}
+
+	// Color table, for bitmaps with 8 or fewer bits a pixel. Each color is b g r and a byte of padding.
+	uint32_t palette[256] = { 0 };
+	if (bits_per_pixel <= 8) {
+		uint32_t color_count = colors_used ? colors_used : (1u << bits_per_pixel);
+		if (color_count > 256) color_count = 256;
+
+		size_t table_offset = BMP_FILE_HEADER_SIZE + header_size;
+		if (table_offset + color_count * 4 > size) {
+			printf("Bitmap file is cut short.\n");
+			return -1;
+		}
+		for (uint32_t i = 0; i < color_count; i++) {
+			const uint8_t* entry = data + table_offset + i * 4;
+			palette[i] = ((uint32_t)entry[2] << 16) | ((uint32_t)entry[1] << 8) | entry[0];
+		}
+	}
+
+	// Rows are padded out to 4 bytes.
+	size_t row_size = (((size_t)width * bits_per_pixel + 31) / 32) * 4;
+	if (pixel_offset > size || row_size * height > size - pixel_offset) {
+		printf("Bitmap file is cut short.\n");
+		return -1;
+	}
+
+	uint32_t* pixels = malloc((size_t)width * height * sizeof(uint32_t));
+	for (int y = 0; y < height; y++) {
+		const uint8_t* row = data + pixel_offset + row_size * (top_down ? y : height - 1 - y);
+		uint32_t* out_row = pixels + (size_t)y * width;
+
+		for (int x = 0; x < width; x++) {
+			switch (bits_per_pixel) {
+			case 1:
+				out_row[x] = palette[(row[x >> 3] >> (7 - (x & 7))) & 1];
+				break;
+			case 4:
+				out_row[x] = palette[(row[x >> 1] >> ((x & 1) ? 0 : 4)) & 0xF];
+				break;
+			case 8:
+				out_row[x] = palette[row[x]];
+				break;
+			case 24:
+			case 32: {
+				const uint8_t* pixel = row + x * (bits_per_pixel / 8);
+				out_row[x] = ((uint32_t)pixel[2] << 16) | ((uint32_t)pixel[1] << 8) | pixel[0];
+				break;
+			}
+			}
+		}
+	}
+
+	out->width = width;
+	out->height = height;
+	out->pixels = pixels;
+	return 0;
+}
+
+int kvm_bitmap_load(const char* filename, kvm_bitmap* out) {
+	out->width = 0;
+	out->height = 0;
+	out->pixels = NULL;
+
+	FILE* file = fopen(filename, "rb");
+	if (!file) {
+		printf("Error opening bitmap file %s.\n", filename);
+		return -1;
+	}
+
+	fseek(file, 0L, SEEK_END);
+	size_t size = ftell(file);
+	rewind(file);
+
+	uint8_t* data = malloc(size ? size : 1);
+	size_t read = fread(data, 1, size, file);
+	fclose(file);
+
+	int result = kvm_bitmap_decode(data, read, out);
+	free(data);
+
+	return result;
+}
+
+void kvm_bitmap_free(kvm_bitmap* bitmap) {
+	if (!bitmap) return;
+
+	if (bitmap->pixels) free(bitmap->pixels);
+	bitmap->pixels = NULL;
+	bitmap->width = 0;
+	bitmap->height = 0;
+}
+
+#pragma endregion
+
+#pragma region Conversion
+
+// Numbers for every color in a tile sheet, in the order they were first seen. There can't be more colors than pixels.
+#define COLOR_TABLE_SIZE (KVM_TILE_SHEET_SIZE * KVM_TILE_SHEET_SIZE * 2)
+
+typedef struct color_entry {
+	uint32_t color;
+	uint8_t number;
+	bool used;
+} color_entry;
+
+typedef struct color_table {
+	color_entry* entries;
+	size_t count;
+	uint32_t last_color;	// Neighboring pixels are usually the same color.
+	uint8_t last_number;
+} color_table;
+
+// process_pix() in graphics_loader.py: the first four colors seen get 0 to 3, and any after that wrap back around to 0.
+static uint8_t get_color_number(color_table* table, uint32_t color) {
+	if (table->count && color == table->last_color) return table->last_number;
+
+	size_t index = (color * 2654435761u) & (COLOR_TABLE_SIZE - 1);
+	while (table->entries[index].used && table->entries[index].color != color) {
+		index = (index + 1) & (COLOR_TABLE_SIZE - 1);
+	}
+
+	color_entry* entry = &table->entries[index];
+	if (!entry->used) {
+		entry->used = true;
+		entry->color = color;
+		entry->number = (uint8_t)(table->count++ % 4);
+	}
+
+	table->last_color = color;
+	table->last_number = entry->number;
+	return entry->number;
+}
+
+int kvm_convert_tiles(const kvm_bitmap* bitmap, uint8_t* out) {
+	// image has to be 16x16 tiles.
+	if (bitmap->width != KVM_TILE_SHEET_SIZE || bitmap->height != KVM_TILE_SHEET_SIZE) {
+		printf("Image is the wrong size. Must be 128 by 128 pixels.\n");
+		return -1;
+	}
+
+	color_table table;
+	memset(&table, 0, sizeof(table));
+	table.entries = malloc(COLOR_TABLE_SIZE * sizeof(color_entry));
+	memset(table.entries, 0, COLOR_TABLE_SIZE * sizeof(color_entry));
+
+	for (int tile = 0; tile < 256; tile++) {
+		const uint32_t* tile_pixels = bitmap->pixels + (tile / 16) * 8 * KVM_TILE_SHEET_SIZE + (tile % 16) * 8;
+
+		// Each row of the tile is two bytes, four pixels in each.
+		for (int row = 0; row < 8; row++) {
+			const uint32_t* row_pixels = tile_pixels + row * KVM_TILE_SHEET_SIZE;
+
+			for (int half = 0; half < 2; half++) {
+				uint8_t byte = 0;
+				for (int i = 0; i < 4; i++) {
+					byte |= (uint8_t)(get_color_number(&table, row_pixels[half * 4 + i]) << (i * 2));
+				}
+				*out++ = byte;
+			}
+		}
+	}
+
+	free(table.entries);
+	return 0;
+}
+
+int kvm_convert_palettes(const kvm_bitmap* bitmap, uint8_t* out) {
+	if (bitmap->width != KVM_PALETTE_SHEET_WIDTH || bitmap->height != KVM_PALETTE_SHEET_HEIGHT) {
+		printf("Image is the wrong size. Must be 4 by 16 pixels.\n");
+		return -1;
+	}
+
+	for (int i = 0; i < KVM_PALETTE_SHEET_WIDTH * KVM_PALETTE_SHEET_HEIGHT; i++) {
+		uint32_t color = bitmap->pixels[i];
+		*out++ = (uint8_t)(color >> 16);
+		*out++ = (uint8_t)(color >> 8);
+		*out++ = (uint8_t)color;
+	}
+	return 0;
+}
+
+#pragma endregion
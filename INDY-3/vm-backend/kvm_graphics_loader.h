@@ -0,0 +1,44 @@
+/*	Header for loading graphics from bitmaps.
+*	Author: Matthew Watson
+*/
+
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+A C port of graphics_loader.py, so syscalls 2 and 3 don't have to start python mid-program.
+Tiles and palettes come out in the same format as the .kvmpix and .kvmpal files it writes:
+	Tiles: 256 8x8 tiles, 2 bits a pixel, 4 pixels a byte stored like [3, 2, 1, 0]. 16 bytes a tile, left to right then top to bottom.
+	Palettes: 16 palettes of 4 colors, 3 bytes a color (r g b), so 12 bytes a palette.
+*/
+
+#define KVM_TILE_SHEET_SIZE 128	// Width and height of a tile sheet in pixels.
+#define KVM_TILE_DATA_SIZE 4096
+#define KVM_PALETTE_SHEET_WIDTH 4
+#define KVM_PALETTE_SHEET_HEIGHT 16
+#define KVM_PALETTE_DATA_SIZE 192
+
+// A decoded bitmap, one 0xRRGGBB value a pixel, in rows from the top down.
+typedef struct kvm_bitmap {
+	int width;
+	int height;
+	uint32_t* pixels;
+} kvm_bitmap;
+
+// Decode a .bmp file that's already in memory. Handles uncompressed 1, 4, 8, 24, and 32 bit bitmaps.
+// Returns 0 on success, or prints the problem and returns -1. Free the bitmap with kvm_bitmap_free().
+int kvm_bitmap_decode(const uint8_t* data, size_t size, kvm_bitmap* out);
+
+// Read and decode a .bmp file.
+int kvm_bitmap_load(const char* filename, kvm_bitmap* out);
+
+void kvm_bitmap_free(kvm_bitmap* bitmap);
+
+// Turn a 128x128 tile sheet into KVM_TILE_DATA_SIZE bytes of tiles. Colors are numbered in the order they're first seen,
+// and any past the fourth wrap back around, same as graphics_loader.py. Returns -1 if the sheet is the wrong size.
+int kvm_convert_tiles(const kvm_bitmap* bitmap, uint8_t* out);
+
+// Turn a 4x16 palette sheet (one palette a row) into KVM_PALETTE_DATA_SIZE bytes of palettes. Returns -1 if the sheet is the wrong size.
+int kvm_convert_palettes(const kvm_bitmap* bitmap, uint8_t* out);
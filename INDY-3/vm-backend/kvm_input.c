@@ -6,6 +6,7 @@
 #include <SDL.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "kvm_input.h"
 #include "kvm_memory.h"
@@ -13,7 +14,7 @@
 
 #include "kvm_mem_map_constants.h"
 
-SDL_Scancode keys[] = {
+static const SDL_Scancode keys[] = {
 	SDL_SCANCODE_0, SDL_SCANCODE_1, SDL_SCANCODE_2, SDL_SCANCODE_3, SDL_SCANCODE_4, SDL_SCANCODE_5, SDL_SCANCODE_6, SDL_SCANCODE_7, SDL_SCANCODE_8, SDL_SCANCODE_9,
 
 	SDL_SCANCODE_A, SDL_SCANCODE_B, SDL_SCANCODE_C, SDL_SCANCODE_D, SDL_SCANCODE_E, SDL_SCANCODE_F, SDL_SCANCODE_G, SDL_SCANCODE_H, SDL_SCANCODE_I, SDL_SCANCODE_J,
@@ -34,13 +35,215 @@ SDL_Scancode keys[] = {
 	SDL_SCANCODE_RETURN, SDL_SCANCODE_BACKSPACE, SDL_SCANCODE_TAB, SDL_SCANCODE_CAPSLOCK
 };
 
-void kvm_input_get_keyboard(kvm_memory* mem) {
-	if (!mem) return;
+#define KEY_COUNT (sizeof(keys) / sizeof(keys[0]))
+
+// Must be a power of two, so the indices can just keep counting up and wrap around.
+#define INPUT_QUEUE_SIZE 256
+
+#pragma region Headless Input
+
+typedef enum script_device { script_key, script_mouse } script_device;
+
+typedef struct script_event {
+	uint32_t frame;
+	script_device device;
+	int values[3];
+} script_event;
+
+struct kvm_input {
+	bool headless;
+
+	script_event* script_events;
+	size_t script_event_count;
+	size_t script_next_event;
+
+	// Events pushed by another thread. Only that thread moves queue_tail, and only the VM's thread moves queue_head.
+	script_event queue_events[INPUT_QUEUE_SIZE];
+	SDL_atomic_t queue_head;
+	SDL_atomic_t queue_tail;
+
+	// Current state of the headless keyboard and mouse, from the script and the queue.
+	bool held_keys[KEY_COUNT];
+	int mouse_state[3];
+};
+
+static void reset_script_state(kvm_input* input) {
+	input->script_next_event = 0;
+	for (size_t i = 0; i < KEY_COUNT; i++) {
+		input->held_keys[i] = false;
+	}
+	for (int i = 0; i < 3; i++) {
+		input->mouse_state[i] = 0;
+	}
+}
+
+static void apply_event(kvm_input* input, const script_event* event) {
+	if (event->device == script_key) {
+		input->held_keys[event->values[0]] = event->values[1] != 0;
+	}
+	else {
+		for (int i = 0; i < 3; i++) {
+			input->mouse_state[i] = event->values[i];
+		}
+	}
+}
+
+kvm_input* kvm_input_init(void) {
+	kvm_input* input = malloc(sizeof(kvm_input));
+	input->headless = false;
+	input->script_events = NULL;
+	input->script_event_count = 0;
+	SDL_AtomicSet(&input->queue_head, 0);
+	SDL_AtomicSet(&input->queue_tail, 0);
+	reset_script_state(input);
+
+	return input;
+}
+
+void kvm_input_free(kvm_input* input) {
+	if (!input) return;
+
+	if (input->script_events) free(input->script_events);
+	free(input);
+}
+
+void kvm_input_set_headless(kvm_input* input, bool headless) {
+	input->headless = headless;
+	reset_script_state(input);
+
+	// A new run starts with nothing left over in the queue from the last one. Only the producer moves the tail,
+	// so catch the head up to it instead.
+	SDL_AtomicSet(&input->queue_head, SDL_AtomicGet(&input->queue_tail));
+}
+
+int kvm_input_load_script(kvm_input* input, const char* filename) {
+	if (input->script_events) free(input->script_events);
+	input->script_events = NULL;
+	input->script_event_count = 0;
+	reset_script_state(input);
+
+	if (!filename) return 0;
+
+	FILE* script_file = fopen(filename, "r");
+	if (!script_file) {
+		printf("Error opening input script %s.\n", filename);
+		return -1;
+	}
+
+	size_t capacity = 64;
+	input->script_events = malloc(capacity * sizeof(script_event));
+
+	char line[128];
+	int line_number = 0;
+	while (fgets(line, sizeof(line), script_file)) {
+		line_number++;
+
+		char* comment = strchr(line, '#');
+		if (comment) *comment = '\0';
+
+		unsigned int frame;
+		char device[16];
+		script_event event = { 0 };
+		int fields = sscanf(line, "%u %15s %d %d %d", &frame, device, &event.values[0], &event.values[1], &event.values[2]);
+		if (fields <= 0) continue; // Blank line
+
+		event.frame = frame;
+		if (fields == 4 && strcmp(device, "key") == 0 && event.values[0] >= 0 && event.values[0] < (int)KEY_COUNT) {
+			event.device = script_key;
+		}
+		else if (fields == 5 && strcmp(device, "mouse") == 0) {
+			event.device = script_mouse;
+		}
+		else {
+			printf("Error in input script %s, line %d: %s\n", filename, line_number, line);
+			continue;
+		}
+
+		if (input->script_event_count == capacity) {
+			capacity *= 2;
+			script_event* bigger = malloc(capacity * sizeof(script_event));
+			memcpy(bigger, input->script_events, input->script_event_count * sizeof(script_event));
+			free(input->script_events);
+			input->script_events = bigger;
+		}
+		input->script_events[input->script_event_count++] = event;
+	}
+
+	fclose(script_file);
+	return 0;
+}
+
+void kvm_input_set_frame(kvm_input* input, uint32_t frame) {
+	while (input->script_next_event < input->script_event_count && input->script_events[input->script_next_event].frame <= frame) {
+		apply_event(input, &input->script_events[input->script_next_event++]);
+	}
+}
+
+#pragma endregion
+
+#pragma region Input Queue
+
+int kvm_input_key_index(SDL_Scancode scancode) {
+	for (size_t i = 0; i < KEY_COUNT; i++) {
+		if (keys[i] == scancode) return (int)i;
+	}
+	return -1;
+}
+
+static bool queue_push(kvm_input* input, const script_event* event) {
+	int tail = SDL_AtomicGet(&input->queue_tail);
+	if (tail - SDL_AtomicGet(&input->queue_head) >= INPUT_QUEUE_SIZE) return false; // Full
+
+	input->queue_events[tail & (INPUT_QUEUE_SIZE - 1)] = *event;
+
+	// The event has to be written before the consumer can see the new tail.
+	SDL_MemoryBarrierRelease();
+	SDL_AtomicSet(&input->queue_tail, tail + 1);
+	return true;
+}
+
+bool kvm_input_push_key(kvm_input* input, int key_index, bool pressed) {
+	if (!input || key_index < 0 || key_index >= (int)KEY_COUNT) return false;
+
+	script_event event = { 0, script_key, { key_index, pressed ? 1 : 0, 0 } };
+	return queue_push(input, &event);
+}
+
+bool kvm_input_push_mouse(kvm_input* input, int x, int y, int buttons) {
+	if (!input) return false;
+
+	script_event event = { 0, script_mouse, { x, y, buttons } };
+	return queue_push(input, &event);
+}
+
+// Apply everything queued so far. Only called from the VM's thread.
+static void drain_queue(kvm_input* input) {
+	int head = SDL_AtomicGet(&input->queue_head);
+	int tail = SDL_AtomicGet(&input->queue_tail);
+	SDL_MemoryBarrierAcquire();
+
+	for (; head != tail; head++) {
+		apply_event(input, &input->queue_events[head & (INPUT_QUEUE_SIZE - 1)]);
+	}
+
+	SDL_AtomicSet(&input->queue_head, head);
+}
+
+#pragma endregion
+
+void kvm_input_get_keyboard(kvm_input* input, kvm_memory* mem) {
+	if (!input || !mem) return;
 	
-	SDL_PumpEvents();
-	const uint8_t* keystates = SDL_GetKeyboardState(NULL);
+	const uint8_t* keystates = NULL;
+	if (input->headless) {
+		drain_queue(input);
+	}
+	else {
+		SDL_PumpEvents();
+		keystates = SDL_GetKeyboardState(NULL);
+	}
 
-	size_t numkeys = sizeof(keys) / sizeof(SDL_KeyCode);
+	size_t numkeys = KEY_COUNT;
 	
 	// Create a pointer to the proper location of IO memory for the keyboard
 	uint8_t* keys_in_mem = mem->data + IO_MEM_KEYBOARD_LOC;
@@ -51,7 +254,8 @@ void kvm_input_get_keyboard(kvm_memory* mem) {
 	}
 
 	for (size_t i = 0; i < numkeys; i++) {
-		if (keystates[keys[i]]) {
+		bool pressed = input->headless ? input->held_keys[i] : keystates[keys[i]];
+		if (pressed) {
 			// Key is now pressed
 
 			if (keys_in_mem[i] <= 1) {
@@ -75,22 +279,38 @@ void kvm_input_get_keyboard(kvm_memory* mem) {
 			}
 		}
 	}
+
+	kvm_memory_notify_write(mem, IO_MEM_KEYBOARD_LOC, numkeys);
 }
 
-void kvm_input_get_mouse(kvm_memory* mem) {
-	if (!mem) return;
+void kvm_input_get_mouse(kvm_input* input, kvm_memory* mem) {
+	if (!input || !mem) return;
 
 	uint8_t* mouse_mem_loc = mem->data + IO_MEM_MOUSE_LOC;
 
 	int x, y;
-	uint32_t mouseState = SDL_GetMouseState(&x, &y);
-	
-	float scale = (float)WINDOW_SIZE / OUTER_WINDOW_SIZE;
+	uint32_t mouseState;
+
+	if (input->headless) {
+		drain_queue(input);
 
-	x *= scale;
-	y *= scale;
+		// Scripted and queued positions are already in screen pixels.
+		x = input->mouse_state[0];
+		y = input->mouse_state[1];
+		mouseState = (uint32_t)input->mouse_state[2];
+	}
+	else {
+		mouseState = SDL_GetMouseState(&x, &y);
+
+		float scale = (float)WINDOW_SIZE / OUTER_WINDOW_SIZE;
+
+		x *= scale;
+		y *= scale;
+	}
 
 	mouse_mem_loc[0] = (uint8_t)x & 0xff;
 	mouse_mem_loc[1] = (uint8_t)y & 0xff;
 	mouse_mem_loc[2] = (uint8_t)mouseState & 0xff;
+
+	kvm_memory_notify_write(mem, IO_MEM_MOUSE_LOC, 3);
 }
\ No newline at end of file
@@ -4,6 +4,10 @@
 
 #pragma once
 
+#include <SDL.h>
+#include <stdbool.h>
+#include <stdint.h>
+
 #include "kvm_memory.h"
 
 typedef enum kvm_input_keystate {
@@ -16,5 +20,34 @@ typedef enum kvm_input_keystate {
 	keyidle, keyup, keydown, keypressed
 }kvm_input_keystate;
 
-void kvm_input_get_keyboard(kvm_memory* mem);
-void kvm_input_get_mouse(kvm_memory* mem);
+typedef struct kvm_input kvm_input;
+
+kvm_input* kvm_input_init(void);
+void kvm_input_free(kvm_input* input);
+
+void kvm_input_get_keyboard(kvm_input* input, kvm_memory* mem);
+void kvm_input_get_mouse(kvm_input* input, kvm_memory* mem);
+
+/* Headless input. Instead of asking SDL, the keyboard and mouse come from an input script (or stay idle without one).
+*  A script is a text file with one event per line, in frame order ('#' starts a comment):
+*      <frame> key <key index> <1 for pressed, 0 for released>
+*      <frame> mouse <x> <y> <buttons>
+*  Key indices are the offsets into keyboard memory (e.g. 52 for escape). An event takes effect once the frame count reaches its frame.
+*/
+void kvm_input_set_headless(kvm_input* input, bool headless);
+
+// Load an input script, replacing the current one. Pass NULL to clear it. Returns 0 on success.
+int kvm_input_load_script(kvm_input* input, const char* filename);
+
+// Tell the script which frame it's on. Called after every GPU refresh.
+void kvm_input_set_frame(kvm_input* input, uint32_t frame);
+
+/* Headless input can also be fed live, from one other thread, while the VM runs (e.g. the IDE, see kvm_thread.h).
+*  Events go through a lock-free single producer, single consumer queue, and are applied the next time the program reads the keyboard or mouse.
+*  Returns false if the event couldn't be queued (bad key index, or the queue is full because the program isn't reading input).
+*/
+bool kvm_input_push_key(kvm_input* input, int key_index, bool pressed);
+bool kvm_input_push_mouse(kvm_input* input, int x, int y, int buttons);
+
+// The key index (offset into keyboard memory) for a scancode, or -1 if the VM doesn't have that key.
+int kvm_input_key_index(SDL_Scancode scancode);
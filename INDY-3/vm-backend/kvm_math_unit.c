@@ -0,0 +1,62 @@
+/*	Memory mapped math unit for the KSU Micro VM.
+*	Guest code has no multiply or divide, so this gives it 16 bit arithmetic for the cost of a few stores and loads.
+*	It's a write hook on its page: every write recalculates all of the results straight into memory,
+*	which means reads are plain memory reads and work the same on every CPU core.
+*	Author: Matthew Watson
+*/
+
+#include "kvm_math_unit.h"
+#include "kvm_mem_map_constants.h"
+
+static uint16_t read16(const uint8_t* data, size_t address) {
+	return data[address] | ((uint16_t)data[address + 1] << 8);
+}
+
+static void write16(uint8_t* data, size_t address, uint16_t value) {
+	data[address] = (uint8_t)(value & 0xFF);
+	data[address + 1] = (uint8_t)(value >> 8);
+}
+
+static uint8_t compare_result(int a, int b) {
+	if (a == b) return 0x00;
+	return (a > b) ? 0x01 : 0xFF;
+}
+
+static void update_results(kvm_memory* mem) {
+	uint8_t* data = mem->data;
+	uint16_t a = read16(data, IO_MEM_MATH_OPERAND_A);
+	uint16_t b = read16(data, IO_MEM_MATH_OPERAND_B);
+
+	uint32_t product = (uint32_t)a * b;
+	write16(data, IO_MEM_MATH_PRODUCT, (uint16_t)(product & 0xFFFF));
+	write16(data, IO_MEM_MATH_PRODUCT + 2, (uint16_t)(product >> 16));
+
+	write16(data, IO_MEM_MATH_QUOTIENT, b ? a / b : 0xFFFF);
+	write16(data, IO_MEM_MATH_REMAINDER, b ? a % b : a);
+
+	uint32_t sum = (uint32_t)a + b;
+	write16(data, IO_MEM_MATH_SUM, (uint16_t)sum);
+	write16(data, IO_MEM_MATH_DIFFERENCE, (uint16_t)(a - b));
+	data[IO_MEM_MATH_CARRY] = (uint8_t)((sum > 0xFFFF ? 0x01 : 0) | (a < b ? 0x02 : 0));
+
+	data[IO_MEM_MATH_COMPARE] = compare_result(a, b);
+	data[IO_MEM_MATH_COMPARE_SIGNED] = compare_result((int16_t)a, (int16_t)b);
+}
+
+static void on_math_write(void* userdata, size_t address, size_t length) {
+	// The hook is told about every write to a watched page, so only recalculate if ours was hit.
+	if (address + length <= IO_MEM_MATH_LOC || address >= IO_MEM_MATH_LOC + 0x100) return;
+	update_results((kvm_memory*)userdata);
+}
+
+int kvm_math_unit_attach(kvm_memory* mem) {
+	if (!mem || mem->size < IO_MEM_MATH_LOC + 0x100) return -1;
+
+	int hook_id = kvm_memory_add_write_hook(mem, on_math_write, mem);
+	if (hook_id < 0) return -1;
+
+	kvm_memory_watch_pages(mem, hook_id, IO_MEM_MATH_LOC >> 8, 1, true);
+	update_results(mem);
+
+	return hook_id;
+}
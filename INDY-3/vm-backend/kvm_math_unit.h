@@ -0,0 +1,11 @@
+/*	Header for the memory mapped math unit (see IO_MEM_MATH_LOC in kvm_mem_map_constants.h).
+*	Author: Matthew Watson
+*/
+
+#pragma once
+
+#include "kvm_memory.h"
+
+// Map the math unit into memory. kvm_memory_init() does this for every memory big enough to hold it.
+// Returns the write hook id it uses, or -1 if it couldn't be attached.
+int kvm_math_unit_attach(kvm_memory* mem);
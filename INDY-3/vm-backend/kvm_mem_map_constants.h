@@ -36,4 +36,20 @@
 #define VRAM_SPRITE_X_TABLE 0x8C00
 #define VRAM_SPRITE_Y_TABLE 0x8D00
 #define VRAM_SPRITE_TILE_TABLE 0x8E00
-#define VRAM_SPRITE_ATTRIBUTE_TABLE 0x8F00
\ No newline at end of file
+#define VRAM_SPRITE_ATTRIBUTE_TABLE 0x8F00
+
+/* Math unit, one page of memory mapped I/O next to the input pages.
+*  Write 16 bit operands (little endian) to A and B, and every result below is ready to read on the next instruction.
+*  Any write to the page recalculates the results, so the result bytes are effectively read-only.
+*/
+#define IO_MEM_MATH_LOC 0x7E00
+#define IO_MEM_MATH_OPERAND_A 0x7E00		// 2 bytes
+#define IO_MEM_MATH_OPERAND_B 0x7E02		// 2 bytes
+#define IO_MEM_MATH_PRODUCT 0x7E04			// 4 bytes, A * B
+#define IO_MEM_MATH_QUOTIENT 0x7E08			// 2 bytes, A / B. FFFF when B is 0.
+#define IO_MEM_MATH_REMAINDER 0x7E0A		// 2 bytes, A % B. A when B is 0.
+#define IO_MEM_MATH_SUM 0x7E0C				// 2 bytes, A + B
+#define IO_MEM_MATH_DIFFERENCE 0x7E0E		// 2 bytes, A - B
+#define IO_MEM_MATH_CARRY 0x7E10			// Bit 0: A + B carried out of 16 bits. Bit 1: A - B borrowed.
+#define IO_MEM_MATH_COMPARE 0x7E11			// 0 if A == B, 1 if A > B, FF if A < B (unsigned). Loading it sets Z and N to match.
+#define IO_MEM_MATH_COMPARE_SIGNED 0x7E12	// Same as above, treating A and B as signed.
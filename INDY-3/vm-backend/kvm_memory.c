@@ -7,6 +7,7 @@
 #include "leakcheck_util.h"
 
 #include "kvm_memory.h"
+#include "kvm_math_unit.h"
 
 kvm_memory* kvm_memory_init(size_t size, uint8_t init_data) {
 	kvm_memory* mem = malloc(sizeof(kvm_memory));
@@ -19,6 +20,19 @@ kvm_memory* kvm_memory_init(size_t size, uint8_t init_data) {
 		dat[i] = init_data;
 	}
 
+	for (int i = 0; i < KVM_MEMORY_PAGE_COUNT; i++) {
+		mem->page_flags[i] = 0;
+	}
+
+	for (int i = 0; i < KVM_MEMORY_MAX_WRITE_HOOKS; i++) {
+		mem->write_hooks[i].callback = NULL;
+		mem->write_hooks[i].userdata = NULL;
+	}
+
+	mem->syscall_pending = (size > KVM_MEMORY_SYSCALL_ADDRESS && init_data != 0);
+
+	kvm_math_unit_attach(mem);
+
 	return mem;
 }
 
@@ -43,6 +57,66 @@ uint8_t kvm_memory_get_byte(kvm_memory* mem, size_t index) {
 	}
 }
 
+int kvm_memory_add_write_hook(kvm_memory* mem, kvm_memory_write_hook callback, void* userdata) {
+	if (!mem || !callback) return -1;
+
+	for (int i = 0; i < KVM_MEMORY_MAX_WRITE_HOOKS; i++) {
+		if (!mem->write_hooks[i].callback) {
+			mem->write_hooks[i].callback = callback;
+			mem->write_hooks[i].userdata = userdata;
+			return i;
+		}
+	}
+
+	fprintf(stderr, "Error with kvm_memory.c, kvm_memory_add_write_hook(): All %d write hooks are in use.\n", KVM_MEMORY_MAX_WRITE_HOOKS);
+	return -1;
+}
+
+void kvm_memory_remove_write_hook(kvm_memory* mem, int hook_id) {
+	if (!mem || hook_id < 0 || hook_id >= KVM_MEMORY_MAX_WRITE_HOOKS) return;
+
+	kvm_memory_watch_pages(mem, hook_id, 0, KVM_MEMORY_PAGE_COUNT, false);
+	mem->write_hooks[hook_id].callback = NULL;
+	mem->write_hooks[hook_id].userdata = NULL;
+}
+
+void kvm_memory_watch_pages(kvm_memory* mem, int hook_id, int first_page, int page_count, bool watch) {
+	if (!mem || hook_id < 0 || hook_id >= KVM_MEMORY_MAX_WRITE_HOOKS) return;
+
+	uint8_t bit = (uint8_t)(1 << hook_id);
+	for (int page = first_page; page < first_page + page_count && page < KVM_MEMORY_PAGE_COUNT; page++) {
+		if (watch) {
+			mem->page_flags[page] |= bit;
+		}
+		else {
+			mem->page_flags[page] &= (0xFF ^ bit);
+		}
+	}
+}
+
+void kvm_memory_notify_write(kvm_memory* mem, size_t address, size_t length) {
+	if (!mem || length == 0 || address >= mem->size) return;
+
+	if (address <= KVM_MEMORY_SYSCALL_ADDRESS && address + length > KVM_MEMORY_SYSCALL_ADDRESS && mem->data[KVM_MEMORY_SYSCALL_ADDRESS]) {
+		mem->syscall_pending = true;
+	}
+
+	size_t last_page = (address + length - 1) >> 8;
+	if (last_page >= KVM_MEMORY_PAGE_COUNT) last_page = KVM_MEMORY_PAGE_COUNT - 1;
+
+	// Gather up every hook that watches a page in the range, and tell each one once.
+	uint8_t flags = 0;
+	for (size_t page = address >> 8; page <= last_page; page++) {
+		flags |= mem->page_flags[page];
+	}
+
+	for (int i = 0; flags && i < KVM_MEMORY_MAX_WRITE_HOOKS; i++) {
+		if ((flags & (1 << i)) && mem->write_hooks[i].callback) {
+			mem->write_hooks[i].callback(mem->write_hooks[i].userdata, address, length);
+		}
+	}
+}
+
 void kvm_memory_print_hexdump(kvm_memory* mem, uint16_t start_point, uint16_t length) {
 	int print_width = 16;
 	
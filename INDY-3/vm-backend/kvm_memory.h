@@ -5,10 +5,33 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define KVM_MEMORY_PAGE_COUNT 256
+#define KVM_MEMORY_MAX_WRITE_HOOKS 8
+
+// Writing a non-zero value here asks the host to perform a system call.
+#define KVM_MEMORY_SYSCALL_ADDRESS 0
+
+// Called after memory in a watched page has been written. length is the number of bytes written starting at address.
+typedef void (*kvm_memory_write_hook)(void* userdata, size_t address, size_t length);
+
+typedef struct kvm_memory_hook {
+	kvm_memory_write_hook callback;
+	void* userdata;
+} kvm_memory_hook;
 
 typedef struct kvm_memory {
 	size_t size;
 	uint8_t* data;
+
+	// Each write hook owns one bit of the page flags. Writes to a page with that bit set get reported to the hook.
+	uint8_t page_flags[KVM_MEMORY_PAGE_COUNT];
+	kvm_memory_hook write_hooks[KVM_MEMORY_MAX_WRITE_HOOKS];
+
+	// Raised when a non-zero value is stored to the syscall address, so nobody has to keep checking it. The host clears it after handling the call.
+	bool syscall_pending;
 } kvm_memory;
 
 kvm_memory* kvm_memory_init(size_t size, uint8_t init_data);
@@ -16,4 +39,26 @@ void kvm_memory_free(kvm_memory* mem);
 
 uint8_t kvm_memory_get_byte(kvm_memory* mem, size_t index);
 
+// Register a write hook. Returns its id (used with kvm_memory_watch_pages), or -1 if all hook slots are taken.
+int kvm_memory_add_write_hook(kvm_memory* mem, kvm_memory_write_hook callback, void* userdata);
+void kvm_memory_remove_write_hook(kvm_memory* mem, int hook_id);
+
+// Turn watching on or off for a range of pages (page = address >> 8).
+void kvm_memory_watch_pages(kvm_memory* mem, int hook_id, int first_page, int page_count, bool watch);
+
+// Report a write to the hooks watching any page in the range, and raise syscall_pending if the syscall address was set.
+// CPU stores do this through kvm_memory_write_byte(); anything on the host side that writes guest memory directly should call it too.
+void kvm_memory_notify_write(kvm_memory* mem, size_t address, size_t length);
+
+// Store a byte, raising syscall_pending and reporting it to any write hooks if needed. All CPU stores go through here.
+static inline void kvm_memory_write_byte(kvm_memory* mem, uint16_t address, uint8_t value) {
+	mem->data[address] = value;
+	if (address == KVM_MEMORY_SYSCALL_ADDRESS && value) {
+		mem->syscall_pending = true;
+	}
+	if (mem->page_flags[address >> 8]) {
+		kvm_memory_notify_write(mem, address, 1);
+	}
+}
+
 void kvm_memory_print_hexdump(kvm_memory* mem, uint16_t start_point, uint16_t length);
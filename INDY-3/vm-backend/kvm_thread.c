@@ -0,0 +1,151 @@
+/*	Runs the virtual machine on its own thread
+*	Author: Matthew Watson
+*/
+
+#include <SDL.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kvm_thread.h"
+#include "leakcheck_util.h"
+
+// Cycles to run between checks for a stop request.
+#define RUN_SLICE 100000
+
+// The shared frame index has this bit set when it holds a frame the reader hasn't taken yet.
+#define FRAME_FRESH 4
+#define FRAME_INDEX_MASK 3
+
+struct kvm_thread {
+	kvm_context* kvm;
+	char* source;
+	size_t source_length;
+	int max_cycles;
+
+	SDL_Thread* thread;
+	SDL_atomic_t stop_requested;
+	SDL_atomic_t running;
+
+	// Triple buffer. The VM draws into frames[back_frame] and the reader looks at frames[front_frame],
+	// and whichever one is left over sits in shared_frame until one side swaps theirs for it.
+	uint32_t* frames[3];
+	int back_frame;		// Only touched by the VM thread.
+	int front_frame;	// Only touched by the reader.
+	SDL_atomic_t shared_frame;
+};
+
+// Copy the frame the VM just drew into the back buffer, and swap it into the middle for the reader.
+static void publish_frame(kvm_thread* thread) {
+	SDL_Surface* surface = kvm_get_display_surface(thread->kvm);
+	if (!surface) return;
+
+	uint32_t* frame = thread->frames[thread->back_frame];
+	for (int y = 0; y < KVM_FRAME_HEIGHT; y++) {
+		memcpy(frame + y * KVM_FRAME_WIDTH, (const uint8_t*)surface->pixels + y * surface->pitch, KVM_FRAME_WIDTH * sizeof(uint32_t));
+	}
+
+	// The pixels have to land before the reader can get at the buffer.
+	SDL_MemoryBarrierRelease();
+	thread->back_frame = SDL_AtomicSet(&thread->shared_frame, thread->back_frame | FRAME_FRESH) & FRAME_INDEX_MASK;
+}
+
+static int thread_main(void* data) {
+	kvm_thread* thread = (kvm_thread*)data;
+	kvm_context* kvm = thread->kvm;
+
+	if (kvm_init(kvm) != 0) {
+		printf("KVM initialization failed.\n");
+	}
+	else if (kvm_load_source(kvm, thread->source, thread->source_length) != 0) {
+		printf("Error loading instructions into KVM.\n");
+	}
+	else {
+		kvm_set_cycle_limit(kvm, thread->max_cycles);
+
+		while (!SDL_AtomicGet(&thread->stop_requested)) {
+			kvm_run_status status = kvm_run(kvm, RUN_SLICE, true);
+			if (status == kvm_run_frame) {
+				publish_frame(thread);
+			}
+			else if (status != kvm_run_budget) {
+				break;
+			}
+		}
+	}
+
+	kvm_quit(kvm);
+	SDL_AtomicSet(&thread->running, 0);
+
+	return 0;
+}
+
+kvm_thread* kvm_thread_start(kvm_context* kvm, const char* source, size_t length, int max_cycles) {
+	if (!kvm || !source) return NULL;
+
+	kvm_thread* thread = malloc(sizeof(kvm_thread));
+	memset(thread, 0, sizeof(kvm_thread));
+
+	thread->kvm = kvm;
+	thread->max_cycles = max_cycles;
+
+	thread->source = malloc(length + 1);
+	memcpy(thread->source, source, length);
+	thread->source_length = length;
+
+	for (int i = 0; i < 3; i++) {
+		thread->frames[i] = malloc(KVM_FRAME_WIDTH * KVM_FRAME_HEIGHT * sizeof(uint32_t));
+		memset(thread->frames[i], 0, KVM_FRAME_WIDTH * KVM_FRAME_HEIGHT * sizeof(uint32_t));
+	}
+	thread->back_frame = 0;
+	thread->front_frame = 1;
+	SDL_AtomicSet(&thread->shared_frame, 2);
+
+	// Frames go through the triple buffer instead of a window, but delays should still take real time.
+	kvm_set_headless(kvm, true);
+	kvm_set_skip_delays(kvm, false);
+
+	SDL_AtomicSet(&thread->stop_requested, 0);
+	SDL_AtomicSet(&thread->running, 1);
+	thread->thread = SDL_CreateThread(thread_main, "kvm_thread", thread);
+	if (!thread->thread) {
+		printf("Error creating VM thread: %s\n", SDL_GetError());
+		SDL_AtomicSet(&thread->running, 0);
+		kvm_thread_stop(thread);
+		return NULL;
+	}
+
+	return thread;
+}
+
+void kvm_thread_stop(kvm_thread* thread) {
+	if (!thread) return;
+
+	SDL_AtomicSet(&thread->stop_requested, 1);
+	// The stop request is only seen between slices, so don't let a delay syscall hold the thread up until then.
+	kvm_interrupt_delays(thread->kvm);
+	if (thread->thread) SDL_WaitThread(thread->thread, NULL);
+
+	for (int i = 0; i < 3; i++) {
+		free(thread->frames[i]);
+	}
+	free(thread->source);
+	free(thread);
+}
+
+bool kvm_thread_is_running(kvm_thread* thread) {
+	return thread && SDL_AtomicGet(&thread->running) != 0;
+}
+
+bool kvm_thread_get_frame(kvm_thread* thread, const uint32_t** pixels) {
+	if (!thread || !pixels) return false;
+
+	if (!(SDL_AtomicGet(&thread->shared_frame) & FRAME_FRESH)) return false;
+
+	// Trade the frame we were showing for the fresh one. The VM may publish again in between, that's fine, it's still fresh.
+	thread->front_frame = SDL_AtomicSet(&thread->shared_frame, thread->front_frame) & FRAME_INDEX_MASK;
+	SDL_MemoryBarrierAcquire();
+
+	*pixels = thread->frames[thread->front_frame];
+	return true;
+}
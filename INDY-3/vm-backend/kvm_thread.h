@@ -0,0 +1,34 @@
+/*	Header for running the virtual machine on its own thread
+*	Author: Matthew Watson
+*/
+
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "kvm.h"
+
+/*
+The VM runs headless on a thread of its own, so whoever started it (the IDE) never waits on the program, and the program never waits on the IDE.
+Finished frames come back through a triple buffer, and input goes in through kvm_queue_key() and kvm_queue_mouse(). Neither side ever takes a lock.
+*/
+
+#define KVM_FRAME_WIDTH 256
+#define KVM_FRAME_HEIGHT 256
+
+typedef struct kvm_thread kvm_thread;
+
+// Make kvm a headless VM that still runs in real time, then assemble source, load it, and run it on a new thread. max_cycles works like it does for kvm_start().
+// The source is copied, so it can be freed right away. kvm belongs to the thread until kvm_thread_stop(), except for kvm_queue_key() and kvm_queue_mouse().
+// Returns NULL if the thread couldn't be started.
+kvm_thread* kvm_thread_start(kvm_context* kvm, const char* source, size_t length, int max_cycles);
+
+// Stop the program if it's still going, wait for the thread to finish, and free it. The VM is shut down with kvm_quit(), so it can be used again.
+void kvm_thread_stop(kvm_thread* thread);
+
+// False once the program has quit, hit its cycle limit, or failed to load.
+bool kvm_thread_is_running(kvm_thread* thread);
+
+// Get the newest finished frame, KVM_FRAME_WIDTH x KVM_FRAME_HEIGHT ARGB8888 pixels. Returns false if no frame has finished since the last call.
+// The pixels stay put until the next call. Only one thread can be reading frames.
+bool kvm_thread_get_frame(kvm_thread* thread, const uint32_t** pixels);
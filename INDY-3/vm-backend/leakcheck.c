@@ -4,12 +4,27 @@
 #include "leakcheck.h"
 #include "linklist.h"
 
+// Every function here takes the record lock, so allocations can be tracked from more than one thread.
+// Both locks can be statically initialized, so there's nothing to set up first.
+#ifdef _WIN32
+#include <windows.h>
+static SRWLOCK record_lock = SRWLOCK_INIT;
+#define lock_record() AcquireSRWLockExclusive(&record_lock)
+#define unlock_record() ReleaseSRWLockExclusive(&record_lock)
+#else
+#include <pthread.h>
+static pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;
+#define lock_record() pthread_mutex_lock(&record_lock)
+#define unlock_record() pthread_mutex_unlock(&record_lock)
+#endif
+
 static size_t current_allocated_bytes = 0; 
 static link_list *allocation_record = NULL;
 
 static allocation *create_data(void* address, size_t size);
 
 void* leakcheck_malloc(size_t size){
+    lock_record();
 
     // Initialize allocation record if not done already.
     if (!allocation_record){
@@ -29,10 +44,12 @@ void* leakcheck_malloc(size_t size){
     link_list_add_at(allocation_record, create_data(ptr, size), -1);
 
     //printf("Allocating %d bytes.\n", size);
+    unlock_record();
     return ptr;
 }
 
 void* leakcheck_realloc(void* ptr, size_t new_size) {
+    lock_record();
 
     // Find the current allocation of ptr
     link_node* current = allocation_record->head->next;
@@ -69,11 +86,21 @@ void* leakcheck_realloc(void* ptr, size_t new_size) {
     // Append the new allocation to the end of the records list.
     link_list_add_at(allocation_record, create_data(new_ptr, new_size), -1);
 
+    unlock_record();
     return new_ptr;
 }
 
 void leakcheck_free(void *ptr){
-    
+    // Same as free(), freeing NULL does nothing.
+    if (!ptr) return;
+
+    lock_record();
+    if (!allocation_record) {
+        unlock_record();
+        fprintf(stderr, "Error with leakcheck_free- No matching address found.\n");
+        return;
+    }
+
     // head->next because head is the blank one.
     link_node *current = allocation_record->head->next;
     int i = 1;
@@ -83,12 +110,14 @@ void leakcheck_free(void *ptr){
         if(!current_allocation){
             // This should never happen.
             fprintf(stderr, "Error with leakcheck_free- allocation struct %d is null.\n", i);
+            unlock_record();
             return;
         }
 
         if (ptr == current_allocation->ptr){
             current_allocated_bytes -= current_allocation->size;
             link_list_remove_at(allocation_record, i);
+            unlock_record();
             free(ptr);
             return;
         }
@@ -97,6 +126,7 @@ void leakcheck_free(void *ptr){
         current = current->next;
     }
 
+    unlock_record();
     fprintf(stderr, "Error with leakcheck_free- No matching address found.\n");
 }
 
@@ -111,7 +141,10 @@ int main(int argc, char *argv[]){
 
 
 size_t get_allocated_memory(void){
-    return current_allocated_bytes;
+    lock_record();
+    size_t bytes = current_allocated_bytes;
+    unlock_record();
+    return bytes;
 }
 
 // LINK LIST INTERACTION
@@ -132,8 +165,10 @@ static allocation *create_data(void* address, size_t size){
 }
 
 void print_allocation_data(){
+    lock_record();
 
     if(!allocation_record){
+        unlock_record();
         printf("Allocation record has not been initialized.\n");
         return;
     }
@@ -152,9 +187,14 @@ void print_allocation_data(){
         current = current->next;
         i++;
     }
+
+    unlock_record();
 }
 
 // Delete the linked list of allocations.
 void clean_allocation(void){
+    lock_record();
     if(allocation_record) link_list_delete(allocation_record);
+    allocation_record = NULL;
+    unlock_record();
 }
\ No newline at end of file
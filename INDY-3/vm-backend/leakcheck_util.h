@@ -2,9 +2,12 @@
 
 #include "leakcheck.h"
 
+// Define LEAKCHECK_DISABLE to use the plain allocator, e.g. for timing runs where every allocation taking the same lock would get in the way.
+#ifndef LEAKCHECK_DISABLE
 #define malloc(x) leakcheck_malloc(x)
 #define realloc(x, y) leakcheck_realloc(x, y)
 #define free(x) leakcheck_free(x)
+#endif
 
 /*
 #ifndef main
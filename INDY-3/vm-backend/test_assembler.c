@@ -0,0 +1,353 @@
+/*	Test file for the built in assembler
+*	Checks kvm_assemble() against binaries made by assembler.py, which it has to match byte for byte.
+*	kvm_assemble_cached() has to match too, both the first time and when everything comes from the cache,
+*	and for edited versions of each program assembled through the same cache.
+*	Author: Matthew Watson
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "leakcheck_util.h"
+#include "kvm_assembler.h"
+#include "kvm_mem_map_constants.h"
+
+// Returns the first byte that's different, or expected_size if they match.
+static size_t find_mismatch(const kvm_assembly* assembly, const char* expected, size_t expected_size) {
+	if (assembly->size != expected_size) return 0;
+
+	size_t mismatch = 0;
+	while (mismatch < expected_size && assembly->bytes[mismatch] == (uint8_t)expected[mismatch]) mismatch++;
+	return mismatch;
+}
+
+static char* read_file(const char* filename, size_t* out_size) {
+	FILE* file = fopen(filename, "rb");
+	if (!file) {
+		printf("Error opening %s.\n", filename);
+		return NULL;
+	}
+
+	fseek(file, 0L, SEEK_END);
+	size_t size = ftell(file);
+	rewind(file);
+
+	char* data = malloc(size + 1);
+	*out_size = fread(data, 1, size, file);
+	fclose(file);
+
+	return data;
+}
+
+#pragma region Edited Sources
+
+/*	Edits like the ones made in the editor between runs, to check that kvm_assemble_cached() keeps matching kvm_assemble()
+*	when lines change, get inserted or deleted, labels move, and variables get new values.
+*	Each edit builds on the last one, and they all go through the same cache as the unedited program.
+*/
+
+#define EDIT_COUNT 60
+
+typedef struct source_lines {
+	char** lines;
+	int count;
+	int capacity;
+} source_lines;
+
+typedef enum line_kind { line_blank, line_instruction, line_label, line_variable } line_kind;
+
+typedef enum edit_kind { edit_change, edit_insert, edit_delete, edit_move_label, edit_variable, edit_kind_count } edit_kind;
+
+static const char* const edit_names[] = { "changed line", "inserted line", "deleted line", "moved label", "changed variable" };
+
+// Lines that get put in place of, or in between, the program's own.
+static const char* const edit_instructions[] = { "    NOP", "    LDA #7", "    STA $0400 x", "    INC $20", "    LDX $1234" };
+
+static unsigned edit_random(unsigned* state) {
+	// xorshift32
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return *state;
+}
+
+static char* copy_line(const char* text, size_t length) {
+	char* line = malloc(length + 1);
+	memcpy(line, text, length);
+	line[length] = '\0';
+	return line;
+}
+
+static void lines_insert(source_lines* source, int index, char* line) {
+	if (source->count == source->capacity) {
+		source->capacity = source->capacity ? source->capacity * 2 : 64;
+		char** lines = malloc(source->capacity * sizeof(char*));
+		if (source->lines) {
+			memcpy(lines, source->lines, source->count * sizeof(char*));
+			free(source->lines);
+		}
+		source->lines = lines;
+	}
+
+	memmove(&source->lines[index + 1], &source->lines[index], (source->count - index) * sizeof(char*));
+	source->lines[index] = line;
+	source->count++;
+}
+
+static void lines_remove(source_lines* source, int index) {
+	free(source->lines[index]);
+	memmove(&source->lines[index], &source->lines[index + 1], (source->count - index - 1) * sizeof(char*));
+	source->count--;
+}
+
+static void lines_replace(source_lines* source, int index, char* line) {
+	free(source->lines[index]);
+	source->lines[index] = line;
+}
+
+static void lines_free(source_lines* source) {
+	for (int i = 0; i < source->count; i++) free(source->lines[i]);
+	if (source->lines) free(source->lines);
+	source->lines = NULL;
+	source->count = 0;
+	source->capacity = 0;
+}
+
+static source_lines split_lines(const char* text, size_t size) {
+	source_lines source = { NULL, 0, 0 };
+
+	size_t start = 0;
+	for (size_t i = 0; i <= size; i++) {
+		if (i == size || text[i] == '\n') {
+			if (i == size && start == size) break;
+			lines_insert(&source, source.count, copy_line(text + start, i - start));
+			start = i + 1;
+		}
+	}
+
+	return source;
+}
+
+static char* join_lines(const source_lines* source, size_t* out_size) {
+	size_t size = 0;
+	for (int i = 0; i < source->count; i++) size += strlen(source->lines[i]) + 1;
+
+	char* text = malloc(size + 1);
+	size_t offset = 0;
+	for (int i = 0; i < source->count; i++) {
+		size_t length = strlen(source->lines[i]);
+		memcpy(text + offset, source->lines[i], length);
+		offset += length;
+		text[offset++] = '\n';
+	}
+	text[offset] = '\0';
+
+	*out_size = size;
+	return text;
+}
+
+static line_kind get_line_kind(const char* line) {
+	while (*line == ' ' || *line == '\t') line++;
+	if (*line == '\0' || *line == ';' || *line == '\r') return line_blank;
+	if (*line != '.') return line_instruction;
+
+	// A name on its own is a label, a name followed by a value is a variable.
+	while (*line && *line != ' ' && *line != '\t' && *line != ';' && *line != '\r') line++;
+	while (*line == ' ' || *line == '\t') line++;
+	return (*line == '\0' || *line == ';' || *line == '\r') ? line_label : line_variable;
+}
+
+// Find a line of the given kind, starting from a random one. Returns -1 if there aren't any.
+static int pick_line(const source_lines* source, line_kind kind, unsigned* random_state) {
+	if (source->count == 0) return -1;
+
+	int start = (int)(edit_random(random_state) % (unsigned)source->count);
+	for (int i = 0; i < source->count; i++) {
+		int index = (start + i) % source->count;
+		if (get_line_kind(source->lines[index]) == kind) return index;
+	}
+	return -1;
+}
+
+static char* random_instruction(unsigned* random_state) {
+	const char* text = edit_instructions[edit_random(random_state) % (sizeof(edit_instructions) / sizeof(edit_instructions[0]))];
+	return copy_line(text, strlen(text));
+}
+
+// Give a variable a new value. Zero page variables stay in the zero page, so instructions that use them stay legal.
+static char* change_variable(const char* line, unsigned* random_state) {
+	const char* name = strchr(line, '.');
+	size_t name_length = 0;
+	while (name[name_length] && name[name_length] != ' ' && name[name_length] != '\t') name_length++;
+
+	const char* value = name + name_length;
+	while (*value == ' ' || *value == '\t') value++;
+
+	uint64_t old_value = 0;
+	bool is_zero_page = sscanf(value, "$%llx", (unsigned long long*)&old_value) == 1 ? old_value <= 0xFF : true;
+
+	unsigned new_value = is_zero_page ? 0x20 + edit_random(random_state) % 0xC0 : 0x0400 + edit_random(random_state) % 0x7000;
+
+	char buffer[128];
+	snprintf(buffer, sizeof(buffer), "    %.*s $%X", (int)name_length, name, new_value);
+	return copy_line(buffer, strlen(buffer));
+}
+
+// Returns false if there was nothing to make that kind of edit to.
+static bool apply_edit(source_lines* source, edit_kind kind, unsigned* random_state) {
+	int index;
+	switch (kind) {
+	case edit_change:
+		index = pick_line(source, line_instruction, random_state);
+		if (index < 0) return false;
+		lines_replace(source, index, random_instruction(random_state));
+		return true;
+	case edit_insert:
+		index = (int)(edit_random(random_state) % (unsigned)(source->count + 1));
+		lines_insert(source, index, random_instruction(random_state));
+		return true;
+	case edit_delete:
+		index = pick_line(source, line_instruction, random_state);
+		if (index < 0) return false;
+		lines_remove(source, index);
+		return true;
+	case edit_move_label: {
+		// Swap it with the line before or after it, which moves it past an instruction most of the time.
+		index = pick_line(source, line_label, random_state);
+		if (index < 0) return false;
+		int other = (edit_random(random_state) & 1) ? index + 1 : index - 1;
+		if (other < 0 || other >= source->count) return false;
+		char* line = source->lines[index];
+		source->lines[index] = source->lines[other];
+		source->lines[other] = line;
+		return true;
+	}
+	case edit_variable:
+		index = pick_line(source, line_variable, random_state);
+		if (index < 0) return false;
+		lines_replace(source, index, change_variable(source->lines[index], random_state));
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Returns the number of failures.
+static int run_edit_tests(kvm_assembler_cache* cache, const char* filename, const char* text, size_t size, const char* expected, size_t expected_size) {
+	int failures = 0;
+	source_lines source = split_lines(text, size);
+
+	// Seeded from the name, so every run makes the same edits.
+	unsigned random_state = 2166136261u;
+	for (const char* c = filename; *c; c++) random_state = (random_state ^ (uint8_t)*c) * 16777619u;
+	if (!random_state) random_state = 1;
+
+	int edits_made = 0;
+	for (int edit = 0; edit < EDIT_COUNT; edit++) {
+		edit_kind kind = (edit_kind)(edit % edit_kind_count);
+		if (!apply_edit(&source, kind, &random_state)) continue;
+		edits_made++;
+
+		size_t edited_size;
+		char* edited = join_lines(&source, &edited_size);
+
+		kvm_assembly assembly, cached_assembly;
+		int result = kvm_assemble(edited, edited_size, INSTRUCTION_ROM_MEM_LOC, &assembly);
+		int cached_result = kvm_assemble_cached(cache, edited, edited_size, &cached_assembly);
+
+		if (result != cached_result) {
+			printf("FAIL %s: after edit %d (%s), kvm_assemble() returned %d and kvm_assemble_cached() returned %d.\n", filename, edit + 1, edit_names[kind], result, cached_result);
+			failures++;
+		}
+		else if (result == 0 && find_mismatch(&cached_assembly, (const char*)assembly.bytes, assembly.size) != assembly.size) {
+			printf("FAIL %s: after edit %d (%s), cached assembly is different.\n", filename, edit + 1, edit_names[kind]);
+			failures++;
+		}
+
+		kvm_assembly_free(&assembly);
+		kvm_assembly_free(&cached_assembly);
+		free(edited);
+	}
+	lines_free(&source);
+
+	// Going back to the unedited program has to give the original bytes again.
+	kvm_assembly assembly;
+	if (kvm_assemble_cached(cache, text, size, &assembly) != 0 || find_mismatch(&assembly, expected, expected_size) != expected_size) {
+		printf("FAIL %s: cached assembly is different after undoing the edits.\n", filename);
+		failures++;
+	}
+	kvm_assembly_free(&assembly);
+
+	if (!failures) printf("OK   %s, %d edits\n", filename, edits_made);
+	return failures;
+}
+
+#pragma endregion
+
+/* Usage: test_assembler <source.txt> <expected.kvmbin> [<source.txt> <expected.kvmbin> ...]
+*  Make the expected files with: python assembler.py <source.txt> 57344
+*/
+int main(int argc, char* argv[]) {
+	if (argc < 3 || argc % 2 == 0) {
+		printf("Usage: test_assembler <source.txt> <expected.kvmbin> [...]\n");
+		return -1;
+	}
+
+	int failures = 0;
+	kvm_assembler_cache* cache = kvm_assembler_cache_create(INSTRUCTION_ROM_MEM_LOC);
+	for (int i = 1; i + 1 < argc; i += 2) {
+		size_t source_size, expected_size;
+		char* source = read_file(argv[i], &source_size);
+		char* expected = read_file(argv[i + 1], &expected_size);
+		if (!source || !expected) {
+			if (source) free(source);
+			if (expected) free(expected);
+			failures++;
+			continue;
+		}
+
+		kvm_assembly assembly;
+		if (kvm_assemble(source, source_size, INSTRUCTION_ROM_MEM_LOC, &assembly) != 0) {
+			printf("FAIL %s: didn't assemble.\n", argv[i]);
+			failures++;
+		}
+		else if (assembly.size != expected_size) {
+			printf("FAIL %s: %d bytes, expected %d.\n", argv[i], (int)assembly.size, (int)expected_size);
+			failures++;
+		}
+		else {
+			size_t mismatch = find_mismatch(&assembly, expected, expected_size);
+			if (mismatch < expected_size) {
+				printf("FAIL %s: byte %d is %02X, expected %02X.\n", argv[i], (int)mismatch, assembly.bytes[mismatch], (uint8_t)expected[mismatch]);
+				failures++;
+			}
+			else {
+				printf("OK   %s (%d bytes)\n", argv[i], (int)expected_size);
+			}
+		}
+		kvm_assembly_free(&assembly);
+
+		for (int pass = 0; pass < 2; pass++) {
+			if (kvm_assemble_cached(cache, source, source_size, &assembly) != 0) {
+				printf("FAIL %s: didn't assemble with the cache (pass %d).\n", argv[i], pass + 1);
+				failures++;
+			}
+			else if (find_mismatch(&assembly, expected, expected_size) != expected_size) {
+				printf("FAIL %s: cached assembly is different (pass %d).\n", argv[i], pass + 1);
+				failures++;
+			}
+			kvm_assembly_free(&assembly);
+		}
+
+		failures += run_edit_tests(cache, argv[i], source, source_size, expected, expected_size);
+
+		free(source);
+		free(expected);
+	}
+
+	kvm_assembler_cache_free(cache);
+
+	print_allocation_data();
+	clean_allocation();
+	return failures ? 1 : 0;
+}
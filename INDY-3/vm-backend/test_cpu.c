@@ -9,17 +9,391 @@
 
 #include "kvm_cpu.h"
 #include "kvm_memory.h"
+#include "kvm_assembler.h"
 
 #include "kvm_mem_map_constants.h"
 
 void quit(void);
 
+static bool cpus_match(kvm_cpu* a, kvm_memory* a_mem, kvm_cpu* b, kvm_memory* b_mem) {
+	return a->program_counter == b->program_counter
+		&& a->accumulator == b->accumulator
+		&& a->x_index == b->x_index
+		&& a->y_index == b->y_index
+		&& a->stack_ptr == b->stack_ptr
+		&& a->processor_status == b->processor_status
+		&& memcmp(a_mem->data, b_mem->data, a_mem->size) == 0;
+}
+
+#pragma region Lockstep Tests
+
+/*	Lockstep tests for every core.
+*	The core being tested runs a built in program through kvm_cpu_run() with a different budget each time, and after every call
+*	a switch core CPU runs the same number of cycles. Registers, memory, and what a write hook saw have to match after every call.
+*	Programs with a check function also have to leave the right results behind, which is what tests the switch core itself.
+*	The programs loop long enough for their blocks to get compiled at the default KVM_JIT_HOT_THRESHOLD. Building everything
+*	with a lower one (like /DKVM_JIT_HOT_THRESHOLD=2) compiles blocks before the programs start changing them.
+*/
+
+#define LOCKSTEP_WATCHED_PAGE 0x30
+#define LOCKSTEP_MAX_CYCLES 1000000
+
+// Counts writes to the page the programs use as a stand-in for VRAM.
+typedef struct lockstep_watch {
+	size_t write_count;
+	uint64_t write_hash;
+} lockstep_watch;
+
+static void on_watched_write(void* userdata, size_t address, size_t length) {
+	lockstep_watch* watch = (lockstep_watch*)userdata;
+	watch->write_count++;
+	watch->write_hash = (watch->write_hash ^ (address * 31 + length)) * 1099511628211ULL;
+}
+
+typedef struct lockstep_program {
+	const char* name;
+	const char* source;
+	bool (*check)(const kvm_memory* mem);	// Checks what the program left in memory. Can be NULL.
+} lockstep_program;
+
+// What the math unit has to give for each case in the math unit program, in the order the program runs them.
+typedef struct math_case {
+	uint16_t a, b;
+	uint32_t product;
+	uint16_t quotient, remainder, sum, difference;
+	uint8_t carry, compare, compare_signed;
+} math_case;
+
+static const math_case math_cases[] = {
+	{ 0x04D2, 0x0000, 0x00000000, 0xFFFF, 0x04D2, 0x04D2, 0x04D2, 0x00, 0x01, 0x01 },
+	{ 0xFFF0, 0x0020, 0x001FFE00, 0x07FF, 0x0010, 0x0010, 0xFFD0, 0x01, 0x01, 0xFF },
+	{ 0x0005, 0x0300, 0x00000F00, 0x0000, 0x0005, 0x0305, 0xFD05, 0x02, 0xFF, 0xFF },
+	{ 0x8000, 0x7FFF, 0x3FFF8000, 0x0001, 0x0001, 0xFFFF, 0x0001, 0x00, 0x01, 0xFF },
+	{ 0x1234, 0x1234, 0x014B5A90, 0x0001, 0x0000, 0x2468, 0x0000, 0x00, 0x00, 0x00 },
+	{ 0x8000, 0x9000, 0x48000000, 0x0000, 0x8000, 0x1000, 0xF000, 0x03, 0xFF, 0xFF },
+};
+
+static uint16_t read16(const uint8_t* data) {
+	return data[0] | ((uint16_t)data[1] << 8);
+}
+
+// The program copies the 15 result bytes of each case to 0x0400, and the status after loading the compare byte to 0x0500.
+static bool check_math_results(const kvm_memory* mem) {
+	bool passed = true;
+	for (int i = 0; i < (int)(sizeof(math_cases) / sizeof(math_cases[0])); i++) {
+		const math_case* expected = &math_cases[i];
+		const uint8_t* results = mem->data + 0x0400 + i * 15;
+		uint8_t status = mem->data[0x0500 + i];
+
+		uint8_t expected_flags = expected->compare == 0 ? CPU_ZERO_FLAG : (expected->compare == 0xFF ? CPU_NEGATIVE_FLAG : 0);
+
+		if ((read16(results) | ((uint32_t)read16(results + 2) << 16)) != expected->product
+			|| read16(results + 4) != expected->quotient
+			|| read16(results + 6) != expected->remainder
+			|| read16(results + 8) != expected->sum
+			|| read16(results + 10) != expected->difference
+			|| results[12] != expected->carry
+			|| results[13] != expected->compare
+			|| results[14] != expected->compare_signed
+			|| (status & (CPU_ZERO_FLAG | CPU_NEGATIVE_FLAG)) != expected_flags) {
+			printf("Math unit case %d (A = %04X, B = %04X) gave the wrong results.\n", i, expected->a, expected->b);
+			passed = false;
+		}
+	}
+	return passed;
+}
+
+static const lockstep_program lockstep_programs[] = {
+	{ "self modifying stores",
+		".watched $3000\n"
+		".inner_count $10\n"
+		".outer_count $11\n"
+		"JMP start\n"
+		// A subroutine, so blocks end in JSR and RTS too.
+		".mix\n"
+		"    XOR watched x\n"
+		"    STA watched x\n"
+		"    RTS\n"
+		".start\n"
+		"    LDA #64\n"
+		"    STA outer_count\n"
+		".outer\n"
+		"    LDA #40\n"
+		"    STA inner_count\n"
+		".inner\n"
+		// Flipped between INX and INY at the end of every outer pass.
+		".patch_op\n"
+		"    INX\n"
+		// The immediate goes up by one every outer pass.
+		".patch_imm\n"
+		"    ADC #1\n"
+		"    JSR mix\n"
+		"    STA watched x\n"
+		"    DEC inner_count\n"
+		"    BNE inner\n"
+		// Patch the next instruction in the same block, it becomes INX or INY.
+		"    TXA\n"
+		"    AND #1\n"
+		"    ORA #$28\n"
+		"    STA same_block_op\n"
+		".same_block_op\n"
+		"    NOP\n"
+		// Patch the inner loop, which is already cached.
+		"    LDA patch_op\n"
+		"    XOR #1\n"
+		"    STA patch_op\n"
+		"    LDX #1\n"
+		"    INC patch_imm x\n"
+		// Print syscall, the test clears it.
+		"    LDA #2\n"
+		"    STA 0\n"
+		"    DEC outer_count\n"
+		"    BNE outer\n"
+		"    LDA #1\n"
+		"    STA 0\n"
+		".halt\n"
+		"    JMP halt\n",
+		NULL },
+	{ "store into a cached block",
+		".count $12\n"
+		"JMP start\n"
+		// Cached after the first call, then cut short and grown back by the stores below.
+		".step\n"
+		"    INX\n"
+		".step_patch\n"
+		"    INY\n"
+		"    INY\n"
+		"    RTS\n"
+		".start\n"
+		"    LDA #200\n"
+		"    STA count\n"
+		".loop\n"
+		"    JSR step\n"
+		// Every eighth pass, swap the first INY for an RTS or back.
+		"    LDA count\n"
+		"    AND #7\n"
+		"    BNE skip\n"
+		"    LDA step_patch\n"
+		"    XOR #$2B\n"
+		"    STA step_patch\n"
+		".skip\n"
+		"    DEC count\n"
+		"    BNE loop\n"
+		"    LDA #1\n"
+		"    STA 0\n"
+		".halt\n"
+		"    JMP halt\n",
+		NULL },
+	{ "math unit",
+		".math_a $7E00\n"
+		".math_a_hi $7E01\n"
+		".math_b $7E02\n"
+		".math_b_hi $7E03\n"
+		".math_results $7E04\n"
+		".math_compare $7E11\n"
+		".results $0400\n"
+		".flags $0500\n"
+		".passes $13\n"
+		".case_index $14\n"
+		"JMP start\n"
+		// Store the high byte of B from A, then save what the unit came up with.
+		".finish\n"
+		"    STA math_b_hi\n"
+		// Loaded in the same block as the store, so it has to see the new result.
+		"    LDA math_compare\n"
+		"    PHP\n"
+		"    PLA\n"
+		"    LDX case_index\n"
+		"    STA flags x\n"
+		"    LDX #0\n"
+		".save_loop\n"
+		"    LDA math_results x\n"
+		"    STA results y\n"
+		"    INX\n"
+		"    INY\n"
+		"    CPX #15\n"
+		"    BNE save_loop\n"
+		"    INC case_index\n"
+		"    RTS\n"
+		".start\n"
+		"    LDA #20\n"
+		"    STA passes\n"
+		".pass\n"
+		"    LDY #0\n"
+		"    LDA #0\n"
+		"    STA case_index\n"
+		// A = $04D2, B = $0000: B = 0
+		"    LDA #$D2\n"
+		"    STA math_a\n"
+		"    LDA #$04\n"
+		"    STA math_a_hi\n"
+		"    LDA #$00\n"
+		"    STA math_b\n"
+		"    LDA #$00\n"
+		"    JSR finish\n"
+		// A = $FFF0, B = $0020: A + B carries, signed A < B
+		"    LDA #$F0\n"
+		"    STA math_a\n"
+		"    LDA #$FF\n"
+		"    STA math_a_hi\n"
+		"    LDA #$20\n"
+		"    STA math_b\n"
+		"    LDA #$00\n"
+		"    JSR finish\n"
+		// A = $0005, B = $0300: A - B borrows
+		"    LDA #$05\n"
+		"    STA math_a\n"
+		"    LDA #$00\n"
+		"    STA math_a_hi\n"
+		"    LDA #$00\n"
+		"    STA math_b\n"
+		"    LDA #$03\n"
+		"    JSR finish\n"
+		// A = $8000, B = $7FFF: unsigned A > B, signed A < B
+		"    LDA #$00\n"
+		"    STA math_a\n"
+		"    LDA #$80\n"
+		"    STA math_a_hi\n"
+		"    LDA #$FF\n"
+		"    STA math_b\n"
+		"    LDA #$7F\n"
+		"    JSR finish\n"
+		// A = $1234, B = $1234: A == B
+		"    LDA #$34\n"
+		"    STA math_a\n"
+		"    LDA #$12\n"
+		"    STA math_a_hi\n"
+		"    LDA #$34\n"
+		"    STA math_b\n"
+		"    LDA #$12\n"
+		"    JSR finish\n"
+		// A = $8000, B = $9000: carries and borrows
+		"    LDA #$00\n"
+		"    STA math_a\n"
+		"    LDA #$80\n"
+		"    STA math_a_hi\n"
+		"    LDA #$00\n"
+		"    STA math_b\n"
+		"    LDA #$90\n"
+		"    JSR finish\n"
+		"    DEC passes\n"
+		"    BNE pass\n"
+		"    LDA #1\n"
+		"    STA 0\n"
+		".halt\n"
+		"    JMP halt\n",
+		check_math_results },
+};
+
+static bool run_lockstep_test(kvm_cpu_core core, const char* core_name, const lockstep_program* program) {
+	kvm_assembly assembly;
+	if (kvm_assemble(program->source, strlen(program->source), INSTRUCTION_ROM_MEM_LOC, &assembly) != 0) {
+		printf("Lockstep test '%s' didn't assemble.\n", program->name);
+		return false;
+	}
+
+	kvm_memory* mem = kvm_memory_init(0xFFFF, 0);
+	kvm_memory* check_mem = kvm_memory_init(0xFFFF, 0);
+	kvm_cpu* cpu = kvm_cpu_init();
+	kvm_cpu* check_cpu = kvm_cpu_init();
+	kvm_cpu_set_core(cpu, core);
+	kvm_cpu_set_core(check_cpu, kvm_core_switch);
+
+	memcpy(mem->data + INSTRUCTION_ROM_MEM_LOC, assembly.bytes, assembly.size);
+	memcpy(check_mem->data + INSTRUCTION_ROM_MEM_LOC, assembly.bytes, assembly.size);
+	kvm_assembly_free(&assembly);
+
+	lockstep_watch watch = { 0, 0 };
+	lockstep_watch check_watch = { 0, 0 };
+	kvm_memory_watch_pages(mem, kvm_memory_add_write_hook(mem, on_watched_write, &watch), LOCKSTEP_WATCHED_PAGE, 1, true);
+	kvm_memory_watch_pages(check_mem, kvm_memory_add_write_hook(check_mem, on_watched_write, &check_watch), LOCKSTEP_WATCHED_PAGE, 1, true);
+
+	// Mix short runs that end mid block with long ones that only stop at syscalls.
+	static const int budgets[] = { 1, 5, 0, 2, 37, 0, 3, 200 };
+
+	bool passed = false;
+	size_t cycle_count = 0;
+	for (int call = 0; cycle_count < LOCKSTEP_MAX_CYCLES; call++) {
+		int ran = kvm_cpu_run(cpu, mem, budgets[call % (sizeof(budgets) / sizeof(budgets[0]))]);
+		for (int i = 0; i < ran; i++) {
+			kvm_cpu_cycle(check_cpu, check_mem);
+		}
+		cycle_count += ran;
+
+		if (!cpus_match(cpu, mem, check_cpu, check_mem) || mem->syscall_pending != check_mem->syscall_pending
+			|| watch.write_count != check_watch.write_count || watch.write_hash != check_watch.write_hash) {
+			printf("Lockstep test '%s': %s and switch cores differ after %d cycles.\n", program->name, core_name, (int)cycle_count);
+			printf("\n%s:\n", core_name);
+			kvm_cpu_print_status(cpu);
+			printf("\nSwitch:\n");
+			kvm_cpu_print_status(check_cpu);
+			break;
+		}
+
+		if (mem->syscall_pending) {
+			if (mem->data[0] == 1) {
+				passed = !program->check || program->check(mem);
+				break;
+			}
+
+			// Clear it the way kvm_run() does.
+			mem->data[0] = 0;
+			check_mem->data[0] = 0;
+			mem->syscall_pending = false;
+			check_mem->syscall_pending = false;
+			kvm_memory_notify_write(mem, 0, 1);
+			kvm_memory_notify_write(check_mem, 0, 1);
+		}
+	}
+
+	if (!passed && cycle_count >= LOCKSTEP_MAX_CYCLES) {
+		printf("Lockstep test '%s' on the %s core didn't finish in %d cycles.\n", program->name, core_name, LOCKSTEP_MAX_CYCLES);
+	}
+
+	kvm_cpu_free(cpu);
+	kvm_cpu_free(check_cpu);
+	kvm_memory_free(mem);
+	kvm_memory_free(check_mem);
+
+	return passed;
+}
+
+// Returns the number of tests that failed.
+static int run_lockstep_tests(void) {
+	int failed = 0;
+	for (size_t i = 0; i < sizeof(lockstep_programs) / sizeof(lockstep_programs[0]); i++) {
+		if (!run_lockstep_test(kvm_core_switch, "Switch", &lockstep_programs[i])) failed++;
+		if (!run_lockstep_test(kvm_core_threaded, "Threaded", &lockstep_programs[i])) failed++;
+		if (!run_lockstep_test(kvm_core_block, "Block", &lockstep_programs[i])) failed++;
+		if (!run_lockstep_test(kvm_core_jit, "JIT", &lockstep_programs[i])) failed++;
+	}
+
+	printf("Lockstep tests: %d failed.\n", failed);
+	return failed;
+}
+
+#pragma endregion
+
 int main(int argc, char* argv[]) {
-	
-	kvm_memory* mem = kvm_memory_init(0x1000, 0);
+
+	// The lockstep tests run first. Pass -lockstep to stop after them.
+	if (run_lockstep_tests() != 0) return -1;
+	if (argc > 1 && strcmp(argv[1], "-lockstep") == 0) {
+		quit();
+		return 0;
+	}
+
+	kvm_memory* mem = kvm_memory_init(0xFFFF, 0);
 	kvm_cpu* cpu = kvm_cpu_init();
 
-	if (mem && cpu && cpu->current_instruction) {
+	// A second CPU runs the same program on the switch core, so the two cores can be checked against each other.
+	kvm_memory* check_mem = kvm_memory_init(0xFFFF, 0);
+	kvm_cpu* check_cpu = kvm_cpu_init();
+
+	kvm_cpu_set_core(cpu, kvm_core_threaded);
+	kvm_cpu_set_core(check_cpu, kvm_core_switch);
+
+	if (mem && cpu && cpu->current_instruction && check_mem && check_cpu) {
 		//printf("Success!\nInstruction size: %d\nMemory size: %llu\n\n", (int)cpu->current_instruction->instruction_size, (unsigned long long)mem->size);
 	}
 	else {
@@ -81,6 +455,8 @@ int main(int argc, char* argv[]) {
 	fread(mem->data + INSTRUCTION_ROM_MEM_LOC, 1, file_size, code_file);
 	fclose(code_file);
 
+	memcpy(check_mem->data, mem->data, mem->size);
+
 	
 	/*
 	for (int i = 0; i < 10; i++) {
@@ -97,8 +473,23 @@ int main(int argc, char* argv[]) {
 	bool cpu_running = true;
 	while (cpu_running) {
 		kvm_cpu_cycle(cpu, mem);
+		kvm_cpu_cycle(check_cpu, check_mem);
+
+		if (!cpus_match(cpu, mem, check_cpu, check_mem)) {
+			printf("Threaded and switch cores differ after %d cycles.\n", (int)cycle_count);
+			printf("\nThreaded:\n");
+			kvm_cpu_print_status(cpu);
+			printf("\nSwitch:\n");
+			kvm_cpu_print_status(check_cpu);
+			break;
+		}
+
+		if (mem->syscall_pending != check_mem->syscall_pending) {
+			printf("Threaded and switch cores disagree on a pending syscall after %d cycles.\n", (int)cycle_count);
+			break;
+		}
 
-		if (mem->data[0] > 0) {
+		if (mem->syscall_pending) {
 			switch (mem->data[0]) {
 			case 1: // Quit
 				cpu_running = false; break;
@@ -107,6 +498,9 @@ int main(int argc, char* argv[]) {
 				printf("\n");
 				kvm_cpu_print_status(cpu);
 				mem->data[0] = 0;
+				check_mem->data[0] = 0;
+				mem->syscall_pending = false;
+				check_mem->syscall_pending = false;
 				break;
 			}
 		}
@@ -123,6 +517,8 @@ int main(int argc, char* argv[]) {
 
 	kvm_cpu_free(cpu);
 	kvm_memory_free(mem);
+	kvm_cpu_free(check_cpu);
+	kvm_memory_free(check_mem);
 	quit();
 
 	return 0;
@@ -0,0 +1,431 @@
+/*	Test file for the graphics processor
+*	Draws random screens and checks them against the original per-pixel renderer, which is kept here as a reference.
+*	Then draws them with the scalar blitter and with every SIMD blitter this CPU has, which all have to come out the same, pixel for pixel.
+*	Author: Matthew Watson
+*/
+#include <SDL.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "leakcheck_util.h"
+#include "kvm_gpu.h"
+#include "kvm_memory.h"
+#include "kvm_mem_map_constants.h"
+
+static uint32_t random_state = 1;
+
+static uint32_t next_random(void) {
+	random_state ^= random_state << 13;
+	random_state ^= random_state >> 17;
+	random_state ^= random_state << 5;
+	return random_state;
+}
+
+static void write_random(kvm_memory* mem, uint16_t address, size_t length) {
+	for (size_t i = 0; i < length; i++) {
+		kvm_memory_write_byte(mem, (uint16_t)(address + i), (uint8_t)next_random());
+	}
+}
+
+// Write VRAM straight from the host side, the way the memory fill and copy syscalls do.
+static void write_from_host(kvm_memory* mem, uint16_t address, size_t length) {
+	if (next_random() & 1) {
+		memset(mem->data + address, (uint8_t)next_random(), length);
+	}
+	else {
+		for (size_t i = 0; i < length; i++) mem->data[address + i] = (uint8_t)next_random();
+	}
+	kvm_memory_notify_write(mem, address, length);
+}
+
+// Change a random part of VRAM, the way a program would between frames.
+static void scramble_vram(kvm_memory* mem) {
+	switch (next_random() % 7) {
+	case 0:
+		write_random(mem, GRAPHICS_ROM_MEM_LOC + (next_random() % 256) * 16, 16);
+		break;
+	case 1:
+		write_random(mem, VRAM_BGCOLOR, 3 + 192);
+		break;
+	case 2:
+		write_random(mem, VRAM_TILE_MAP_TABLE + next_random() % 1024, 64);
+		write_random(mem, VRAM_TILE_ATTRIBUTE_TABLE + next_random() % 1024, 64);
+		break;
+	case 3:
+		write_random(mem, VRAM_SPRITE_X_TABLE, 256 * 4);
+		break;
+	case 4:
+		write_random(mem, VRAM_TILE_LINE_SHIFT_TABLE, 32);
+		kvm_memory_write_byte(mem, VRAM_PERPENDICULAR_SCROLL, (uint8_t)next_random());
+		kvm_memory_write_byte(mem, VRAM_SCREEN_FLAGS, next_random() & 1);
+		break;
+	case 5: {
+		// Locks all on or all off take the scanline path, mixed ones the tile by tile path.
+		uint32_t pattern = next_random() % 3;
+		for (int i = 0; i < 32; i++) {
+			uint8_t lock = pattern == 2 ? ((next_random() % 3) ? 0 : 1) : (uint8_t)pattern;
+			kvm_memory_write_byte(mem, VRAM_TILE_LINE_LOCK_TABLE + i, lock);
+		}
+		break;
+	}
+	default: {
+		// Ranges that cross from one table into the next, or cover a whole table at once.
+		uint16_t address;
+		size_t length;
+		switch (next_random() % 4) {
+		case 0:
+			address = GRAPHICS_ROM_MEM_LOC + next_random() % 4096;
+			length = 1 + next_random() % 512;
+			if (address + length > GRAPHICS_ROM_MEM_LOC + 4096) length = GRAPHICS_ROM_MEM_LOC + 4096 - address;
+			break;
+		case 1:
+			address = VRAM_TILE_MAP_TABLE + next_random() % 2048;
+			length = 1 + next_random() % 1024;
+			if (address + length > VRAM_TILE_MAP_TABLE + 2048) length = VRAM_TILE_MAP_TABLE + 2048 - address;
+			break;
+		case 2:
+			address = VRAM_SPRITE_X_TABLE + next_random() % 1024;
+			length = 1 + next_random() % 512;
+			if (address + length > VRAM_SPRITE_X_TABLE + 1024) length = VRAM_SPRITE_X_TABLE + 1024 - address;
+			break;
+		default:
+			address = VRAM_BGCOLOR;
+			length = 3 + 192;
+			break;
+		}
+		write_from_host(mem, address, length);
+		break;
+	}
+	}
+}
+
+#pragma region Reference Renderer
+
+/*	The graphics processor's original renderer, which drew every tile and sprite a pixel at a time straight from VRAM.
+*	It has no caches to get out of date, so whatever the real one draws has to match it. Draws raw 0xRRGGBB colors into a 256x256 buffer.
+*/
+
+static uint8_t reference_extract_bits(uint8_t b, uint8_t mask, uint8_t shift) {
+	return (b & mask) >> shift;
+}
+
+static void reference_set_pixel(uint32_t* pixels, int x, int y, uint32_t color) {
+	pixels[(y % WINDOW_SIZE) * WINDOW_SIZE + (x % WINDOW_SIZE)] = color;
+}
+
+static void reference_render_tiles(uint32_t* pixels, const uint8_t* mem_data) {
+	const uint8_t* tile_map = mem_data + VRAM_TILE_MAP_TABLE;
+	const uint8_t* tile_attributes = mem_data + VRAM_TILE_ATTRIBUTE_TABLE;
+	const uint8_t* tile_rom = mem_data + GRAPHICS_ROM_MEM_LOC;
+	const uint8_t* palettes = mem_data + VRAM_COLOR_PALETTES;
+
+	uint8_t screen_flags = mem_data[VRAM_SCREEN_FLAGS];
+	const uint8_t* scroll_table = mem_data + VRAM_TILE_LINE_SHIFT_TABLE;
+	const uint8_t* lock_table = mem_data + VRAM_TILE_LINE_LOCK_TABLE;
+
+	uint8_t perpendicular_scroll = mem_data[VRAM_PERPENDICULAR_SCROLL];
+
+	const uint8_t* bg_color_ptr = mem_data + VRAM_BGCOLOR;
+	uint32_t bg_color = (bg_color_ptr[0] << 16) | (bg_color_ptr[1] << 8) | (bg_color_ptr[2]);
+
+	uint8_t scroll_mode = reference_extract_bits(screen_flags, 0b1, 0); // zero represents x-scroll, 1 is y-scroll
+
+	for (int tile_i = 0; tile_i < 1024; tile_i++) {
+		int t_x = (tile_i * 8) % 256;
+		int t_y = (tile_i * 8) / 256 * 8;
+
+		uint8_t t_xcoord = t_x >> 3;
+		uint8_t t_ycoord = t_y >> 3;
+
+		uint8_t x_scroll = 0;
+		uint8_t y_scroll = 0;
+		if (scroll_mode == 1) {
+			x_scroll = scroll_table[t_ycoord];
+
+			if (!lock_table[t_ycoord]) y_scroll = perpendicular_scroll;
+		}
+		else {
+			y_scroll = scroll_table[t_xcoord];
+
+			if (!lock_table[t_xcoord]) x_scroll = perpendicular_scroll;
+		}
+
+		uint8_t tile_id = tile_map[tile_i];
+		uint8_t attributes = tile_attributes[tile_i];
+
+		uint8_t fliph = reference_extract_bits(attributes, 0b10000000, 7);
+		uint8_t flipv = reference_extract_bits(attributes, 0b01000000, 6);
+		uint8_t mirror = reference_extract_bits(attributes, 0b00100000, 5);
+		uint8_t zeroc = reference_extract_bits(attributes, 0b00010000, 4);
+
+		uint8_t palette = reference_extract_bits(attributes, 0b00001111, 0);
+		int palette_ptr = palette * 12;
+
+		int tile_rom_ptr = tile_id * 16;
+
+		int x = 0, x_init = 0;
+		int y = 0;
+		int x_increment = 1;
+		int y_increment = 1;
+
+		if (fliph) {
+			x += 7;
+			x_init = 7;
+			x_increment = -1;
+		}
+
+		if (flipv) {
+			y += 7;
+			y_increment = -1;
+		}
+
+		int shift = 0;
+		int byte_offset = 0;
+		int bit_pos = 0;
+		int count = 0;
+
+		for (int pix_i = 0; pix_i < 64; pix_i++) {
+			uint8_t color_index = reference_extract_bits(tile_rom[tile_rom_ptr + byte_offset], 0b11 << shift, shift);
+
+			uint32_t color = bg_color;
+			if ((!zeroc || color_index != 0) && tile_id != 0xff) {
+				int i0 = palette_ptr + (3 * color_index);
+				color = (palettes[i0] << 16) | (palettes[i0 + 1] << 8) | (palettes[i0 + 2]);
+			}
+
+			if (mirror) {
+				reference_set_pixel(pixels, y + t_x + x_scroll, x + t_y + y_scroll, color);
+			}
+			else {
+				reference_set_pixel(pixels, x + t_x + x_scroll, y + t_y + y_scroll, color);
+			}
+
+			count++;
+			x += x_increment;
+			if (count > 7) {
+				x = x_init;
+				y += y_increment;
+				count = 0;
+			}
+
+			bit_pos++;
+			if (bit_pos > 3) {
+				bit_pos = 0;
+				byte_offset++;
+			}
+
+			shift += 2;
+			if (shift > 6) {
+				shift = 0;
+			}
+		}
+	}
+}
+
+static void reference_render_sprites(uint32_t* pixels, const uint8_t* mem_data) {
+	const uint8_t* sprite_x = mem_data + VRAM_SPRITE_X_TABLE;
+	const uint8_t* sprite_y = mem_data + VRAM_SPRITE_Y_TABLE;
+	const uint8_t* sprite_tiles = mem_data + VRAM_SPRITE_TILE_TABLE;
+	const uint8_t* sprite_attributes = mem_data + VRAM_SPRITE_ATTRIBUTE_TABLE;
+
+	const uint8_t* tile_rom = mem_data + GRAPHICS_ROM_MEM_LOC;
+	const uint8_t* palettes = mem_data + VRAM_COLOR_PALETTES;
+
+	for (int sprite_i = 0; sprite_i < 256; sprite_i++) {
+		uint8_t t_x = sprite_x[sprite_i];
+		uint8_t t_y = sprite_y[sprite_i];
+		if ((uint8_t)(t_x - 1) > 248 || (uint8_t)(t_y - 1) > 248) {
+			// Illegal sprite position, do not render.
+			continue;
+		}
+
+		uint8_t tile_id = sprite_tiles[sprite_i];
+		uint8_t attributes = sprite_attributes[sprite_i];
+
+		uint8_t fliph = reference_extract_bits(attributes, 0b10000000, 7);
+		uint8_t flipv = reference_extract_bits(attributes, 0b01000000, 6);
+		uint8_t mirror = reference_extract_bits(attributes, 0b00100000, 5);
+		uint8_t zeroc = reference_extract_bits(attributes, 0b00010000, 4);
+
+		uint8_t palette = reference_extract_bits(attributes, 0b00001111, 0);
+		int palette_ptr = palette * 12;
+
+		int tile_rom_ptr = tile_id * 16;
+
+		int x = 0, x_init = 0;
+		int y = 0;
+		int x_increment = 1;
+		int y_increment = 1;
+
+		if (fliph) {
+			x += 7;
+			x_init = 7;
+			x_increment = -1;
+		}
+
+		if (flipv) {
+			y += 7;
+			y_increment = -1;
+		}
+
+		int shift = 0;
+		int byte_offset = 0;
+		int bit_pos = 0;
+		int count = 0;
+
+		for (int pix_i = 0; pix_i < 64; pix_i++) {
+			uint8_t color_index = reference_extract_bits(tile_rom[tile_rom_ptr + byte_offset], 0b11 << shift, shift);
+
+			if (!zeroc || color_index != 0) {
+				int i0 = palette_ptr + (3 * color_index);
+				uint32_t color = (palettes[i0] << 16) | (palettes[i0 + 1] << 8) | (palettes[i0 + 2]);
+
+				if (mirror) {
+					reference_set_pixel(pixels, y + t_x, x + t_y, color);
+				}
+				else {
+					reference_set_pixel(pixels, x + t_x, y + t_y, color);
+				}
+			}
+
+			count++;
+			x += x_increment;
+			if (count > 7) {
+				x = x_init;
+				y += y_increment;
+				count = 0;
+			}
+
+			bit_pos++;
+			if (bit_pos > 3) {
+				bit_pos = 0;
+				byte_offset++;
+			}
+
+			shift += 2;
+			if (shift > 6) {
+				shift = 0;
+			}
+		}
+	}
+}
+
+#pragma endregion
+
+// Returns the number of frames that didn't match the reference renderer. Only the color is compared, the reference leaves alpha at zero.
+static int compare_reference(int frames) {
+	kvm_memory* mem = kvm_memory_init(0xFFFF, 0);
+	kvm_gpu* gpu = kvm_gpu_init(mem, true);
+	if (!gpu) {
+		printf("FAIL reference: couldn't start the GPU.\n");
+		kvm_memory_free(mem);
+		return 1;
+	}
+	kvm_gpu_set_blitter(gpu, kvm_gpu_blitter_scalar);
+
+	uint32_t* expected = malloc(WINDOW_SIZE * WINDOW_SIZE * sizeof(uint32_t));
+
+	random_state = 1;
+	write_random(mem, GRAPHICS_ROM_MEM_LOC, 4096);
+	write_random(mem, VRAM_BGCOLOR, 3 + 192);
+
+	int failures = 0;
+	for (int frame = 0; frame < frames; frame++) {
+		scramble_vram(mem);
+		kvm_gpu_refresh_graphics(gpu, mem);
+		reference_render_tiles(expected, mem->data);
+		reference_render_sprites(expected, mem->data);
+
+		SDL_Surface* actual = kvm_gpu_get_surface(gpu);
+		for (int y = 0; y < WINDOW_SIZE; y++) {
+			const uint32_t* expected_row = expected + y * WINDOW_SIZE;
+			const uint32_t* actual_row = (const uint32_t*)((const uint8_t*)actual->pixels + y * actual->pitch);
+
+			int x = 0;
+			while (x < WINDOW_SIZE && (actual_row[x] & 0x00FFFFFF) == expected_row[x]) x++;
+			if (x < WINDOW_SIZE) {
+				printf("FAIL reference: frame %d, pixel (%d, %d) is %06X, expected %06X.\n", frame, x, y, actual_row[x] & 0x00FFFFFF, expected_row[x]);
+				failures++;
+				break;
+			}
+		}
+	}
+
+	if (!failures) printf("OK   reference (%d frames)\n", frames);
+
+	free(expected);
+	kvm_gpu_quit(gpu);
+	kvm_memory_free(mem);
+	return failures;
+}
+
+// Returns the number of frames that didn't match the scalar blitter.
+static int compare_blitter(kvm_gpu_blitter blitter, const char* name, int frames) {
+	kvm_memory* mem = kvm_memory_init(0xFFFF, 0);
+	kvm_gpu* reference = kvm_gpu_init(mem, true);
+	kvm_gpu* tested = kvm_gpu_init(mem, true);
+	if (!reference || !tested) {
+		printf("FAIL %s: couldn't start the GPU.\n", name);
+		kvm_gpu_quit(reference);
+		kvm_gpu_quit(tested);
+		kvm_memory_free(mem);
+		return 1;
+	}
+
+	kvm_gpu_set_blitter(reference, kvm_gpu_blitter_scalar);
+	if (!kvm_gpu_set_blitter(tested, blitter)) {
+		printf("SKIP %s: not supported on this CPU.\n", name);
+		kvm_gpu_quit(reference);
+		kvm_gpu_quit(tested);
+		kvm_memory_free(mem);
+		return 0;
+	}
+
+	random_state = 1;
+	write_random(mem, GRAPHICS_ROM_MEM_LOC, 4096);
+	write_random(mem, VRAM_BGCOLOR, 3 + 192);
+
+	int failures = 0;
+	for (int frame = 0; frame < frames; frame++) {
+		scramble_vram(mem);
+		kvm_gpu_refresh_graphics(reference, mem);
+		kvm_gpu_refresh_graphics(tested, mem);
+
+		SDL_Surface* expected = kvm_gpu_get_surface(reference);
+		SDL_Surface* actual = kvm_gpu_get_surface(tested);
+		for (int y = 0; y < WINDOW_SIZE; y++) {
+			const uint32_t* expected_row = (const uint32_t*)((const uint8_t*)expected->pixels + y * expected->pitch);
+			const uint32_t* actual_row = (const uint32_t*)((const uint8_t*)actual->pixels + y * actual->pitch);
+			if (memcmp(expected_row, actual_row, WINDOW_SIZE * sizeof(uint32_t)) != 0) {
+				int x = 0;
+				while (expected_row[x] == actual_row[x]) x++;
+				printf("FAIL %s: frame %d, pixel (%d, %d) is %08X, expected %08X.\n", name, frame, x, y, actual_row[x], expected_row[x]);
+				failures++;
+				break;
+			}
+		}
+	}
+
+	if (!failures) printf("OK   %s (%d frames)\n", name, frames);
+
+	kvm_gpu_quit(reference);
+	kvm_gpu_quit(tested);
+	kvm_memory_free(mem);
+	return failures;
+}
+
+/* Usage: test_gpu [frames]
+*/
+int main(int argc, char* argv[]) {
+	int frames = argc > 1 ? atoi(argv[1]) : 1000;
+
+	int failures = 0;
+	failures += compare_reference(frames);
+	failures += compare_blitter(kvm_gpu_blitter_sse2, "sse2", frames);
+	failures += compare_blitter(kvm_gpu_blitter_avx2, "avx2", frames);
+
+	print_allocation_data();
+	clean_allocation();
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,122 @@
+/*	Test file for the built in graphics loader
+*	Checks kvm_bitmap_load(), kvm_convert_tiles(), and kvm_convert_palettes() against the .kvmpix and .kvmpal files
+*	made by graphics_loader.py, which they have to match byte for byte, and checks that sheets of the wrong size get rejected.
+*	Author: Matthew Watson
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "leakcheck_util.h"
+#include "kvm_graphics_loader.h"
+
+static bool ends_with(const char* text, const char* suffix) {
+	size_t length = strlen(text), suffix_length = strlen(suffix);
+	return length >= suffix_length && strcmp(text + length - suffix_length, suffix) == 0;
+}
+
+static char* read_file(const char* filename, size_t* out_size) {
+	FILE* file = fopen(filename, "rb");
+	if (!file) {
+		printf("Error opening %s.\n", filename);
+		return NULL;
+	}
+
+	fseek(file, 0L, SEEK_END);
+	size_t size = ftell(file);
+	rewind(file);
+
+	char* data = malloc(size + 1);
+	*out_size = fread(data, 1, size, file);
+	fclose(file);
+
+	return data;
+}
+
+// Convert the bitmap as tiles or palettes and compare it with the expected file. Returns the number of failures.
+static int check_conversion(const char* filename, const kvm_bitmap* bitmap, const char* expected_filename, bool tiles) {
+	size_t expected_size;
+	char* expected = read_file(expected_filename, &expected_size);
+	if (!expected) return 1;
+
+	size_t size = tiles ? KVM_TILE_DATA_SIZE : KVM_PALETTE_DATA_SIZE;
+	uint8_t* converted = malloc(size);
+
+	int failures = 0;
+	int result = tiles ? kvm_convert_tiles(bitmap, converted) : kvm_convert_palettes(bitmap, converted);
+	if (result != 0) {
+		printf("FAIL %s: didn't convert.\n", filename);
+		failures++;
+	}
+	else if (size != expected_size) {
+		printf("FAIL %s: %d bytes, expected %d.\n", filename, (int)size, (int)expected_size);
+		failures++;
+	}
+	else {
+		size_t mismatch = 0;
+		while (mismatch < size && converted[mismatch] == (uint8_t)expected[mismatch]) mismatch++;
+
+		if (mismatch < size) {
+			printf("FAIL %s: byte %d is %02X, expected %02X.\n", filename, (int)mismatch, converted[mismatch], (uint8_t)expected[mismatch]);
+			failures++;
+		}
+		else {
+			printf("OK   %s (%s)\n", filename, tiles ? "tiles" : "palettes");
+		}
+	}
+
+	free(converted);
+	free(expected);
+	return failures;
+}
+
+// The bitmap is the wrong size, so converting it has to fail. Returns the number of failures.
+static int check_rejected(const char* filename, const kvm_bitmap* bitmap, bool tiles) {
+	uint8_t converted[KVM_TILE_DATA_SIZE];
+	int result = tiles ? kvm_convert_tiles(bitmap, converted) : kvm_convert_palettes(bitmap, converted);
+	if (result != -1) {
+		printf("FAIL %s: %dx%d was accepted as %s.\n", filename, bitmap->width, bitmap->height, tiles ? "tiles" : "palettes");
+		return 1;
+	}
+
+	printf("OK   %s (rejected as %s)\n", filename, tiles ? "tiles" : "palettes");
+	return 0;
+}
+
+/* Usage: test_graphics_loader <bitmap.bmp> <expected.kvmpix | expected.kvmpal | -tiles | -palettes> [...]
+*  The kind of expected file says whether the bitmap is converted as tiles or palettes. -tiles and -palettes mean it has to be rejected.
+*  Make the expected files with: python graphics_loader.py <name> -1 (or -1 <name> for palettes), with the bitmap in graphics/.
+*/
+int main(int argc, char* argv[]) {
+	if (argc < 3 || argc % 2 == 0) {
+		printf("Usage: test_graphics_loader <bitmap.bmp> <expected.kvmpix | expected.kvmpal | -tiles | -palettes> [...]\n");
+		return -1;
+	}
+
+	int failures = 0;
+	for (int i = 1; i + 1 < argc; i += 2) {
+		const char* expected = argv[i + 1];
+
+		kvm_bitmap bitmap;
+		if (kvm_bitmap_load(argv[i], &bitmap) != 0) {
+			printf("FAIL %s: didn't decode.\n", argv[i]);
+			failures++;
+			continue;
+		}
+
+		if (strcmp(expected, "-tiles") == 0) failures += check_rejected(argv[i], &bitmap, true);
+		else if (strcmp(expected, "-palettes") == 0) failures += check_rejected(argv[i], &bitmap, false);
+		else if (ends_with(expected, ".kvmpix")) failures += check_conversion(argv[i], &bitmap, expected, true);
+		else if (ends_with(expected, ".kvmpal")) failures += check_conversion(argv[i], &bitmap, expected, false);
+		else {
+			printf("FAIL %s: don't know what kind of file %s is.\n", argv[i], expected);
+			failures++;
+		}
+
+		kvm_bitmap_free(&bitmap);
+	}
+
+	print_allocation_data();
+	clean_allocation();
+	return failures ? 1 : 0;
+}
@@ -2,11 +2,137 @@
 	Author: Matthew Watson
 */
 #include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
 
 #include "leakcheck_util.h"
 #include "kvm.h"
 #include "kvm_memory.h"
 
+#pragma region Syscall Tests
+
+// Registered by the syscall test as syscall 200, which tests/MemSyscalls.txt calls once.
+#define TEST_SYSCALL_ID 200
+
+typedef struct test_syscall_data {
+	int calls;
+	uint16_t address;
+} test_syscall_data;
+
+static void test_syscall(kvm_syscall_context* context) {
+	test_syscall_data* data = (test_syscall_data*)context->userdata;
+	data->calls++;
+	data->address = context->address;
+	context->memory[1] = 0x42;
+}
+
+// Returns 1 if the bytes at address aren't what's expected, 0 if they are.
+static int check_bytes(const uint8_t* memory, uint16_t address, const uint8_t* expected, size_t length, const char* what) {
+	for (size_t i = 0; i < length; i++) {
+		if (memory[address + i] != expected[i]) {
+			printf("FAIL %s: %04X is %02X, expected %02X.\n", what, (int)(address + i), memory[address + i], expected[i]);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int check_calls(kvm_context* kvm, uint8_t id, uint64_t expected) {
+	uint64_t calls = kvm_get_syscall_stats(kvm, id)->calls;
+	if (calls == expected) return 0;
+
+	printf("FAIL syscall %d was called %llu times, expected %llu.\n", id, (unsigned long long)calls, (unsigned long long)expected);
+	return 1;
+}
+
+// Run tests/MemSyscalls.txt (or whatever filename is) and check what it leaves in memory. Returns the number of failures.
+static int run_syscall_test(const char* filename, bool use_jit) {
+	int failures = 0;
+	test_syscall_data data = { 0, 0 };
+
+	kvm_context* kvm = kvm_context_create();
+	kvm_set_headless(kvm, true);
+	kvm_set_jit_enabled(kvm, use_jit);
+
+	if (kvm_register_syscall(kvm, 0, test_syscall, &data) != -1) {
+		printf("FAIL syscall ID 0 was accepted.\n");
+		failures++;
+	}
+	if (kvm_register_syscall(kvm, TEST_SYSCALL_ID, NULL, &data) != -1) {
+		printf("FAIL a NULL syscall handler was accepted.\n");
+		failures++;
+	}
+	// Before kvm_init(), which has to leave it alone.
+	if (kvm_register_syscall(kvm, TEST_SYSCALL_ID, test_syscall, &data) != 0) {
+		printf("FAIL couldn't register syscall %d.\n", TEST_SYSCALL_ID);
+		failures++;
+	}
+
+	if (kvm_init(kvm) != 0 || kvm_load_instructions(kvm, filename) != 0 || kvm_start(kvm, 100000) != 0) {
+		printf("FAIL couldn't run %s.\n", filename);
+		kvm_quit(kvm);
+		kvm_context_free(kvm);
+		return failures + 1;
+	}
+
+	const uint8_t* memory = kvm_get_memory_pointer(kvm);
+
+	// Status byte of every syscall, in the order the program makes them.
+	static const uint8_t statuses[] = {
+		0x00,	// Fill
+		0x00, 0x00, 0x00, 0x00,	// Copies, two of them overlapping
+		0x00,	// Strided fill
+		0xFF,	// Stride of 0
+		0x00,	// Strided fill of 0 bytes
+		0x00,	// Fill of 0 bytes
+		0xFF, 0xFF, 0xFF, 0xFF,	// Out of bounds fill, copy from, copy to, and strided fill
+		0x42,	// The registered syscall
+		0x00, 0x00	// Copy and fill over cached code
+	};
+	failures += check_bytes(memory, 0x0600, statuses, sizeof(statuses), "status");
+
+	static const uint8_t filled[] = { 0xAA, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA, 0x00 };
+	failures += check_bytes(memory, 0x0400, filled, sizeof(filled), "fill");
+
+	static const uint8_t copied_forward[] = { 1, 2, 1, 2, 3, 4, 5, 6 };
+	failures += check_bytes(memory, 0x0420, copied_forward, sizeof(copied_forward), "overlapping copy to a higher address");
+
+	static const uint8_t copied_backward[] = { 3, 4, 5, 6, 7, 8, 7, 8 };
+	failures += check_bytes(memory, 0x0430, copied_backward, sizeof(copied_backward), "overlapping copy to a lower address");
+
+	static const uint8_t strided[] = { 0x55, 0, 0, 0x55, 0, 0, 0x55, 0, 0, 0x55, 0 };
+	failures += check_bytes(memory, 0x0440, strided, sizeof(strided), "strided fill");
+
+	// Nothing the rejected or empty calls were pointed at can have changed.
+	static const uint8_t untouched[16] = { 0 };
+	failures += check_bytes(memory, 0x0450, untouched, 16, "rejected or empty fill");
+	failures += check_bytes(memory, 0x0460, untouched, 2, "rejected copy");
+	failures += check_bytes(memory, 0xFFF0, untouched, 15, "out of bounds syscall");
+
+	// The cached code has to be thrown away after each write.
+	static const uint8_t patched[] = { 0x11, 0x22, 0x33 };
+	failures += check_bytes(memory, 0x0470, patched, sizeof(patched), "copy and fill over cached code");
+
+	if (data.calls != 1 || data.address != 0x1234) {
+		printf("FAIL registered syscall was called %d times with %04X, expected once with 1234.\n", data.calls, data.address);
+		failures++;
+	}
+
+	failures += check_calls(kvm, 20, 7);	// Copy
+	failures += check_calls(kvm, 21, 4);	// Fill
+	failures += check_calls(kvm, 22, 4);	// Strided fill
+	failures += check_calls(kvm, TEST_SYSCALL_ID, 1);
+	failures += check_calls(kvm, 3, 0);		// Load graphics, never called
+
+	kvm_quit(kvm);
+	kvm_context_free(kvm);
+
+	if (!failures) printf("OK   %s%s\n", filename, use_jit ? " with the JIT" : "");
+	return failures;
+}
+
+#pragma endregion
+
 void quit_message(void) {
 	// Wait for the user to type something before quitting.
 	printf("Press [enter] to quit.\n");
@@ -14,47 +140,94 @@ void quit_message(void) {
 	getchar();
 }
 
+/* Usage: test_kvm [filename [-headless] [-input script_file] [-vsync] [-integer-scale] [-syscall-test]]
+*  With no arguments, asks for a file to run. Headless runs don't wait for the user at the end, so they can be run in bulk.
+*  -syscall-test runs filename (tests/MemSyscalls) with and without the JIT and checks the memory it leaves behind.
+*/
 int main(int argc, char* argv[]) {
+	char fname[50];
+	bool headless = false;
+	bool syscall_test = false;
 
-	// Get filename from user
-	printf("Files:\n");
-	system("dir tests /B");
+	kvm_context* kvm = kvm_context_create();
 
-	printf("Enter filename to assemble and run (omit '.txt'): ");
-	char fname[50];
+	if (argc > 1) {
+		strncpy(fname, argv[1], sizeof(fname) - 1);
+		fname[sizeof(fname) - 1] = '\0';
 
-	if (scanf("%s", fname) != 1) {
-		printf("Error with scanf, cannot read in fname.\n");
-		quit_message();
-		return -1;
+		for (int i = 2; i < argc; i++) {
+			if (strcmp(argv[i], "-headless") == 0) {
+				headless = true;
+			}
+			else if (strcmp(argv[i], "-vsync") == 0) {
+				kvm_set_vsync(kvm, true);
+			}
+			else if (strcmp(argv[i], "-integer-scale") == 0) {
+				kvm_set_integer_scale(kvm, true);
+			}
+			else if (strcmp(argv[i], "-syscall-test") == 0) {
+				syscall_test = true;
+			}
+			else if (strcmp(argv[i], "-input") == 0 && i + 1 < argc) {
+				if (kvm_set_input_script(kvm, argv[++i]) != 0) return -1;
+			}
+			else {
+				printf("Unknown argument %s.\n", argv[i]);
+				return -1;
+			}
+		}
+	}
+	else {
+		// Get filename from user
+		printf("Files:\n");
+		system("dir tests /B");
+
+		printf("Enter filename to assemble and run (omit '.txt'): ");
+
+		if (scanf("%s", fname) != 1) {
+			printf("Error with scanf, cannot read in fname.\n");
+			quit_message();
+			return -1;
+		}
 	}
 	printf("\nInstruction Filename: %s\n", fname);
 
-	if (kvm_init() != 0) return -1;
+	if (syscall_test) {
+		kvm_context_free(kvm);
+		int failures = run_syscall_test(fname, false) + run_syscall_test(fname, true);
+
+		print_allocation_data();
+		clean_allocation();
+		return failures ? 1 : 0;
+	}
+
+	kvm_set_headless(kvm, headless);
+	if (kvm_init(kvm) != 0) return -1;
 
-	if (kvm_load_instructions(fname) == -1) {
+	if (kvm_load_instructions(kvm, fname) == -1) {
 		printf("Error loading instruction file %s.\n", fname);
-		quit_message();
+		if (!headless) quit_message();
 		return -1;
 	}
 
 	// Actually run the KSU Micro VM
-	int kvm_run_result = kvm_start(-1);
+	int kvm_run_result = kvm_start(kvm, -1);
 
 	if (kvm_run_result == 0) {
-		printf("\nProcess Finished.\nFirst four pages of memory:\n");
-		kvm_hexdump(0, 4, true);
+		printf("\nProcess Finished after %u frames.\nFirst four pages of memory:\n", kvm_get_frame_count(kvm));
+		kvm_hexdump(kvm, 0, 4, true);
 
 		//printf("\n\nTile Data: \n");
-		//kvm_hexdump(0x84, 4, false);
+		//kvm_hexdump(kvm, 0x84, 4, false);
 	}
 
-	kvm_quit();
+	kvm_quit(kvm);
+	kvm_context_free(kvm);
 
 	// Finish up with the memory leak detection stuff.
 	print_allocation_data();
 	clean_allocation();
 
-	quit_message();
+	if (!headless) quit_message();
 	return 0;
 }
\ No newline at end of file